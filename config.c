@@ -23,44 +23,106 @@
 
 #include "p_libsupport.h"
 
+/* Sentinel default used to distinguish absent keys from NULL values */
+#define CONFIG_MISSING                 ((char *) -1)
+
+/* Space held by replaced values in the loaded configuration's string arena
+ * beyond which the arena is compacted
+ */
+#define CONFIG_COMPACT_WASTE           65536
+
+/* The layers from which a value in the merged configuration may have
+ * been taken, in increasing order of precedence
+ */
+#define CONFIG_LAYER_DEFAULT           1
+#define CONFIG_LAYER_FILE              2
+#define CONFIG_LAYER_OVERRIDE          3
+
+/* An immutable copy of the merged configuration, published atomically so
+ * that readers never need to take a lock; layer[n] records which layer
+ * supplied the value in slot n of the dictionary. lent is set once
+ * config_getptr_unlocked() has returned a pointer into it, after which
+ * it is kept (on config_lent, via next) until the configuration file is
+ * next loaded.
+ */
+struct config_snapshot_struct
+{
+	dictionary *merged;
+	unsigned char *layer;
+	int lent;
+	struct config_snapshot_struct *next;
+};
+
 static void config_thread_init_(void);
-static const char *config_get_unlocked_(const char *key, const char *defval);
+static int config_swap_(char *file, int (*fn)(const char *key, const char *oldval, const char *newval, void *data), void *data);
+static int config_diff_(dictionary *from, dictionary *to, dictionary *changes);
+static int config_merge_(void);
+static int config_merge_set_(const char *key, const char *value, int layer);
+static int config_publish_(void);
+static void config_snapshot_free_(void *ptr);
+static void config_snapshot_destroy_(struct config_snapshot_struct *snap);
+static const char *config_get_unlocked_(struct config_snapshot_struct *snap, const char *key, const char *defval);
+static const char *config_get_key_unlocked_(struct config_snapshot_struct *snap, struct config_key_struct *k, const char *defval);
+static size_t config_copy_(const char *value, char *buf, size_t bufsize);
+static int config_int_(const char *value, int defval);
+static int config_bool_(const char *value, int defval);
 static void config_logger_(const char *format, va_list args);
 
 static pthread_once_t config_control = PTHREAD_ONCE_INIT;
-static pthread_rwlock_t config_lock;
-	
+static struct snapshot_domain config_snapshots;
+static int config_log_category;
+
+/* Replaced snapshots into which config_getptr_unlocked() has returned
+ * pointers
+ */
+static struct config_snapshot_struct *config_lent;
+
+/* The master copies of the configuration, which may only be accessed
+ * by writers while holding the snapshot domain lock
+ */
 static dictionary *defaults;
 static dictionary *overrides;
 static dictionary *config;
+static char *config_path;
+
+/* The master merged view of defaults, config and overrides from which
+ * snapshots are copied, so that a reader finds any key with a single
+ * lookup; also only accessed with the snapshot domain lock held
+ */
+static dictionary *merged;
+static unsigned char *merged_layer;
+static int merged_size;
+
+/* Interned key handles, protected by the snapshot domain lock */
+static struct config_key_struct *config_keys;
 
 int
 config_init(int (*defaults_cb)(void))
 {
 	pthread_once(&config_control, config_thread_init_);
-	pthread_rwlock_wrlock(&config_lock);
+	snapshot_lock(&config_snapshots);
 	/* Defaults are the values used if no value is specified in the
 	 * configuration file.
 	 */
 	defaults = dictionary_new(0);
 	if(!defaults)
 	{
-		pthread_rwlock_unlock(&config_lock);
+		snapshot_unlock(&config_snapshots);
 		return -1;
 	}
 	/* Overrides are the values used regardless of defaults or the
-	 * the values present in the configuration file; the overrides
-	 * dictionary only exists until the configuration is loaded: after
-	 * that point, setting an override is simply a case of replacing
-	 * a value in the config dictionary.
+	 * the values present in the configuration file; once the
+	 * configuration is loaded, overrides are also applied directly to
+	 * the config dictionary, but are retained so that they can be
+	 * re-applied if the configuration file is reloaded.
 	 */
 	overrides = dictionary_new(0);
-	if(!overrides)
+	if(!overrides || config_merge_() || config_publish_())
 	{
-		pthread_rwlock_unlock(&config_lock);
+		snapshot_unlock(&config_snapshots);
 		return -1;
 	}
-	pthread_rwlock_unlock(&config_lock);
+	snapshot_unlock(&config_snapshots);
 	/* If a callback was specified to populate defaults, invoke it */
 	if(defaults_cb)
 	{
@@ -75,92 +137,128 @@ config_init(int (*defaults_cb)(void))
 int
 config_load(const char *default_path)
 {
-	int n;
 	const char *file;
+	char *path;
+	struct config_snapshot_struct master;
 	
 	pthread_once(&config_control, config_thread_init_);
-	pthread_rwlock_wrlock(&config_lock);
-	file = config_get_unlocked_("global:configFile", default_path);
-	log_printf(LOG_DEBUG, "loading configuration file '%s'\n", file);
-	config = iniparser_load(file);
-	if(!config)
+	snapshot_lock(&config_snapshots);
+	master.merged = merged;
+	master.layer = merged_layer;
+	file = config_get_unlocked_(&master, "global:configFile", default_path);
+	path = (file ? strdup(file) : NULL);
+	snapshot_unlock(&config_snapshots);
+	if(!path)
 	{
-		pthread_rwlock_unlock(&config_lock);
 		return -1;
 	}
-	for(n = 0; n < overrides->n; n++)
+	return config_swap_(path, NULL, NULL);
+}
+
+/* Re-read the configuration file most recently loaded by config_load()
+ * and replace the configuration with its contents, re-applying any
+ * values set with config_set(). Readers are never blocked: the file is
+ * parsed before any lock is taken, and the new configuration is published
+ * atomically.
+ *
+ * If fn is not NULL, it is invoked once for each key whose value changed,
+ * with oldval or newval being NULL where the key was added or removed.
+ * Sections themselves are not reported, only the keys within them, so
+ * a section added or removed is seen as its keys being added or removed.
+ * As with config_get_all(), the callback may halt iteration by returning
+ * non-zero; it is invoked after the new configuration has been published,
+ * and so may freely read from or write to it.
+ *
+ * The result is the number of keys which changed, or -1 if an error
+ * occurs (including if the callback returned an error).
+ */
+int
+config_reload(int (*fn)(const char *key, const char *oldval, const char *newval, void *data), void *data)
+{
+	char *path;
+
+	pthread_once(&config_control, config_thread_init_);
+	snapshot_lock(&config_snapshots);
+	path = (config_path ? strdup(config_path) : NULL);
+	snapshot_unlock(&config_snapshots);
+	if(!path)
 	{
-		iniparser_set(config, overrides->key[n], overrides->val[n]);
+		return -1;
 	}
-	dictionary_del(overrides);
-	overrides = NULL;
-	pthread_rwlock_unlock(&config_lock);
-	return 0;
+	return config_swap_(path, fn, data);
 }
 
 int
 config_set(const char *key, const char *value)
 {
+	int r;
+
 	pthread_once(&config_control, config_thread_init_);
-	pthread_rwlock_wrlock(&config_lock);
-	iniparser_set((overrides ? overrides : config), key, value);
-	pthread_rwlock_unlock(&config_lock);
-	return 0;
+	snapshot_lock(&config_snapshots);
+	r = iniparser_set((overrides ? overrides : config), key, value);
+	if(!r && overrides && config)
+	{
+		r = iniparser_set(config, key, value);
+	}
+	if(!r && config && config->waste > CONFIG_COMPACT_WASTE)
+	{
+		/* Readers only ever see snapshot copies, never the master, so
+		 * moving its strings is safe
+		 */
+		dictionary_compact(config);
+	}
+	if(!r && merged)
+	{
+		r = config_merge_set_(key, value, CONFIG_LAYER_OVERRIDE);
+	}
+	if(!r)
+	{
+		r = config_publish_();
+	}
+	snapshot_unlock(&config_snapshots);
+	return r;
 }
 
 int
 config_set_default(const char *key, const char *value)
 {
+	int r;
+
 	pthread_once(&config_control, config_thread_init_);
-	pthread_rwlock_wrlock(&config_lock);
+	snapshot_lock(&config_snapshots);
+	r = 0;
 	if(defaults)
 	{
-		iniparser_set(defaults, key, value);
+		r = iniparser_set(defaults, key, value);
+		if(!r)
+		{
+			r = config_merge_set_(key, value, CONFIG_LAYER_DEFAULT);
+		}
 	}
 	else if(!iniparser_getstring(config, key, NULL))
 	{
-		iniparser_set(config, key, value);
+		r = iniparser_set(config, key, value);
+		if(!r)
+		{
+			r = config_merge_();
+		}
 	}
-	pthread_rwlock_unlock(&config_lock);
-	return 0;
+	if(!r)
+	{
+		r = config_publish_();
+	}
+	snapshot_unlock(&config_snapshots);
+	return r;
 }
 
 size_t
 config_get(const char *key, const char *defval, char *buf, size_t bufsize)
 {
-	const char *ret;
 	size_t r;
 	
 	pthread_once(&config_control, config_thread_init_);
-	if(buf && bufsize)
-	{
-		*buf = 0;
-	}
-	pthread_rwlock_rdlock(&config_lock);
-	ret = config_get_unlocked_(key, defval);
-	if(ret)
-	{
-		r = strlen(ret) + 1;			
-	}
-	else
-	{
-		r = 0;
-	}	
-	if(!buf || !bufsize)
-	{
-		pthread_rwlock_unlock(&config_lock);
-		return r;
-	}
-	if(ret)
-	{
-		strncpy(buf, ret, bufsize);
-	}
-	else
-	{
-		buf[0] = 0;
-	}
-	buf[bufsize - 1] = 0;
-	pthread_rwlock_unlock(&config_lock);
+	r = config_copy_(config_get_unlocked_(snapshot_acquire(&config_snapshots), key, defval), buf, bufsize);
+	snapshot_release(&config_snapshots);
 	return r;
 }
 
@@ -169,13 +267,24 @@ config_get(const char *key, const char *defval, char *buf, size_t bufsize)
  * application.
  *
  * The result is a pointer to the string within the config data itself,
- * or defval if no match was found.
+ * or defval if no match was found. It remains valid until the
+ * configuration file is next loaded by config_load() or config_reload(),
+ * even if the configuration is changed meanwhile: the snapshot which it
+ * points into is kept until then.
  */
 const char *
 config_getptr_unlocked(const char *key, const char *defval)
 {
+	struct config_snapshot_struct *snap;
+
+	pthread_once(&config_control, config_thread_init_);
 	errno = 0;
-	return config_get_unlocked_(key, defval);
+	snap = (struct config_snapshot_struct *) snapshot_current(&config_snapshots);
+	if(snap)
+	{
+		__atomic_store_n(&(snap->lent), 1, __ATOMIC_RELAXED);
+	}
+	return config_get_unlocked_(snap, key, defval);
 }
 
 char *
@@ -185,10 +294,9 @@ config_geta(const char *key, const char *defval)
 	char *s;
 	
 	pthread_once(&config_control, config_thread_init_);
-	pthread_rwlock_rdlock(&config_lock);
 	/* Reset errno so that errors versus NULL returns can be distinguished */
 	errno = 0;
-	ret = config_get_unlocked_(key, defval);
+	ret = config_get_unlocked_(snapshot_acquire(&config_snapshots), key, defval);
 	if(ret)
 	{
 		s = strdup(ret);
@@ -197,55 +305,126 @@ config_geta(const char *key, const char *defval)
 	{
 		s = NULL;
 	}
-	pthread_rwlock_unlock(&config_lock);
+	snapshot_release(&config_snapshots);
 	return s;
 }
 
 int
 config_get_int(const char *key, int defval)
 {
-	const char *s;
 	int i;
 	
 	pthread_once(&config_control, config_thread_init_);
-	pthread_rwlock_rdlock(&config_lock);
-	s = config_get_unlocked_(key, NULL);
-	if(s)
-	{
-		i = atoi(s);
-	}
-	else
-	{
-		i = defval;
-	}
-	pthread_rwlock_unlock(&config_lock);
+	i = config_int_(config_get_unlocked_(snapshot_acquire(&config_snapshots), key, NULL), defval);
+	snapshot_release(&config_snapshots);
 	return i;
 }
 
 int
 config_get_bool(const char *key, int defval)
 {
-	const char *s;
-	int c, r;
+	int r;
 	
 	pthread_once(&config_control, config_thread_init_);
-	pthread_rwlock_rdlock(&config_lock);
-	s = config_get_unlocked_(key, NULL);
-	r = defval;
-	if(s)
+	r = config_bool_(config_get_unlocked_(snapshot_acquire(&config_snapshots), key, NULL), defval);
+	snapshot_release(&config_snapshots);
+	return r;
+}
+
+/* Resolve a key name into a handle which can be passed to the config_*_k()
+ * functions in place of the name, avoiding the need to hash the name and
+ * (usually) to search for it on each lookup. Handles are interned, so that
+ * resolving the same name twice yields the same handle, and are never
+ * freed; they are intended to be resolved once and kept, for example in a
+ * static variable.
+ *
+ * Returns NULL (with errno set) if the handle could not be allocated; the
+ * config_*_k() functions treat a NULL handle as naming a key which is
+ * never present.
+ */
+config_key_t
+config_key(const char *key)
+{
+	struct config_key_struct *k;
+
+	pthread_once(&config_control, config_thread_init_);
+	snapshot_lock(&config_snapshots);
+	for(k = config_keys; k; k = k->next)
 	{
-		c = toupper(s[0]);
-		if(c == 'Y' || c == 'T' || c == '1')
+		if(!strcmp(k->key, key))
 		{
-			r = -1;
-		}
-		else
-		{
-			r = atoi(s);
+			snapshot_unlock(&config_snapshots);
+			return k;
 		}
 	}
-	pthread_rwlock_unlock(&config_lock);
-	return r ? -1 : 0;
+	k = (struct config_key_struct *) calloc(1, sizeof(struct config_key_struct));
+	if(!k || !(k->key = strdup(key)))
+	{
+		free(k);
+		snapshot_unlock(&config_snapshots);
+		errno = ENOMEM;
+		return NULL;
+	}
+	k->hash = dictionary_hashl(key, &(k->len));
+	k->slot = -1;
+	k->next = config_keys;
+	config_keys = k;
+	snapshot_unlock(&config_snapshots);
+	return k;
+}
+
+size_t
+config_get_k(config_key_t key, const char *defval, char *buf, size_t bufsize)
+{
+	size_t r;
+	
+	pthread_once(&config_control, config_thread_init_);
+	r = config_copy_(config_get_key_unlocked_(snapshot_acquire(&config_snapshots), key, defval), buf, bufsize);
+	snapshot_release(&config_snapshots);
+	return r;
+}
+
+char *
+config_geta_k(config_key_t key, const char *defval)
+{
+	const char *ret;
+	char *s;
+	
+	pthread_once(&config_control, config_thread_init_);
+	errno = 0;
+	ret = config_get_key_unlocked_(snapshot_acquire(&config_snapshots), key, defval);
+	if(ret)
+	{
+		s = strdup(ret);
+	}
+	else
+	{
+		s = NULL;
+	}
+	snapshot_release(&config_snapshots);
+	return s;
+}
+
+int
+config_get_int_k(config_key_t key, int defval)
+{
+	int i;
+	
+	pthread_once(&config_control, config_thread_init_);
+	i = config_int_(config_get_key_unlocked_(snapshot_acquire(&config_snapshots), key, NULL), defval);
+	snapshot_release(&config_snapshots);
+	return i;
+}
+
+int
+config_get_bool_k(config_key_t key, int defval)
+{
+	int r;
+	
+	pthread_once(&config_control, config_thread_init_);
+	r = config_bool_(config_get_key_unlocked_(snapshot_acquire(&config_snapshots), key, NULL), defval);
+	snapshot_release(&config_snapshots);
+	return r;
 }
 
 /* Iterate configuration values in a section, optionally only those matching
@@ -254,9 +433,13 @@ config_get_bool(const char *key, int defval)
  * Iteration is halted early if the supplied callback function returns
  * non-zero.
  *
- * Note that the configuration is read-locked while iteration occurs:
- * other threads can read from, but are blocked from writing to, the
- * configuration.
+ * Only values from the configuration file or set by config_set() are
+ * visited: defaults are not.
+ *
+ * Iteration takes place over a snapshot of the configuration: other
+ * threads may continue to read from and write to the configuration while
+ * iteration occurs, but changes made after iteration has begun will not
+ * be seen by the callback.
  *
  * The result is the number of times the callback was invoked, or -1 if an
  * error occurs (including if the callback was invoked and returned an error).
@@ -265,25 +448,32 @@ int
 config_get_all(const char *section, const char *key, int (*fn)(const char *key, const char *value, void *data), void *data)
 {
 	int c;
+	struct config_snapshot_struct *snap;
 	dictionary *dict;
+	const char *colon;
 	size_t l;
 	int r, n;
 
-	if(section)
-	{
-		l = strlen(section);
-	}
 	pthread_once(&config_control, config_thread_init_);
-	pthread_rwlock_rdlock(&config_lock);
-	dict = (config ? config : overrides);
+	snap = (struct config_snapshot_struct *) snapshot_acquire(&config_snapshots);
 	n = 0;
-	for(c = 0; c < dict->n; c++)
+	dict = (snap ? snap->merged : NULL);
+	if(!dict)
+	{
+		snapshot_release(&config_snapshots);
+		return 0;
+	}
+	if(!section)
 	{
-		if(!section)
+		for(c = 0; c < dict->size; c++)
 		{
+			if(!dict->key[c] || snap->layer[c] == CONFIG_LAYER_DEFAULT)
+			{
+				continue;
+			}
 			n++;
 			r = fn(dict->key[c], dict->val[c], data);
-			if(r < 0)		   
+			if(r < 0)
 			{
 				n = -1;
 				break;
@@ -293,48 +483,430 @@ config_get_all(const char *section, const char *key, int (*fn)(const char *key,
 				break;
 			}
 		}
-		else if(!strncmp(dict->key[c], section, l) &&
-				dict->key[c][l] == ':')
+		snapshot_release(&config_snapshots);
+		return n;
+	}
+	/* Only visit the section's own entries, via the dictionary's section
+	 * index; a section name containing a colon is indexed under the part
+	 * preceding it, so the remainder still has to be matched
+	 */
+	l = strlen(section);
+	colon = strchr(section, ':');
+	for(c = dictionary_secfirst(dict, section, colon ? (int) (colon - section) : (int) l); c >= 0; c = dictionary_secnext(dict, c))
+	{
+		if(snap->layer[c] == CONFIG_LAYER_DEFAULT ||
+		   (colon && (strncmp(dict->key[c], section, l) || dict->key[c][l] != ':')))
 		{
-			if(!key || !strcmp(&(dict->key[c][l+1]), key))
+			continue;
+		}
+		if(!key || !strcmp(&(dict->key[c][l+1]), key))
+		{
+			n++;
+			r = fn(dict->key[c], dict->val[c], data);
+			if(r < 0)
+			{
+				n = -1;
+				break;
+			}
+			else if(r)
 			{
-				n++;
-				r = fn(dict->key[c], dict->val[c], data);
-				if(r < 0)
-				{
-					n = -1;
-					break;
-				}
-				else if(r)
-				{
-					break;
-				}
+				break;
 			}
 		}
 	}
-	pthread_rwlock_unlock(&config_lock);
+	snapshot_release(&config_snapshots);
 	return n;
 }
 
 static void
 config_thread_init_(void)
 {
-	pthread_rwlock_init(&config_lock, NULL);
+	snapshot_init(&config_snapshots, config_snapshot_free_);
+	config_log_category = log_category("config");
 	iniparser_setlogger(config_logger_);
 }
 
+/* Parse the configuration file at the (allocated) path, apply the
+ * overrides to it, and publish it as the new configuration, taking
+ * ownership of the path. If fn is not NULL, it is invoked for each key
+ * whose value differs from the configuration being replaced.
+ */
+static int
+config_swap_(char *file, int (*fn)(const char *key, const char *oldval, const char *newval, void *data), void *data)
+{
+	struct config_snapshot_struct *lent, *next;
+	dictionary *dict, *old, *changes;
+	int c, r, n;
+
+	LOG_CPRINTF(config_log_category, LOG_DEBUG, "loading configuration file '%s'\n", file);
+	dict = iniparser_load(file);
+	changes = (fn ? dictionary_new(0) : NULL);
+	if(!dict || (fn && !changes))
+	{
+		dictionary_del(dict);
+		dictionary_del(changes);
+		free(file);
+		return -1;
+	}
+	snapshot_lock(&config_snapshots);
+	for(c = 0; overrides && c < overrides->size; c++)
+	{
+		if(overrides->key[c] && iniparser_set(dict, overrides->key[c], overrides->val[c]))
+		{
+			break;
+		}
+	}
+	if((overrides && c < overrides->size) ||
+	   (changes && config_diff_(config, dict, changes)))
+	{
+		snapshot_unlock(&config_snapshots);
+		dictionary_del(dict);
+		dictionary_del(changes);
+		free(file);
+		return -1;
+	}
+	old = config;
+	config = dict;
+	if(config_merge_())
+	{
+		config = old;
+		snapshot_unlock(&config_snapshots);
+		dictionary_del(dict);
+		dictionary_del(changes);
+		free(file);
+		return -1;
+	}
+	free(config_path);
+	config_path = file;
+	r = config_publish_();
+	snapshot_unlock(&config_snapshots);
+	/* Pointers returned by config_getptr_unlocked() before now are no
+	 * longer valid
+	 */
+	for(lent = __atomic_exchange_n(&config_lent, NULL, __ATOMIC_ACQ_REL); lent; lent = next)
+	{
+		next = lent->next;
+		config_snapshot_destroy_(lent);
+	}
+	for(c = 0; !r && changes && c < changes->size; c++)
+	{
+		if(!changes->key[c])
+		{
+			continue;
+		}
+		r = fn(changes->key[c], iniparser_getstring(old, changes->key[c], NULL), changes->val[c], data);
+		if(r > 0)
+		{
+			break;
+		}
+	}
+	n = (changes ? changes->n : 0);
+	dictionary_del(old);
+	dictionary_del(changes);
+	if(r < 0)
+	{
+		return -1;
+	}
+	return n;
+}
+
+/* Record in changes every key whose value differs between two
+ * configurations, mapped to its new value (or NULL if it was removed);
+ * the entries for sections themselves, whose values are NULL, are skipped
+ */
+static int
+config_diff_(dictionary *from, dictionary *to, dictionary *changes)
+{
+	int c;
+	const char *oldval, *newval;
+
+	for(c = 0; c < to->size; c++)
+	{
+		if(!to->key[c] || !to->val[c])
+		{
+			continue;
+		}
+		newval = to->val[c];
+		oldval = iniparser_getstring(from, to->key[c], CONFIG_MISSING);
+		if(oldval == CONFIG_MISSING || !oldval || strcmp(oldval, newval))
+		{
+			if(dictionary_set(changes, to->key[c], newval))
+			{
+				return -1;
+			}
+		}
+	}
+	for(c = 0; from && c < from->size; c++)
+	{
+		if(from->key[c] && from->val[c] &&
+		   iniparser_getstring(to, from->key[c], CONFIG_MISSING) == CONFIG_MISSING)
+		{
+			if(dictionary_set(changes, from->key[c], NULL))
+			{
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Rebuild the master merged configuration from scratch; must be called
+ * with the snapshot domain lock held. Entries are added in the order of
+ * the configuration (or, before it is loaded, the overrides), so that
+ * iterating the merged view visits them in the same order; defaults not
+ * otherwise set follow.
+ */
+static int
+config_merge_(void)
+{
+	dictionary *old, *src;
+	unsigned char *oldlayer;
+	int oldsize, c, r;
+
+	old = merged;
+	oldlayer = merged_layer;
+	oldsize = merged_size;
+	merged = dictionary_new_arena(0);
+	merged_layer = (merged ? (unsigned char *) calloc(merged->size, 1) : NULL);
+	merged_size = (merged_layer ? merged->size : 0);
+	r = (merged_layer ? 0 : -1);
+	src = (config ? config : overrides);
+	for(c = 0; !r && src && c < src->size; c++)
+	{
+		if(src->key[c])
+		{
+			r = config_merge_set_(src->key[c], src->val[c], (src == config ? CONFIG_LAYER_FILE : CONFIG_LAYER_OVERRIDE));
+		}
+	}
+	for(c = 0; !r && config && overrides && c < overrides->size; c++)
+	{
+		if(overrides->key[c])
+		{
+			r = config_merge_set_(overrides->key[c], overrides->val[c], CONFIG_LAYER_OVERRIDE);
+		}
+	}
+	for(c = 0; !r && defaults && c < defaults->size; c++)
+	{
+		if(defaults->key[c])
+		{
+			r = config_merge_set_(defaults->key[c], defaults->val[c], CONFIG_LAYER_DEFAULT);
+		}
+	}
+	if(r)
+	{
+		dictionary_del(merged);
+		free(merged_layer);
+		merged = old;
+		merged_layer = oldlayer;
+		merged_size = oldsize;
+		return -1;
+	}
+	dictionary_del(old);
+	free(oldlayer);
+	return 0;
+}
+
+/* Set a value in the master merged configuration on behalf of a layer,
+ * unless a layer of higher precedence has already supplied it; must be
+ * called with the snapshot domain lock held.
+ */
+static int
+config_merge_set_(const char *key, const char *value, int layer)
+{
+	unsigned char *p;
+	unsigned hash;
+	int len, slot;
+
+	hash = dictionary_hashl(key, &len);
+	slot = dictionary_lookup(merged, key, len, hash, -1);
+	if(slot >= 0 && merged_layer[slot] > layer)
+	{
+		return 0;
+	}
+	if(dictionary_set(merged, key, value))
+	{
+		return -1;
+	}
+	if(slot < 0)
+	{
+		slot = dictionary_lookup(merged, key, len, hash, -1);
+	}
+	if(merged->size > merged_size)
+	{
+		p = (unsigned char *) realloc(merged_layer, merged->size);
+		if(!p)
+		{
+			dictionary_unset(merged, key);
+			return -1;
+		}
+		memset(p + merged_size, 0, merged->size - merged_size);
+		merged_layer = p;
+		merged_size = merged->size;
+	}
+	merged_layer[slot] = layer;
+	if(merged->waste > CONFIG_COMPACT_WASTE)
+	{
+		dictionary_compact(merged);
+	}
+	return 0;
+}
+
+/* Publish a new snapshot copied from the master merged configuration;
+ * must be called with the snapshot domain lock held.
+ */
+static int
+config_publish_(void)
+{
+	struct config_snapshot_struct *snap;
+
+	snap = (struct config_snapshot_struct *) calloc(1, sizeof(struct config_snapshot_struct));
+	if(!snap)
+	{
+		return -1;
+	}
+	if(merged)
+	{
+		snap->merged = dictionary_dup(merged);
+		snap->layer = (unsigned char *) malloc(merged->size);
+		if(!snap->merged || !snap->layer)
+		{
+			config_snapshot_destroy_(snap);
+			return -1;
+		}
+		memcpy(snap->layer, merged_layer, merged->size);
+	}
+	return snapshot_publish(&config_snapshots, snap);
+}
+
+/* Destroy a replaced snapshot once no reader has it pinned, unless
+ * config_getptr_unlocked() has returned a pointer into it
+ */
+static void
+config_snapshot_free_(void *ptr)
+{
+	struct config_snapshot_struct *snap;
+
+	snap = (struct config_snapshot_struct *) ptr;
+	if(!__atomic_load_n(&(snap->lent), __ATOMIC_RELAXED))
+	{
+		config_snapshot_destroy_(snap);
+		return;
+	}
+	snap->next = __atomic_load_n(&config_lent, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&config_lent, &(snap->next), snap, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void
+config_snapshot_destroy_(struct config_snapshot_struct *snap)
+{
+	dictionary_del(snap->merged);
+	free(snap->layer);
+	free(snap);
+}
+
+static const char *
+config_get_unlocked_(struct config_snapshot_struct *snap, const char *key, const char *defval)
+{
+	if(!snap)
+	{
+		return defval;
+	}
+	return iniparser_getstring(snap->merged, key, (char *) defval);
+}
+
+/* Look up a key by handle: as config_get_unlocked_(), but using the
+ * handle's precomputed hash, and trying the slot at which the key was
+ * last found before searching. Because snapshots preserve the slots of
+ * the master merged configuration, this remains correct until the key is
+ * removed or the configuration file is reloaded.
+ */
 static const char *
-config_get_unlocked_(const char *key, const char *defval)
+config_get_key_unlocked_(struct config_snapshot_struct *snap, struct config_key_struct *k, const char *defval)
+{
+	int hint, slot;
+
+	if(!snap || !snap->merged || !k)
+	{
+		return defval;
+	}
+	hint = __atomic_load_n(&(k->slot), __ATOMIC_RELAXED);
+	slot = dictionary_lookup(snap->merged, k->key, k->len, k->hash, hint);
+	if(slot < 0)
+	{
+		return defval;
+	}
+	if(slot != hint)
+	{
+		__atomic_store_n(&(k->slot), slot, __ATOMIC_RELAXED);
+	}
+	return snap->merged->val[slot];
+}
+
+/* Copy a value into a caller-supplied buffer, returning the size of
+ * buffer needed to hold it in full, or zero if it is NULL
+ */
+static size_t
+config_copy_(const char *value, char *buf, size_t bufsize)
 {
-	if(config)
+	size_t r;
+
+	if(value)
 	{
-		return iniparser_getstring(config, key, iniparser_getstring(defaults, key, (char *) defval));
+		r = strlen(value) + 1;
 	}
-	return iniparser_getstring(overrides, key, iniparser_getstring(defaults, key, (char *) defval));
+	else
+	{
+		r = 0;
+	}
+	if(!buf || !bufsize)
+	{
+		return r;
+	}
+	if(value)
+	{
+		strncpy(buf, value, bufsize);
+	}
+	else
+	{
+		buf[0] = 0;
+	}
+	buf[bufsize - 1] = 0;
+	return r;
+}
+
+static int
+config_int_(const char *value, int defval)
+{
+	if(value)
+	{
+		return atoi(value);
+	}
+	return defval;
+}
+
+static int
+config_bool_(const char *value, int defval)
+{
+	int c, r;
+
+	r = defval;
+	if(value)
+	{
+		c = toupper(value[0]);
+		if(c == 'Y' || c == 'T' || c == '1')
+		{
+			r = -1;
+		}
+		else
+		{
+			r = atoi(value);
+		}
+	}
+	return r ? -1 : 0;
 }
 
 static void
 config_logger_(const char *format, va_list args)
 {
-	log_vprintf(LOG_ERR, format, args);
+	log_vcprintf(config_log_category, LOG_ERR, format, args);
 }
@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /** Maximum value size for integers and doubles. */
@@ -29,6 +30,35 @@
 /** Invalid key token */
 #define DICT_INVALID_KEY    ((char*)-1)
 
+/** Hash index cell which has never held an entry */
+#define DICT_EMPTY          (-1)
+
+/** Hash index cell whose entry has been removed (tombstone) */
+#define DICT_DELETED        (-2)
+
+/** Minimal size of the section index */
+#define DICTMINSEC          16
+
+/** Size of string storage in each arena chunk */
+#define DICTCHUNKSZ         16384
+
+/** Multipliers for the key hash (the xxHash 64-bit primes) */
+#define DICT_P1     0x9E3779B185EBCA87ULL
+#define DICT_P2     0xC2B2AE3D27D4EB4FULL
+#define DICT_P3     0x165667B19E3779F9ULL
+#define DICT_P4     0x85EBCA77C2B2AE63ULL
+#define DICT_P5     0x27D4EB2F165667C5ULL
+
+/** Rotate a 64-bit value left */
+#define DICT_ROTL(x, r)     (((x) << (r)) | ((x) >> (64 - (r))))
+
+/*---------------------------------------------------------------------------
+                            Private variables
+ ---------------------------------------------------------------------------*/
+
+/** Per-process hash seed, chosen on first use (never zero once chosen) */
+static unsigned long long dict_seed ;
+
 /*---------------------------------------------------------------------------
                             Private functions
  ---------------------------------------------------------------------------*/
@@ -50,26 +80,546 @@ static void * mem_double(void * ptr, int size)
 
 /*-------------------------------------------------------------------------*/
 /**
-  @brief    Duplicate a string
-  @param    s String to duplicate
-  @return   Pointer to a newly allocated string, to be freed with free()
-
-  This is a replacement for strdup(). This implementation is provided
-  for systems that do not have it.
+  @brief    Add a chunk to a dictionary's arena
+  @param    d       Dictionary to extend
+  @param    size    Bytes of string storage required
+  @param    behind  Non-zero to insert the chunk after the current one
+  @return   Pointer to the new chunk, or NULL on failure
  */
 /*--------------------------------------------------------------------------*/
-static char * xstrdup(const char * s)
+static dictchunk * dict_chunk_new(dictionary * d, size_t size, int behind)
 {
-    char * t ;
-    if (!s)
+    dictchunk * c ;
+
+    c = (dictchunk *)malloc(sizeof(dictchunk) + size);
+    if (c==NULL) {
         return NULL ;
-    t = (char*)malloc(strlen(s)+1) ;
+    }
+    c->size = size ;
+    c->used = 0 ;
+    if (behind && d->chunks!=NULL) {
+        c->next = d->chunks->next ;
+        d->chunks->next = c ;
+    } else {
+        c->next = d->chunks ;
+        d->chunks = c ;
+    }
+    return c ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Allocate string storage for a dictionary
+  @param    d   Dictionary which will own the storage
+  @param    len Number of bytes required
+  @return   Pointer to the storage, or NULL on failure
+
+  Storage is taken from the dictionary's arena if it has one, otherwise
+  it is allocated with malloc().
+ */
+/*--------------------------------------------------------------------------*/
+static char * dict_alloc(dictionary * d, size_t len)
+{
+    dictchunk * c ;
+    char      * p ;
+
+    if (!d->arena) {
+        return (char *)malloc(len) ;
+    }
+    c = d->chunks ;
+    if (c==NULL || c->size - c->used < len) {
+        /* Large strings get a chunk of their own, so as not to abandon
+           the free space remaining in the current one */
+        if (len > DICTCHUNKSZ / 4) {
+            c = dict_chunk_new(d, len, 1);
+        } else {
+            c = dict_chunk_new(d, DICTCHUNKSZ, 0);
+        }
+        if (c==NULL) {
+            return NULL ;
+        }
+    }
+    p = (char *)(c + 1) + c->used ;
+    c->used += len ;
+    return p ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Determine whether a string lies in a dictionary's file image
+  @param    d   Dictionary to examine
+  @param    s   String to test
+  @return   int 1 if the string is borrowed from the file image, 0 otherwise
+ */
+/*--------------------------------------------------------------------------*/
+static int dict_inmap(dictionary * d, const char * s)
+{
+    return d->map!=NULL && s>=d->map && s<d->map+d->maplen ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Store a string in a dictionary
+  @param    d   Dictionary which will own the string
+  @param    s   String to store
+  @return   Pointer to the stored string, or NULL on failure
+
+  Strings which lie within the dictionary's file image are borrowed
+  as-is; any other string is copied, into the arena if there is one.
+ */
+/*--------------------------------------------------------------------------*/
+static char * dict_strdup(dictionary * d, const char * s)
+{
+    char  * t ;
+    size_t  len ;
+
+    if (dict_inmap(d, s)) {
+        return (char *)s ;
+    }
+    len = strlen(s) + 1 ;
+    t = dict_alloc(d, len);
     if (t) {
-        strcpy(t,s);
+        memcpy(t, s, len);
     }
     return t ;
 }
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Release a string stored in a dictionary
+  @param    d   Dictionary which owns the string
+  @param    s   String to release (may be NULL)
+  @return   void
+ */
+/*--------------------------------------------------------------------------*/
+static void dict_strfree(dictionary * d, char * s)
+{
+    if (s==NULL || dict_inmap(d, s)) {
+        return ;
+    }
+    if (d->arena) {
+        d->waste += strlen(s) + 1 ;
+        return ;
+    }
+    free(s);
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Count the bytes of string storage in use by a dictionary
+  @param    d   Dictionary to examine
+  @return   Number of bytes, excluding strings borrowed from the file image
+ */
+/*--------------------------------------------------------------------------*/
+static size_t dict_live(dictionary * d)
+{
+    size_t  live ;
+    int     i ;
+
+    live = 0 ;
+    for (i=0 ; i<d->size ; i++) {
+        if (d->key[i]!=NULL && !dict_inmap(d, d->key[i]))
+            live += strlen(d->key[i]) + 1 ;
+        if (d->val[i]!=NULL && !dict_inmap(d, d->val[i]))
+            live += strlen(d->val[i]) + 1 ;
+    }
+    for (i=0 ; i<d->nsec ; i++) {
+        live += d->sec[i].len + 1 ;
+    }
+    return live ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Obtain the per-process hash seed
+  @return   The seed, which is the same for every call within a process
+
+  The seed is chosen on first use, from /dev/urandom if possible and
+  otherwise from the time, process ID and stack address. Threads racing
+  to choose it agree on whichever value is stored first.
+ */
+/*--------------------------------------------------------------------------*/
+static unsigned long long dict_hash_seed(void)
+{
+    unsigned long long  seed, prev ;
+    struct timespec     ts ;
+    FILE            *   f ;
+
+    seed = __atomic_load_n(&dict_seed, __ATOMIC_RELAXED);
+    if (seed) {
+        return seed ;
+    }
+    f = fopen("/dev/urandom", "rb");
+    if (f==NULL || fread(&seed, sizeof(seed), 1, f)!=1) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = ((unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^
+               ((unsigned long long)getpid() << 32) ^
+               (unsigned long long)(size_t)&ts ;
+        seed *= DICT_P1 ;
+    }
+    if (f!=NULL) {
+        fclose(f);
+    }
+    if (seed==0) {
+        seed = DICT_P5 ;
+    }
+    prev = 0 ;
+    if (!__atomic_compare_exchange_n(&dict_seed, &prev, seed, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        seed = prev ;
+    }
+    return seed ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Compute the hash key for the first len bytes of a string.
+  @param    key     Character string to use for key.
+  @param    len     Number of characters to hash.
+  @return   1 unsigned int on at least 32 bits.
+
+  The string is consumed eight bytes at a time, using the xxHash64 round
+  and finalisation steps, mixed with the per-process seed so that the
+  placement of keys in the index cannot be predicted from outside.
+ */
+/*--------------------------------------------------------------------------*/
+static unsigned dict_hash_len(const char * key, int len)
+{
+    unsigned long long  h, w ;
+    unsigned int        v ;
+
+    h = dict_hash_seed() + DICT_P5 + (unsigned long long)len ;
+    while (len>=8) {
+        memcpy(&w, key, 8);
+        w *= DICT_P2 ;
+        w = DICT_ROTL(w, 31) * DICT_P1 ;
+        h ^= w ;
+        h = DICT_ROTL(h, 27) * DICT_P1 + DICT_P4 ;
+        key += 8 ;
+        len -= 8 ;
+    }
+    if (len>=4) {
+        memcpy(&v, key, 4);
+        h ^= (unsigned long long)v * DICT_P1 ;
+        h = DICT_ROTL(h, 23) * DICT_P2 + DICT_P3 ;
+        key += 4 ;
+        len -= 4 ;
+    }
+    while (len>0) {
+        h ^= (unsigned long long)(unsigned char)*key * DICT_P5 ;
+        h = DICT_ROTL(h, 11) * DICT_P1 ;
+        key ++ ;
+        len -- ;
+    }
+    h ^= h >> 33 ;
+    h *= DICT_P2 ;
+    h ^= h >> 29 ;
+    h *= DICT_P3 ;
+    h ^= h >> 32 ;
+    return (unsigned)h ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Compute the size of the hash index for a dictionary
+  @param    size    Storage size of the dictionary
+  @return   Power of two which is at least twice size
+
+  Keeping the index at least twice as large as the storage keeps the load
+  factor at or below one half, so that linear probe sequences stay short.
+ */
+/*--------------------------------------------------------------------------*/
+static int dict_index_size(int size)
+{
+    int isize ;
+
+    for (isize=DICTMINSZ ; isize<2*size ; isize*=2)
+        ;
+    return isize ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Rebuild the hash index of a dictionary
+  @param    d   Dictionary to re-index
+  @return   int 0 if Ok, -1 otherwise
+
+  Allocates a fresh index sized for the current storage size and inserts
+  every entry into it, discarding any deleted cells. Entries are inserted
+  in slot order so that, where dictionary_add() has stored the same key
+  more than once, lookups continue to find the earliest one.
+ */
+/*--------------------------------------------------------------------------*/
+static int dict_reindex(dictionary * d)
+{
+    int     *   index ;
+    int         isize ;
+    int         i ;
+    unsigned    c ;
+
+    isize = dict_index_size(d->size);
+    index = (int *)malloc(isize * sizeof(int));
+    if (index==NULL) {
+        return -1 ;
+    }
+    for (i=0 ; i<isize ; i++) {
+        index[i] = DICT_EMPTY ;
+    }
+    for (i=0 ; i<d->size ; i++) {
+        if (d->key[i]==NULL)
+            continue ;
+        for (c=d->hash[i] & (isize-1) ; index[c]!=DICT_EMPTY ; ) {
+            c = (c + 1) & (isize-1) ;
+        }
+        index[c] = i ;
+    }
+    free(d->index);
+    d->index = index ;
+    d->isize = isize ;
+    d->ifill = d->n ;
+    return 0 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Locate the index cell for a key
+  @param    d       Dictionary to search
+  @param    key     Key to look for
+  @param    len     Length of key
+  @param    hash    Hash of key, as returned by dictionary_hash()
+  @return   Position of the matching cell in d->index, or -1
+
+  Probes the index linearly from the key's hash until either a matching
+  entry or a never-used cell is found. Deleted cells do not terminate the
+  probe sequence.
+ */
+/*--------------------------------------------------------------------------*/
+static int dict_probe(dictionary * d, const char * key, int len, unsigned hash)
+{
+    unsigned    c ;
+    int         i ;
+
+    for (c=hash & (d->isize-1) ; (i=d->index[c])!=DICT_EMPTY ; ) {
+        if (i!=DICT_DELETED && hash==d->hash[i] && len==d->klen[i] &&
+            !memcmp(key, d->key[i], len)) {
+            return (int)c ;
+        }
+        c = (c + 1) & (d->isize-1) ;
+    }
+    return -1 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Locate the record for a section
+  @param    d       Dictionary to search
+  @param    s       Section name (need not be NUL-terminated)
+  @param    len     Length of section name
+  @param    create  Non-zero to create the record if it does not exist
+  @return   Index of the section record in d->sec, or -1
+ */
+/*--------------------------------------------------------------------------*/
+static int dict_section(dictionary * d, const char * s, int len, int create)
+{
+    dictsec *   sec ;
+    int     *   index ;
+    unsigned    hash, c ;
+    int         i, isize ;
+
+    hash = dict_hash_len(s, len);
+    for (c=hash & (d->secisize-1) ; (i=d->secindex[c])!=DICT_EMPTY ; ) {
+        if (d->sec[i].hash==hash && d->sec[i].len==len &&
+            !memcmp(d->sec[i].name, s, len)) {
+            return i ;
+        }
+        c = (c + 1) & (d->secisize-1) ;
+    }
+    if (!create) {
+        return -1 ;
+    }
+    if (d->nsec==d->secalloc) {
+        sec = (dictsec *)realloc(d->sec,
+                                 (d->secalloc ? d->secalloc * 2 : DICTMINSEC) *
+                                 sizeof(dictsec));
+        if (sec==NULL) {
+            return -1 ;
+        }
+        d->sec = sec ;
+        d->secalloc = d->secalloc ? d->secalloc * 2 : DICTMINSEC ;
+    }
+    sec = &(d->sec[d->nsec]) ;
+    sec->name = dict_alloc(d, len + 1);
+    if (sec->name==NULL) {
+        return -1 ;
+    }
+    memcpy(sec->name, s, len);
+    sec->name[len] = 0 ;
+    sec->len = len ;
+    sec->hash = hash ;
+    sec->n = 0 ;
+    sec->head = sec->tail = -1 ;
+    d->secindex[c] = d->nsec ;
+    d->nsec ++ ;
+    if (d->nsec * 2 > d->secisize) {
+        /* Keep the section index at most half full */
+        isize = d->secisize * 2 ;
+        index = (int *)malloc(isize * sizeof(int));
+        if (index==NULL) {
+            return d->nsec - 1 ;
+        }
+        for (c=0 ; c<(unsigned)isize ; c++) {
+            index[c] = DICT_EMPTY ;
+        }
+        for (i=0 ; i<d->nsec ; i++) {
+            for (c=d->sec[i].hash & (isize-1) ; index[c]!=DICT_EMPTY ; ) {
+                c = (c + 1) & (isize-1) ;
+            }
+            index[c] = i ;
+        }
+        free(d->secindex);
+        d->secindex = index ;
+        d->secisize = isize ;
+    }
+    return d->nsec - 1 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Add an entry to the list of its section's entries
+  @param    d   Dictionary to modify
+  @param    i   Slot of the entry
+  @return   int 0 if Ok, -1 otherwise
+ */
+/*--------------------------------------------------------------------------*/
+static int dict_seclink(dictionary * d, int i)
+{
+    const char  *   colon ;
+    dictsec     *   sec ;
+    int             id ;
+
+    d->secid[i] = d->snext[i] = d->sprev[i] = -1 ;
+    colon = strchr(d->key[i], ':');
+    if (colon==NULL) {
+        return 0 ;
+    }
+    id = dict_section(d, d->key[i], (int)(colon - d->key[i]), 1);
+    if (id<0) {
+        return -1 ;
+    }
+    sec = &(d->sec[id]) ;
+    d->secid[i] = id ;
+    d->sprev[i] = sec->tail ;
+    if (sec->tail>=0) {
+        d->snext[sec->tail] = i ;
+    } else {
+        sec->head = i ;
+    }
+    sec->tail = i ;
+    sec->n ++ ;
+    return 0 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Remove an entry from the list of its section's entries
+  @param    d   Dictionary to modify
+  @param    i   Slot of the entry
+  @return   void
+ */
+/*--------------------------------------------------------------------------*/
+static void dict_secunlink(dictionary * d, int i)
+{
+    dictsec     *   sec ;
+
+    if (d->secid[i]<0) {
+        return ;
+    }
+    sec = &(d->sec[d->secid[i]]) ;
+    if (d->sprev[i]>=0) {
+        d->snext[d->sprev[i]] = d->snext[i] ;
+    } else {
+        sec->head = d->snext[i] ;
+    }
+    if (d->snext[i]>=0) {
+        d->sprev[d->snext[i]] = d->sprev[i] ;
+    } else {
+        sec->tail = d->sprev[i] ;
+    }
+    sec->n -- ;
+    d->secid[i] = d->snext[i] = d->sprev[i] = -1 ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Store a new entry in a dictionary
+  @param    d       Dictionary to modify
+  @param    key     Key to add
+  @param    val     Value to add (may be NULL)
+  @param    len     Length of key
+  @param    hash    Hash of key, as returned by dictionary_hash()
+  @return   int 0 if Ok, -1 otherwise
+
+  Adds an entry without checking whether the key is already present,
+  growing the storage and the index as needed. New entries are only ever
+  placed in never-used index cells, so that a duplicate key added later
+  is always found after any earlier one on the same probe sequence.
+ */
+/*--------------------------------------------------------------------------*/
+static int dict_insert(dictionary * d, const char * key, const char * val,
+                       int len, unsigned hash)
+{
+    int         i ;
+    unsigned    c ;
+
+    /* See if dictionary needs to grow */
+    if (d->n==d->size) {
+
+        /* Reached maximum size: reallocate dictionary */
+        d->val  = (char **)mem_double(d->val,  d->size * sizeof(char*)) ;
+        d->key  = (char **)mem_double(d->key,  d->size * sizeof(char*)) ;
+        d->hash = (unsigned int *)mem_double(d->hash, d->size * sizeof(unsigned)) ;
+        d->klen = (int *)mem_double(d->klen, d->size * sizeof(int)) ;
+        d->secid = (int *)mem_double(d->secid, d->size * sizeof(int)) ;
+        d->snext = (int *)mem_double(d->snext, d->size * sizeof(int)) ;
+        d->sprev = (int *)mem_double(d->sprev, d->size * sizeof(int)) ;
+        if ((d->val==NULL) || (d->key==NULL) || (d->hash==NULL) ||
+            (d->klen==NULL) || (d->secid==NULL) || (d->snext==NULL) || (d->sprev==NULL)) {
+            /* Cannot grow dictionary */
+            return -1 ;
+        }
+        /* Double size */
+        d->size *= 2 ;
+        if (dict_reindex(d)) {
+            return -1 ;
+        }
+    } else if ((d->ifill+1)*4 > d->isize*3) {
+        /* Too many deleted cells: sweep them out of the index */
+        if (dict_reindex(d)) {
+            return -1 ;
+        }
+    }
+
+    /* Insert key in the first empty slot. Start at d->n and wrap at
+       d->size. Because d->n < d->size this will necessarily
+       terminate. */
+    for (i=d->n ; d->key[i] ; ) {
+        if(++i == d->size) i = 0;
+    }
+    /* Copy key */
+    d->key[i]  = dict_strdup(d, key);
+    d->val[i]  = val ? dict_strdup(d, val) : NULL ;
+    d->hash[i] = hash;
+    d->klen[i] = len ;
+    d->n ++ ;
+    /* Index it */
+    for (c=hash & (d->isize-1) ; d->index[c]!=DICT_EMPTY ; ) {
+        c = (c + 1) & (d->isize-1) ;
+    }
+    d->index[c] = i ;
+    d->ifill ++ ;
+    return dict_seclink(d, i) ;
+}
+
 /*---------------------------------------------------------------------------
                             Function codes
  ---------------------------------------------------------------------------*/
@@ -79,28 +629,34 @@ static char * xstrdup(const char * s)
   @param    key     Character string to use for key.
   @return   1 unsigned int on at least 32 bits.
 
-  This hash function has been taken from an Article in Dr Dobbs Journal.
-  This is normally a collision-free function, distributing keys evenly.
-  The key is stored anyway in the struct so that collision can be avoided
-  by comparing the key itself in last resort.
+  The hash is computed a word at a time and is seeded with a value chosen
+  at random once per process, so that a hostile set of keys cannot be
+  constructed in advance to collide. Hash values are therefore only
+  meaningful within the process which computed them. The key is stored
+  anyway in the struct so that collision can be avoided by comparing the
+  key itself in last resort.
  */
 /*--------------------------------------------------------------------------*/
 unsigned dictionary_hash(const char * key)
 {
-    int         len ;
-    unsigned    hash ;
-    int         i ;
+    return dict_hash_len(key, (int)strlen(key));
+}
 
-    len = strlen(key);
-    for (hash=0, i=0 ; i<len ; i++) {
-        hash += (unsigned)key[i] ;
-        hash += (hash<<10);
-        hash ^= (hash>>6) ;
-    }
-    hash += (hash <<3);
-    hash ^= (hash >>11);
-    hash += (hash <<15);
-    return hash ;
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Compute the hash key and length of a string.
+  @param    key     Character string to use for key.
+  @param    len     Receives the length of the key.
+  @return   1 unsigned int on at least 32 bits.
+
+  As dictionary_hash(), but also provides the length of the key, which is
+  needed along with the hash by dictionary_lookup().
+ */
+/*--------------------------------------------------------------------------*/
+unsigned dictionary_hashl(const char * key, int * len)
+{
+    *len = (int)strlen(key);
+    return dict_hash_len(key, *len);
 }
 
 /*-------------------------------------------------------------------------*/
@@ -117,6 +673,7 @@ unsigned dictionary_hash(const char * key)
 dictionary * dictionary_new(int size)
 {
     dictionary  *   d ;
+    int             i ;
 
     /* If no size was specified, allocate space for DICTMINSZ */
     if (size<DICTMINSZ) size=DICTMINSZ ;
@@ -128,6 +685,45 @@ dictionary * dictionary_new(int size)
     d->val  = (char **)calloc(size, sizeof(char*));
     d->key  = (char **)calloc(size, sizeof(char*));
     d->hash = (unsigned int *)calloc(size, sizeof(unsigned));
+    d->klen = (int *)calloc(size, sizeof(int));
+    d->secid = (int *)calloc(size, sizeof(int));
+    d->snext = (int *)calloc(size, sizeof(int));
+    d->sprev = (int *)calloc(size, sizeof(int));
+    d->secisize = DICTMINSEC ;
+    d->secindex = (int *)malloc(DICTMINSEC * sizeof(int));
+    if (d->val==NULL || d->key==NULL || d->hash==NULL || d->klen==NULL ||
+        d->secid==NULL || d->snext==NULL || d->sprev==NULL ||
+        d->secindex==NULL || dict_reindex(d)) {
+        dictionary_del(d);
+        return NULL ;
+    }
+    for (i=0 ; i<DICTMINSEC ; i++) {
+        d->secindex[i] = DICT_EMPTY ;
+    }
+    return d ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Create a new arena-allocated dictionary object.
+  @param    size    Optional initial size of the dictionary.
+  @return   1 newly allocated dictionary objet.
+
+  As dictionary_new(), except that keys and values stored in the
+  dictionary are allocated from a private arena of large chunks instead
+  of one at a time. This suits dictionaries which are filled once and
+  then mostly read, such as those loaded from a file. Space used by
+  replaced or removed values is only reclaimed by dictionary_compact().
+ */
+/*--------------------------------------------------------------------------*/
+dictionary * dictionary_new_arena(int size)
+{
+    dictionary  *   d ;
+
+    d = dictionary_new(size);
+    if (d!=NULL) {
+        d->arena = 1 ;
+    }
     return d ;
 }
 
@@ -142,22 +738,188 @@ dictionary * dictionary_new(int size)
 /*--------------------------------------------------------------------------*/
 void dictionary_del(dictionary * d)
 {
-    int     i ;
+    int         i ;
+    dictchunk * c ;
 
     if (d==NULL) return ;
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]!=NULL)
-            free(d->key[i]);
-        if (d->val[i]!=NULL)
-            free(d->val[i]);
+    if (d->arena) {
+        /* Every string is in one of the chunks */
+        while ((c = d->chunks)!=NULL) {
+            d->chunks = c->next ;
+            free(c);
+        }
+    } else {
+        for (i=0 ; d->key!=NULL && d->val!=NULL && i<d->size ; i++) {
+            if (d->key[i]!=NULL)
+                dict_strfree(d, d->key[i]);
+            if (d->val[i]!=NULL)
+                dict_strfree(d, d->val[i]);
+        }
+        for (i=0 ; i<d->nsec ; i++) {
+            free(d->sec[i].name);
+        }
     }
+    free(d->map);
     free(d->val);
     free(d->key);
     free(d->hash);
+    free(d->klen);
+    free(d->index);
+    free(d->secid);
+    free(d->snext);
+    free(d->sprev);
+    free(d->sec);
+    free(d->secindex);
     free(d);
     return ;
 }
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Duplicate a dictionary object
+  @param    d   dictionary object to copy.
+  @return   1 newly allocated dictionary object, or NULL on failure.
+
+  Creates a deep copy of a dictionary: every key and value is duplicated,
+  and entries keep the same slots as in the original. The copy must be
+  freed with dictionary_del(). If the original uses an arena then so does
+  the copy, whose strings are packed into a single chunk.
+ */
+/*--------------------------------------------------------------------------*/
+dictionary * dictionary_dup(dictionary * d)
+{
+    dictionary  *   n ;
+    size_t          live ;
+    int             i ;
+
+    if (d==NULL) return NULL ;
+    if (!(n = (dictionary *)calloc(1, sizeof(dictionary)))) {
+        return NULL ;
+    }
+    n->size  = d->size ;
+    n->isize = d->isize ;
+    n->secisize = d->secisize ;
+    n->arena = d->arena ;
+    n->val   = (char **)calloc(d->size, sizeof(char*));
+    n->key   = (char **)calloc(d->size, sizeof(char*));
+    n->hash  = (unsigned int *)malloc(d->size * sizeof(unsigned));
+    n->klen  = (int *)malloc(d->size * sizeof(int));
+    n->index = (int *)malloc(d->isize * sizeof(int));
+    n->secid = (int *)malloc(d->size * sizeof(int));
+    n->snext = (int *)malloc(d->size * sizeof(int));
+    n->sprev = (int *)malloc(d->size * sizeof(int));
+    n->secindex = (int *)malloc(d->secisize * sizeof(int));
+    if (d->nsec) {
+        n->sec = (dictsec *)malloc(d->nsec * sizeof(dictsec));
+    }
+    if (n->val==NULL || n->key==NULL || n->hash==NULL || n->index==NULL ||
+        n->klen==NULL || n->secid==NULL || n->snext==NULL || n->sprev==NULL ||
+        n->secindex==NULL || (d->nsec && n->sec==NULL)) {
+        dictionary_del(n);
+        return NULL ;
+    }
+    if (n->arena) {
+        /* Size the arena to hold exactly the strings to be copied; those
+           borrowed from the original's file image are counted too, as
+           the copy has no file image of its own */
+        live = dict_live(d);
+        for (i=0 ; d->map!=NULL && i<d->size ; i++) {
+            if (d->key[i]!=NULL && dict_inmap(d, d->key[i]))
+                live += strlen(d->key[i]) + 1 ;
+            if (d->val[i]!=NULL && dict_inmap(d, d->val[i]))
+                live += strlen(d->val[i]) + 1 ;
+        }
+        if (live>0 && dict_chunk_new(n, live, 0)==NULL) {
+            dictionary_del(n);
+            return NULL ;
+        }
+    }
+    n->secalloc = d->nsec ;
+    for (i=0 ; i<d->nsec ; i++) {
+        n->sec[i] = d->sec[i] ;
+        n->sec[i].name = dict_strdup(n, d->sec[i].name);
+        if (n->sec[i].name==NULL) {
+            dictionary_del(n);
+            return NULL ;
+        }
+        n->nsec ++ ;
+    }
+    for (i=0 ; i<d->size ; i++) {
+        if (d->key[i]==NULL)
+            continue ;
+        n->key[i] = dict_strdup(n, d->key[i]);
+        if (n->key[i]==NULL) {
+            dictionary_del(n);
+            return NULL ;
+        }
+        n->n ++ ;
+        if (d->val[i]!=NULL) {
+            n->val[i] = dict_strdup(n, d->val[i]);
+            if (n->val[i]==NULL) {
+                dictionary_del(n);
+                return NULL ;
+            }
+        }
+    }
+    memcpy(n->hash, d->hash, d->size * sizeof(unsigned));
+    memcpy(n->klen, d->klen, d->size * sizeof(int));
+    memcpy(n->index, d->index, d->isize * sizeof(int));
+    memcpy(n->secid, d->secid, d->size * sizeof(int));
+    memcpy(n->snext, d->snext, d->size * sizeof(int));
+    memcpy(n->sprev, d->sprev, d->size * sizeof(int));
+    memcpy(n->secindex, d->secindex, d->secisize * sizeof(int));
+    n->ifill = d->ifill ;
+    return n ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Reclaim space held by replaced strings in an arena
+  @param    d   dictionary object to compact.
+  @return   int 0 if Ok, -1 otherwise.
+
+  Copies every string still in use into a single new arena chunk and
+  releases the old chunks. Any pointer previously returned by
+  dictionary_get() for this dictionary is invalidated. Does nothing for a
+  dictionary which does not use an arena. On failure the dictionary is
+  left unchanged.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_compact(dictionary * d)
+{
+    dictchunk   *   old ;
+    dictchunk   *   c ;
+    size_t          live ;
+    int             i ;
+
+    if (d==NULL) return -1 ;
+    if (!d->arena) return 0 ;
+
+    live = dict_live(d);
+    old = d->chunks ;
+    d->chunks = NULL ;
+    if (live>0 && dict_chunk_new(d, live, 0)==NULL) {
+        d->chunks = old ;
+        return -1 ;
+    }
+    /* The new chunk is exactly large enough, so none of these can fail */
+    for (i=0 ; i<d->size ; i++) {
+        if (d->key[i]!=NULL)
+            d->key[i] = dict_strdup(d, d->key[i]);
+        if (d->val[i]!=NULL)
+            d->val[i] = dict_strdup(d, d->val[i]);
+    }
+    for (i=0 ; i<d->nsec ; i++) {
+        d->sec[i].name = dict_strdup(d, d->sec[i].name);
+    }
+    while ((c = old)!=NULL) {
+        old = c->next ;
+        free(c);
+    }
+    d->waste = 0 ;
+    return 0 ;
+}
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Get a value from a dictionary.
@@ -174,22 +936,50 @@ void dictionary_del(dictionary * d)
 /*--------------------------------------------------------------------------*/
 char * dictionary_get(dictionary * d, const char * key, char * def)
 {
+    int         c, len ;
     unsigned    hash ;
-    int         i ;
 
-    hash = dictionary_hash(key);
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        /* Compare hash */
-        if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-                return d->val[i] ;
-            }
-        }
+    hash = dictionary_hashl(key, &len);
+    c = dict_probe(d, key, len, hash);
+    if (c<0) {
+        return def ;
     }
-    return def ;
+    return d->val[d->index[c]] ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find the slot holding a key, given its precomputed hash.
+  @param    d       dictionary object to search.
+  @param    key     Key to look for in the dictionary.
+  @param    len     Length of key.
+  @param    hash    Hash of key, as returned by dictionary_hashl().
+  @param    hint    Slot at which the key was previously found, or -1.
+  @return   int     Slot of the key (an index into d->key and d->val), or -1.
+
+  This is intended for callers which look up the same keys repeatedly:
+  they can compute the hash once, and pass back the slot returned by a
+  previous call as a hint. If the key is still at that slot (as it will
+  be in a copy made by dictionary_dup(), for example) the index is not
+  probed at all.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_lookup(dictionary * d, const char * key, int len, unsigned hash,
+                      int hint)
+{
+    int         c ;
+
+    if (d==NULL || key==NULL) return -1 ;
+    if (hint>=0 && hint<d->size && d->key[hint]!=NULL &&
+        d->hash[hint]==hash && d->klen[hint]==len &&
+        !memcmp(d->key[hint], key, len)) {
+        return hint ;
+    }
+    c = dict_probe(d, key, len, hash);
+    if (c<0) {
+        return -1 ;
+    }
+    return d->index[c] ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -220,58 +1010,26 @@ char * dictionary_get(dictionary * d, const char * key, char * def)
 /*--------------------------------------------------------------------------*/
 int dictionary_set(dictionary * d, const char * key, const char * val)
 {
-    int         i ;
+    int         c, i, len ;
     unsigned    hash ;
 
     if (d==NULL || key==NULL) return -1 ;
     
     /* Compute hash for this key */
-    hash = dictionary_hash(key) ;
+    hash = dictionary_hashl(key, &len) ;
     /* Find if value is already in dictionary */
-    if (d->n>0) {
-        for (i=0 ; i<d->size ; i++) {
-            if (d->key[i]==NULL)
-                continue ;
-            if (hash==d->hash[i]) { /* Same hash value */
-                if (!strcmp(key, d->key[i])) {   /* Same key */
-                    /* Found a value: modify and return */
-                    if (d->val[i]!=NULL)
-                        free(d->val[i]);
-                    d->val[i] = val ? xstrdup(val) : NULL ;
-                    /* Value has been modified: return */
-                    return 0 ;
-                }
-            }
-        }
+    c = dict_probe(d, key, len, hash);
+    if (c>=0) {
+        /* Found a value: modify and return */
+        i = d->index[c] ;
+        if (d->val[i]!=NULL)
+            dict_strfree(d, d->val[i]);
+        d->val[i] = val ? dict_strdup(d, val) : NULL ;
+        /* Value has been modified: return */
+        return 0 ;
     }
     /* Add a new value */
-    /* See if dictionary needs to grow */
-    if (d->n==d->size) {
-
-        /* Reached maximum size: reallocate dictionary */
-        d->val  = (char **)mem_double(d->val,  d->size * sizeof(char*)) ;
-        d->key  = (char **)mem_double(d->key,  d->size * sizeof(char*)) ;
-        d->hash = (unsigned int *)mem_double(d->hash, d->size * sizeof(unsigned)) ;
-        if ((d->val==NULL) || (d->key==NULL) || (d->hash==NULL)) {
-            /* Cannot grow dictionary */
-            return -1 ;
-        }
-        /* Double size */
-        d->size *= 2 ;
-    }
-
-    /* Insert key in the first empty slot. Start at d->n and wrap at
-       d->size. Because d->n < d->size this will necessarily
-       terminate. */
-    for (i=d->n ; d->key[i] ; ) {
-        if(++i == d->size) i = 0;
-    }
-    /* Copy key */
-    d->key[i]  = xstrdup(key);
-    d->val[i]  = val ? xstrdup(val) : NULL ;
-    d->hash[i] = hash;
-    d->n ++ ;
-    return 0 ;
+    return dict_insert(d, key, val, len, hash);
 }
 
 /*-------------------------------------------------------------------------*/
@@ -287,41 +1045,14 @@ int dictionary_set(dictionary * d, const char * key, const char * val)
 /*--------------------------------------------------------------------------*/
 int dictionary_add(dictionary * d, const char * key, const char * val)
 {
-    int         i ;
+    int         len ;
     unsigned    hash ;
 
     if (d==NULL || key==NULL || val==NULL) return -1 ;
     
-    /* Compute hash for this key */
-    hash = dictionary_hash(key) ;
     /* Add a new value */
-    /* See if dictionary needs to grow */
-    if (d->n==d->size) {
-
-        /* Reached maximum size: reallocate dictionary */
-        d->val  = (char **)mem_double(d->val,  d->size * sizeof(char*)) ;
-        d->key  = (char **)mem_double(d->key,  d->size * sizeof(char*)) ;
-        d->hash = (unsigned int *)mem_double(d->hash, d->size * sizeof(unsigned)) ;
-        if ((d->val==NULL) || (d->key==NULL) || (d->hash==NULL)) {
-            /* Cannot grow dictionary */
-            return -1 ;
-        }
-        /* Double size */
-        d->size *= 2 ;
-    }
-
-    /* Insert key in the first empty slot. Start at d->n and wrap at
-       d->size. Because d->n < d->size this will necessarily
-       terminate. */
-    for (i=d->n ; d->key[i] ; ) {
-        if(++i == d->size) i = 0;
-    }
-    /* Copy key */
-    d->key[i]  = xstrdup(key);
-    d->val[i]  = val ? xstrdup(val) : NULL ;
-    d->hash[i] = hash;
-    d->n ++ ;
-    return 0 ;
+    hash = dictionary_hashl(key, &len);
+    return dict_insert(d, key, val, len, hash);
 }
 
 /*-------------------------------------------------------------------------*/
@@ -337,41 +1068,97 @@ int dictionary_add(dictionary * d, const char * key, const char * val)
 /*--------------------------------------------------------------------------*/
 void dictionary_unset(dictionary * d, const char * key)
 {
+    int         c, i, len ;
     unsigned    hash ;
-    int         i ;
 
     if (key == NULL) {
         return;
     }
 
-    hash = dictionary_hash(key);
-    for (i=0 ; i<d->size ; i++) {
-        if (d->key[i]==NULL)
-            continue ;
-        /* Compare hash */
-        if (hash==d->hash[i]) {
-            /* Compare string, to avoid hash collisions */
-            if (!strcmp(key, d->key[i])) {
-                /* Found key */
-                break ;
-            }
-        }
-    }
-    if (i>=d->size)
+    hash = dictionary_hashl(key, &len);
+    c = dict_probe(d, key, len, hash);
+    if (c<0)
         /* Key not found */
         return ;
 
-    free(d->key[i]);
+    /* Leave a tombstone so that later probe sequences are unbroken */
+    i = d->index[c] ;
+    d->index[c] = DICT_DELETED ;
+    dict_secunlink(d, i);
+    dict_strfree(d, d->key[i]);
     d->key[i] = NULL ;
     if (d->val[i]!=NULL) {
-        free(d->val[i]);
+        dict_strfree(d, d->val[i]);
         d->val[i] = NULL ;
     }
     d->hash[i] = 0 ;
+    d->klen[i] = 0 ;
     d->n -- ;
     return ;
 }
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find the first entry in a section
+  @param    d       dictionary object to search.
+  @param    s       Section name (need not be NUL-terminated).
+  @param    len     Length of section name.
+  @return   int     Slot of the first entry, or -1 if there are none.
+
+  Returns the slot (an index into d->key and d->val) of the earliest-added
+  entry whose key is of the form "section:key". The section name must not
+  itself contain a colon. Use dictionary_secnext() to visit the rest of
+  the section's entries; the dictionary must not be modified while doing
+  so.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_secfirst(dictionary * d, const char * s, int len)
+{
+    int     id ;
+
+    if (d==NULL || s==NULL) return -1 ;
+    id = dict_section(d, s, len, 0);
+    if (id<0) {
+        return -1 ;
+    }
+    return d->sec[id].head ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find the next entry in the same section
+  @param    d       dictionary object to search.
+  @param    i       Slot of an entry, as returned by dictionary_secfirst().
+  @return   int     Slot of the next entry, or -1 if there are none.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_secnext(dictionary * d, int i)
+{
+    if (d==NULL || i<0 || i>=d->size) return -1 ;
+    return d->snext[i] ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Count the entries in a section
+  @param    d       dictionary object to search.
+  @param    s       Section name (need not be NUL-terminated).
+  @param    len     Length of section name.
+  @return   int     Number of entries whose key is of the form "section:key".
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_secsize(dictionary * d, const char * s, int len)
+{
+    int     id ;
+
+    if (d==NULL || s==NULL) return 0 ;
+    id = dict_section(d, s, len, 0);
+    if (id<0) {
+        return 0 ;
+    }
+    return d->sec[id].n ;
+}
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Dump a dictionary to an opened file pointer.
@@ -28,6 +28,39 @@
  ---------------------------------------------------------------------------*/
 
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Dictionary section record
+
+  Keys of the form "section:key" belong to the section named by the text
+  before the first colon. Each section which has ever had an entry has a
+  record listing its entries, in the order in which they were added,
+  through the snext/sprev links of the dictionary.
+ */
+/*-------------------------------------------------------------------------*/
+typedef struct _dictsec_ {
+    char        *   name ;  /** Section name */
+    int             len ;   /** Length of section name */
+    unsigned        hash ;  /** Hash of section name */
+    int             n ;     /** Number of entries in section */
+    int             head ;  /** First entry in section, or -1 */
+    int             tail ;  /** Last entry in section, or -1 */
+} dictsec ;
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Dictionary string arena chunk
+
+  A block of memory from which strings are allocated by advancing the
+  used count. The string storage follows the header.
+ */
+/*-------------------------------------------------------------------------*/
+typedef struct _dictchunk_ {
+    struct _dictchunk_ * next ; /** Next (older) chunk */
+    size_t          size ;  /** Bytes of string storage in chunk */
+    size_t          used ;  /** Bytes allocated from chunk */
+} dictchunk ;
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Dictionary object
@@ -36,6 +69,27 @@
   association is identified by a unique string key. Looking up values
   in the dictionary is speeded up by the use of a (hopefully collision-free)
   hash function.
+
+  Entries are stored in the key/val/hash arrays, which may be walked from
+  0 to size-1 (skipping NULL keys) to visit every entry in the order in
+  which it was added. Lookups do not walk these arrays: they go through
+  a separate open-addressed index, probed linearly from the key's hash,
+  whose cells hold the slot number of an entry in key/val/hash.
+
+  The entries of each section are additionally linked together, so that
+  a section can be enumerated in time proportional to its size; see
+  dictionary_secfirst().
+
+  If map is set, the dictionary owns a malloc()ed image of maplen bytes
+  (typically the file it was loaded from). Keys and values which point
+  into the image are referenced rather than copied, are never freed
+  individually, and the image is freed by dictionary_del().
+
+  If arena is set, all other strings owned by the dictionary are carved
+  out of the chunks list rather than allocated individually, and are all
+  released at once by dictionary_del(). Replacing or removing an entry
+  does not release its strings: their size is added to waste, and the
+  space is recovered by dictionary_compact().
  */
 /*-------------------------------------------------------------------------*/
 typedef struct _dictionary_ {
@@ -44,6 +98,23 @@ typedef struct _dictionary_ {
     char        **  val ;   /** List of string values */
     char        **  key ;   /** List of string keys */
     unsigned     *  hash ;  /** List of hash values for keys */
+    int          *  klen ;  /** List of key lengths */
+    int          *  index ; /** Open-addressed hash index into key/val */
+    int             isize ; /** Size of hash index (a power of two) */
+    int             ifill ; /** Used and deleted cells in hash index */
+    int          *  secid ; /** Section record of each entry, or -1 */
+    int          *  snext ; /** Next entry in the same section, or -1 */
+    int          *  sprev ; /** Previous entry in the same section, or -1 */
+    dictsec      *  sec ;   /** Section records */
+    int             nsec ;  /** Number of section records */
+    int             secalloc ; /** Allocated section records */
+    int          *  secindex ; /** Open-addressed index of section records */
+    int             secisize ; /** Size of section index (a power of two) */
+    char         *  map ;   /** File image holding borrowed strings */
+    size_t          maplen ;/** Length of file image */
+    int             arena ; /** Non-zero if strings are arena-allocated */
+    dictchunk    *  chunks ;/** Arena chunks, most recent first */
+    size_t          waste ; /** Arena bytes held by released strings */
 } dictionary ;
 
 
@@ -57,14 +128,29 @@ typedef struct _dictionary_ {
   @param    key     Character string to use for key.
   @return   1 unsigned int on at least 32 bits.
 
-  This hash function has been taken from an Article in Dr Dobbs Journal.
-  This is normally a collision-free function, distributing keys evenly.
-  The key is stored anyway in the struct so that collision can be avoided
-  by comparing the key itself in last resort.
+  The hash is computed a word at a time and is seeded with a value chosen
+  at random once per process, so that a hostile set of keys cannot be
+  constructed in advance to collide. Hash values are therefore only
+  meaningful within the process which computed them. The key is stored
+  anyway in the struct so that collision can be avoided by comparing the
+  key itself in last resort.
  */
 /*--------------------------------------------------------------------------*/
 unsigned dictionary_hash(const char * key);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Compute the hash key and length of a string.
+  @param    key     Character string to use for key.
+  @param    len     Receives the length of the key.
+  @return   1 unsigned int on at least 32 bits.
+
+  As dictionary_hash(), but also provides the length of the key, which is
+  needed along with the hash by dictionary_lookup().
+ */
+/*--------------------------------------------------------------------------*/
+unsigned dictionary_hashl(const char * key, int * len);
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Create a new dictionary object.
@@ -78,6 +164,21 @@ unsigned dictionary_hash(const char * key);
 /*--------------------------------------------------------------------------*/
 dictionary * dictionary_new(int size);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Create a new arena-allocated dictionary object.
+  @param    size    Optional initial size of the dictionary.
+  @return   1 newly allocated dictionary objet.
+
+  As dictionary_new(), except that keys and values stored in the
+  dictionary are allocated from a private arena of large chunks instead
+  of one at a time. This suits dictionaries which are filled once and
+  then mostly read, such as those loaded from a file. Space used by
+  replaced or removed values is only reclaimed by dictionary_compact().
+ */
+/*--------------------------------------------------------------------------*/
+dictionary * dictionary_new_arena(int size);
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Delete a dictionary object
@@ -89,6 +190,35 @@ dictionary * dictionary_new(int size);
 /*--------------------------------------------------------------------------*/
 void dictionary_del(dictionary * vd);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Duplicate a dictionary object
+  @param    d   dictionary object to copy.
+  @return   1 newly allocated dictionary object, or NULL on failure.
+
+  Creates a deep copy of a dictionary: every key and value is duplicated,
+  and entries keep the same slots as in the original. The copy must be
+  freed with dictionary_del(). If the original uses an arena then so does
+  the copy, whose strings are packed into a single chunk.
+ */
+/*--------------------------------------------------------------------------*/
+dictionary * dictionary_dup(dictionary * d);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Reclaim space held by replaced strings in an arena
+  @param    d   dictionary object to compact.
+  @return   int 0 if Ok, -1 otherwise.
+
+  Copies every string still in use into a single new arena chunk and
+  releases the old chunks. Any pointer previously returned by
+  dictionary_get() for this dictionary is invalidated. Does nothing for a
+  dictionary which does not use an arena. On failure the dictionary is
+  left unchanged.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_compact(dictionary * d);
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Get a value from a dictionary.
@@ -105,6 +235,26 @@ void dictionary_del(dictionary * vd);
 /*--------------------------------------------------------------------------*/
 char * dictionary_get(dictionary * d, const char * key, char * def);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find the slot holding a key, given its precomputed hash.
+  @param    d       dictionary object to search.
+  @param    key     Key to look for in the dictionary.
+  @param    len     Length of key.
+  @param    hash    Hash of key, as returned by dictionary_hashl().
+  @param    hint    Slot at which the key was previously found, or -1.
+  @return   int     Slot of the key (an index into d->key and d->val), or -1.
+
+  This is intended for callers which look up the same keys repeatedly:
+  they can compute the hash once, and pass back the slot returned by a
+  previous call as a hint. If the key is still at that slot (as it will
+  be in a copy made by dictionary_dup(), for example) the index is not
+  probed at all.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_lookup(dictionary * d, const char * key, int len, unsigned hash,
+                      int hint);
+
 
 /*-------------------------------------------------------------------------*/
 /**
@@ -160,6 +310,44 @@ int dictionary_add(dictionary * d, const char * key, const char * val);
 /*--------------------------------------------------------------------------*/
 void dictionary_unset(dictionary * d, const char * key);
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find the first entry in a section
+  @param    d       dictionary object to search.
+  @param    s       Section name (need not be NUL-terminated).
+  @param    len     Length of section name.
+  @return   int     Slot of the first entry, or -1 if there are none.
+
+  Returns the slot (an index into d->key and d->val) of the earliest-added
+  entry whose key is of the form "section:key". The section name must not
+  itself contain a colon. Use dictionary_secnext() to visit the rest of
+  the section's entries; the dictionary must not be modified while doing
+  so.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_secfirst(dictionary * d, const char * s, int len);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Find the next entry in the same section
+  @param    d       dictionary object to search.
+  @param    i       Slot of an entry, as returned by dictionary_secfirst().
+  @return   int     Slot of the next entry, or -1 if there are none.
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_secnext(dictionary * d, int i);
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Count the entries in a section
+  @param    d       dictionary object to search.
+  @param    s       Section name (need not be NUL-terminated).
+  @param    len     Length of section name.
+  @return   int     Number of entries whose key is of the form "section:key".
+ */
+/*--------------------------------------------------------------------------*/
+int dictionary_secsize(dictionary * d, const char * s, int len);
+
 
 /*-------------------------------------------------------------------------*/
 /**
@@ -8,6 +8,9 @@
 /*--------------------------------------------------------------------------*/
 /*---------------------------- Includes ------------------------------------*/
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include "iniparser.h"
 
 /*---------------------------- Defines -------------------------------------*/
@@ -29,6 +32,14 @@ typedef enum _line_status_ {
     LINE_VALUE
 } line_status ;
 
+/**
+ * A run of characters within a line (internal use only).
+ */
+typedef struct _line_span_ {
+    const char  *   ptr ;
+    int             len ;
+} line_span ;
+
 static void (*logger)(const char *format, va_list args);
 
 /*-------------------------------------------------------------------------*/
@@ -96,36 +107,33 @@ static char * strlwc(const char * s)
 
 /*-------------------------------------------------------------------------*/
 /**
-  @brief    Remove blanks at the beginning and the end of a string.
-  @param    s   String to parse.
-  @return   ptr to statically allocated string.
-
-  This function returns a pointer to a statically allocated string,
-  which is identical to the input string, except that all blank
-  characters at the end and the beg. of the string have been removed.
-  Do not free or modify the returned string! Since the returned string
-  is statically allocated, it will be modified at each function call
-  (not re-entrant).
+  @brief    Find the next key belonging to a section
+  @param    d       Dictionary to examine
+  @param    s       Section name
+  @param    seclen  Length of section name
+  @param    j       Slot of the previous key, or -1 to find the first
+  @return   Slot of the next key of the form "section:key", or -1
+
+  Walks the dictionary's section index rather than every entry. A section
+  name containing a colon is indexed under the text before the colon, so
+  in that case the members of the enclosing index section are filtered.
  */
 /*--------------------------------------------------------------------------*/
-static char * strstrip(const char * s)
+static int secnext(dictionary * d, const char * s, int seclen, int j)
 {
-    static char l[ASCIILINESZ+1];
-    char * last ;
-    
-    if (s==NULL) return NULL ;
-    
-    while (isspace((int)*s) && *s) s++;
-    memset(l, 0, ASCIILINESZ+1);
-    strcpy(l, s);
-    last = l + strlen(l);
-    while (last > l) {
-        if (!isspace((int)*(last-1)))
-            break ;
-        last -- ;
+    const char * colon ;
+
+    colon = strchr(s, ':');
+    if (j<0) {
+        j = dictionary_secfirst(d, s, colon ? (int)(colon - s) : seclen);
+    } else {
+        j = dictionary_secnext(d, j);
+    }
+    while (j>=0 && colon!=NULL &&
+           (strncmp(d->key[j], s, seclen) || d->key[j][seclen]!=':')) {
+        j = dictionary_secnext(d, j);
     }
-    *last = (char)0;
-    return (char*)l ;
+    return j ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -281,7 +289,6 @@ void iniparser_dump_ini(dictionary * d, FILE * f)
 void iniparser_dumpsection_ini(dictionary * d, char * s, FILE * f)
 {
     int     j ;
-    char    keym[ASCIILINESZ+1];
     int     seclen ;
 
     if (d==NULL || f==NULL) return ;
@@ -289,16 +296,11 @@ void iniparser_dumpsection_ini(dictionary * d, char * s, FILE * f)
 
     seclen  = (int)strlen(s);
     fprintf(f, "\n[%s]\n", s);
-    sprintf(keym, "%s:", s);
-    for (j=0 ; j<d->size ; j++) {
-        if (d->key[j]==NULL)
-            continue ;
-        if (!strncmp(d->key[j], keym, seclen+1)) {
-            fprintf(f,
-                    "%-30s = %s\n",
-                    d->key[j]+seclen+1,
-                    d->val[j] ? d->val[j] : "");
-        }
+    for (j=secnext(d, s, seclen, -1) ; j>=0 ; j=secnext(d, s, seclen, j)) {
+        fprintf(f,
+                "%-30s = %s\n",
+                d->key[j]+seclen+1,
+                d->val[j] ? d->val[j] : "");
     }
     fprintf(f, "\n");
     return ;
@@ -315,7 +317,6 @@ void iniparser_dumpsection_ini(dictionary * d, char * s, FILE * f)
 int iniparser_getsecnkeys(dictionary * d, char * s)
 {
     int     seclen, nkeys ;
-    char    keym[ASCIILINESZ+1];
     int j ;
 
     nkeys = 0;
@@ -324,14 +325,11 @@ int iniparser_getsecnkeys(dictionary * d, char * s)
     if (! iniparser_find_entry(d, s)) return nkeys;
 
     seclen  = (int)strlen(s);
-    sprintf(keym, "%s:", s);
-
-    for (j=0 ; j<d->size ; j++) {
-        if (d->key[j]==NULL)
-            continue ;
-        if (!strncmp(d->key[j], keym, seclen+1)) 
-            nkeys++;
+    if (strchr(s, ':')==NULL) {
+        return dictionary_secsize(d, s, seclen);
     }
+    for (j=secnext(d, s, seclen, -1) ; j>=0 ; j=secnext(d, s, seclen, j))
+        nkeys++;
 
     return nkeys;
 
@@ -357,7 +355,6 @@ char ** iniparser_getseckeys(dictionary * d, char * s)
     char **keys;
 
     int i, j ;
-    char    keym[ASCIILINESZ+1];
     int     seclen, nkeys ;
 
     keys = NULL;
@@ -370,17 +367,12 @@ char ** iniparser_getseckeys(dictionary * d, char * s)
     keys = (char**) malloc(nkeys*sizeof(char*));
 
     seclen  = (int)strlen(s);
-    sprintf(keym, "%s:", s);
     
     i = 0;
 
-    for (j=0 ; j<d->size ; j++) {
-        if (d->key[j]==NULL)
-            continue ;
-        if (!strncmp(d->key[j], keym, seclen+1)) {
-            keys[i] = d->key[j];
-            i++;
-        }
+    for (j=secnext(d, s, seclen, -1) ; j>=0 ; j=secnext(d, s, seclen, j)) {
+        keys[i] = d->key[j];
+        i++;
     }
 
     return keys;
@@ -577,72 +569,220 @@ void iniparser_unset(dictionary * ini, const char * entry)
     dictionary_unset(ini, entry);
 }
 
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Trim blanks from both ends of a span
+  @param    sp  Span to trim
+  @return   void
+ */
+/*--------------------------------------------------------------------------*/
+static void span_strip(line_span * sp)
+{
+    while (sp->len>0 && isspace((unsigned char)sp->ptr[0])) {
+        sp->ptr++ ;
+        sp->len-- ;
+    }
+    while (sp->len>0 && isspace((unsigned char)sp->ptr[sp->len-1])) {
+        sp->len-- ;
+    }
+}
+
 /*-------------------------------------------------------------------------*/
 /**
   @brief    Load a single line from an INI file
   @param    input_line  Input line, may be concatenated multi-line input
-  @param    section     Output space to store section
-  @param    key         Output space to store key
-  @param    value       Output space to store value
+  @param    len         Length of input line
+  @param    section     Output span of section name
+  @param    key         Output span of key
+  @param    value       Output span of value
   @return   line_status value
+
+  The line need not be NUL-terminated, and is not modified: the spans
+  which are returned point into it. For a LINE_SECTION whose brackets are
+  empty, section->ptr is set to NULL and the current section should be
+  left unchanged. For a LINE_VALUE, value->ptr always points somewhere
+  within the line following the equals sign, even if value->len is zero.
+
+  The line is classified in a single forward scan. The syntax accepted is
+  exactly that of the sscanf() formats previously tried in turn:
+
+  - "[%[^]]" for a section name;
+  - "%[^=] = \"%[^\"]\"" or "%[^=] = '%[^\']'" for a non-empty quoted
+    value, whose closing quote may be missing;
+  - "%[^=] = %[^;#]" for an unquoted value, up to any inline comment;
+  - "%[^=] = %[;#]" or "%[^=] %[=]" for an empty value.
+
+  A quoted value which is empty ("" or '') therefore falls through to the
+  unquoted form, and both forms treat a value of "" or '' as empty.
  */
 /*--------------------------------------------------------------------------*/
 static line_status iniparser_line(
     const char * input_line,
-    char * section,
-    char * key,
-    char * value)
+    int len,
+    line_span * section,
+    line_span * key,
+    line_span * value)
 {   
-    line_status sta ;
-    char        line[ASCIILINESZ+1];
-    int         len ;
-
-    strcpy(line, strstrip(input_line));
-    len = (int)strlen(line);
-
-    sta = LINE_UNPROCESSED ;
-    if (len<1) {
+    enum {
+        LEX_KEY,        /* Scanning the key, up to '=' */
+        LEX_EQUALS,     /* Skipping blanks after '=' */
+        LEX_QUOTED,     /* Within a quoted value */
+        LEX_PLAIN,      /* Within an unquoted value */
+        LEX_DONE
+    } state ;
+    const char  * p, * e, * c ;
+    const char  * vs=NULL, * ve=NULL ;
+    char          quote=0 ;
+
+    p = input_line ;
+    e = input_line + len ;
+    while (e>p && isspace((unsigned char)e[-1])) e-- ;
+    while (p<e && isspace((unsigned char)*p)) p++ ;
+
+    if (p==e) {
         /* Empty line */
-        sta = LINE_EMPTY ;
-    } else if (line[0]=='#' || line[0]==';') {
+        return LINE_EMPTY ;
+    }
+    if (*p=='#' || *p==';') {
         /* Comment line */
-        sta = LINE_COMMENT ; 
-    } else if (line[0]=='[' && line[len-1]==']') {
+        return LINE_COMMENT ;
+    }
+    if (*p=='[' && e[-1]==']') {
         /* Section name */
-        sscanf(line, "[%[^]]", section);
-        strcpy(section, strstrip(section));
-        strcpy(section, section);
-        sta = LINE_SECTION ;
-    } else if (sscanf (line, "%[^=] = \"%[^\"]\"", key, value) == 2
-           ||  sscanf (line, "%[^=] = '%[^\']'",   key, value) == 2
-           ||  sscanf (line, "%[^=] = %[^;#]",     key, value) == 2) {
-        /* Usual key=value, with or without comments */
-        strcpy(key, strstrip(key));
-        strcpy(value, strstrip(value));
-        /*
-         * sscanf cannot handle '' or "" as empty values
-         * this is done here
-         */
-        if (!strcmp(value, "\"\"") || (!strcmp(value, "''"))) {
-            value[0]=0 ;
+        for (c=p+1 ; *c!=']' ; c++)
+            ;
+        if (c==p+1) {
+            section->ptr = NULL ;
+            section->len = 0 ;
+        } else {
+            section->ptr = p + 1 ;
+            section->len = (int)(c - section->ptr) ;
+            span_strip(section);
         }
-        sta = LINE_VALUE ;
-    } else if (sscanf(line, "%[^=] = %[;#]", key, value)==2
-           ||  sscanf(line, "%[^=] %[=]", key, value) == 2) {
-        /*
-         * Special cases:
-         * key=
-         * key=;
-         * key=#
-         */
-        strcpy(key, strstrip(key));
-        value[0]=0 ;
-        sta = LINE_VALUE ;
-    } else {
+        return LINE_SECTION ;
+    }
+
+    key->ptr = p ;
+    key->len = 0 ;
+    state = LEX_KEY ;
+    for (c=p ; c<e && state!=LEX_DONE ; c++) {
+        switch (state) {
+            case LEX_KEY:
+            if (*c=='=') {
+                if (c==p) {
+                    /* Keys may not be empty */
+                    return LINE_ERROR ;
+                }
+                state = LEX_EQUALS ;
+            } else if (!isspace((unsigned char)*c)) {
+                key->len = (int)(c + 1 - p) ;
+            }
+            break ;
+
+            case LEX_EQUALS:
+            if (isspace((unsigned char)*c)) {
+                break ;
+            }
+            value->ptr = c ;
+            if (*c=='"' || *c=='\'') {
+                quote = *c ;
+                state = LEX_QUOTED ;
+                break ;
+            }
+            state = LEX_PLAIN ;
+            /* Fall through */
+
+            case LEX_PLAIN:
+            if (*c==';' || *c=='#') {
+                state = LEX_DONE ;
+            } else if (!isspace((unsigned char)*c)) {
+                if (vs==NULL) vs = c ;
+                ve = c + 1 ;
+            }
+            break ;
+
+            case LEX_QUOTED:
+            if (*c==quote) {
+                if (c==value->ptr+1) {
+                    /* An empty quoted value is read as unquoted */
+                    state = LEX_PLAIN ;
+                    vs = value->ptr ;
+                    ve = c + 1 ;
+                } else {
+                    state = LEX_DONE ;
+                }
+            } else if (!isspace((unsigned char)*c)) {
+                if (vs==NULL) vs = c ;
+                ve = c + 1 ;
+            }
+            break ;
+
+            default:
+            break ;
+        }
+    }
+
+    switch (state) {
+        case LEX_KEY:
         /* Generate syntax error */
-        sta = LINE_ERROR ;
+        return LINE_ERROR ;
+
+        case LEX_EQUALS:
+        /* key= */
+        value->ptr = e ;
+        value->len = 0 ;
+        return LINE_VALUE ;
+
+        case LEX_QUOTED:
+        if (e==value->ptr+1) {
+            /* A lone quote is read as unquoted */
+            vs = value->ptr ;
+            ve = e ;
+        }
+        break ;
+
+        default:
+        break ;
+    }
+    if (vs==NULL) {
+        /* key=; key=# or a blank quoted value */
+        value->len = 0 ;
+        return LINE_VALUE ;
+    }
+    value->ptr = vs ;
+    value->len = (int)(ve - vs) ;
+    /*
+     * '' and "" are read as empty values
+     */
+    if (value->len==2 &&
+        ((vs[0]=='"' && vs[1]=='"') || (vs[0]=='\'' && vs[1]=='\''))) {
+        value->len = 0 ;
     }
-    return sta ;
+    return LINE_VALUE ;
+}
+
+/*-------------------------------------------------------------------------*/
+/**
+  @brief    Ensure a scratch buffer is large enough
+  @param    buf     Pointer to buffer, reallocated as needed
+  @param    size    Pointer to current size of buffer
+  @param    len     Number of bytes required
+  @return   int 0 if Ok, -1 otherwise
+ */
+/*--------------------------------------------------------------------------*/
+static int buf_reserve(char ** buf, size_t * size, size_t len)
+{
+    char    *   p ;
+    size_t      n ;
+
+    if (len<=*size) return 0 ;
+    for (n=(*size ? *size : ASCIILINESZ) ; n<len ; n*=2)
+        ;
+    p = (char *)realloc(*buf, n);
+    if (p==NULL) return -1 ;
+    *buf = p ;
+    *size = n ;
+    return 0 ;
 }
 
 /*-------------------------------------------------------------------------*/
@@ -656,82 +796,193 @@ static line_status iniparser_line(
   should not be accessed directly, but through accessor functions
   instead.
 
+  The file is read into memory in one go rather than line by line, and
+  the buffer is handed to the dictionary: section names and values are
+  NUL-terminated in place and referenced directly from the buffer. Only
+  the "section:key" names, and the values of lines which were joined
+  together with a trailing backslash, are copied.
+
+  The file is read with read(2) rather than mapped. Linux discards even
+  the copied-on-write pages of a private mapping when the file is
+  truncated, so rewriting a file would change the strings of any
+  dictionary still loaded from it.
+
   The returned dictionary must be freed using iniparser_freedict().
  */
 /*--------------------------------------------------------------------------*/
 dictionary * iniparser_load(const char * ininame)
 {
-    FILE * in ;
-
-    char line    [ASCIILINESZ+1] ;
-    char section [ASCIILINESZ+1] ;
-    char key     [ASCIILINESZ+1] ;
-    char tmp     [ASCIILINESZ+1] ;
-    char val     [ASCIILINESZ+1] ;
+    int             fd ;
+    struct stat     st ;
+    ssize_t         got ;
+    size_t          size ;
+
+    char        *   map ;
+    char        *   end ;
+    char        *   p ;
+    char        *   eol ;
+    char        *   next ;
+    char        *   line ;
+    char        *   sec ;
+    char        *   val ;
+    char        *   join=NULL ;
+    char        *   secbuf=NULL ;
+    char        *   tmp=NULL ;
+    size_t          joinsz=0, secsz=0, tmpsz=0 ;
+    size_t          joinlen=0 ;
+    line_span       section, key, value ;
 
     int  last=0 ;
+    int  inplace ;
     int  len ;
     int  lineno=0 ;
     int  errs=0;
 
     dictionary * dict ;
 
-    if ((in=fopen(ininame, "r"))==NULL) {
+    if ((fd=open(ininame, O_RDONLY))<0) {
+		iniparser_logf("cannot open %s\n", ininame);
+        return NULL ;
+    }
+    if (fstat(fd, &st)<0) {
 		iniparser_logf("cannot open %s\n", ininame);
+        close(fd);
         return NULL ;
     }
 
-    dict = dictionary_new(0) ;
+    dict = dictionary_new_arena(0) ;
     if (!dict) {
-        fclose(in);
+        close(fd);
         return NULL ;
     }
-
-    memset(line,    0, ASCIILINESZ);
-    memset(section, 0, ASCIILINESZ);
-    memset(key,     0, ASCIILINESZ);
-    memset(val,     0, ASCIILINESZ);
-    last=0 ;
-
-    while (fgets(line+last, ASCIILINESZ-last, in)!=NULL) {
+    if (st.st_size==0) {
+        /* Nothing to read */
+        close(fd);
+        return dict ;
+    }
+    /*
+     * The file is copied rather than mapped: even the private pages of a
+     * MAP_PRIVATE mapping are discarded if the file is truncated, as
+     * happens when a configuration file is rewritten before a reload,
+     * and the loaded values would change underneath the dictionary.
+     */
+    map = (char *)malloc((size_t)st.st_size);
+    if (map==NULL) {
+        close(fd);
+        dictionary_del(dict);
+        return NULL ;
+    }
+    for (size=0 ; size<(size_t)st.st_size ; size+=got) {
+        got = read(fd, map + size, (size_t)st.st_size - size);
+        if (got<0) {
+            iniparser_logf("cannot read %s\n", ininame);
+            close(fd);
+            free(map);
+            dictionary_del(dict);
+            return NULL ;
+        }
+        if (got==0) {
+            /* The file shrank since fstat() */
+            break ;
+        }
+    }
+    close(fd);
+    dict->map = map ;
+    dict->maplen = size ;
+    end = map + size ;
+
+    sec = "" ;
+    for (p=map ; p<end && errs>=0 ; p=next) {
+        eol = memchr(p, '\n', end - p);
+        next = eol ? eol + 1 : end ;
+        if (eol==NULL) eol = end ;
         lineno++ ;
-        len = (int)strlen(line)-1;
-        if (len==0)
+        if (!last && next - p == 1)
             continue;
-        /* Safety check against buffer overflows */
-        if (line[len]!='\n' && !feof(in)) {
+        /* Lines are limited in length exactly as they were when they were
+           read through a fixed-size buffer */
+        if ((last ? joinlen : 0) + (next - p) + (eol==end) > ASCIILINESZ-1) {
             iniparser_logf("input line too long in %s (%d)\n",
                     ininame,
                     lineno);
             dictionary_del(dict);
-            fclose(in);
+            free(join);
+            free(secbuf);
+            free(tmp);
             return NULL ;
         }
         /* Get rid of \n and spaces at end of line */
-        while ((len>=0) &&
-                ((line[len]=='\n') || (isspace(line[len])))) {
-            line[len]=0 ;
+        if (!last) {
+            line = p ;
+            len = (int)(eol - p) ;
+        } else {
+            if (buf_reserve(&join, &joinsz, joinlen + (eol - p) + 1)) {
+                errs = -1 ;
+                break ;
+            }
+            memcpy(join + joinlen, p, eol - p);
+            joinlen += eol - p ;
+            line = join ;
+            len = (int)joinlen ;
+        }
+        while (len>0 && isspace((unsigned char)line[len-1])) {
             len-- ;
         }
         /* Detect multi-line */
-        if (line[len]=='\\') {
-            /* Multi-line value */
-            last=len ;
+        if (len>0 && line[len-1]=='\\') {
+            /* Multi-line value: the backslash is replaced by the next line */
+            if (!last) {
+                if (buf_reserve(&join, &joinsz, len)) {
+                    errs = -1 ;
+                    break ;
+                }
+                memcpy(join, line, len - 1);
+            }
+            joinlen = len - 1 ;
+            /* As before, a lone backslash joins nothing */
+            last = (joinlen > 0) ;
             continue ;
-        } else {
-            last=0 ;
         }
-        switch (iniparser_line(line, section, key, val)) {
+        inplace = !last ;
+        last = 0 ;
+        switch (iniparser_line(line, len, &section, &key, &value)) {
             case LINE_EMPTY:
             case LINE_COMMENT:
             break ;
 
             case LINE_SECTION:
-            errs = dictionary_set(dict, section, NULL);
+            if (section.ptr!=NULL) {
+                if (inplace) {
+                    /* Always followed by at least the closing bracket */
+                    sec = (char *)section.ptr ;
+                } else {
+                    if (buf_reserve(&secbuf, &secsz, section.len + 1)) {
+                        errs = -1 ;
+                        break ;
+                    }
+                    memcpy(secbuf, section.ptr, section.len);
+                    sec = secbuf ;
+                }
+                sec[section.len] = 0 ;
+            }
+            errs = dictionary_set(dict, sec, NULL);
             break ;
 
             case LINE_VALUE:
-            sprintf(tmp, "%s:%s", section, key);
+            if (buf_reserve(&tmp, &tmpsz, strlen(sec) + key.len + value.len + 3)) {
+                errs = -1 ;
+                break ;
+            }
+            len = sprintf(tmp, "%s:", sec);
+            memcpy(tmp + len, key.ptr, key.len);
+            tmp[len + key.len] = 0 ;
+            if (inplace && value.ptr + value.len < end) {
+                val = (char *)value.ptr ;
+            } else {
+                val = tmp + len + key.len + 1 ;
+                memcpy(val, value.ptr, value.len);
+            }
+            val[value.len] = 0 ;
             errs = dictionary_add(dict, tmp, val) ;
             break ;
 
@@ -739,15 +990,13 @@ dictionary * iniparser_load(const char * ininame)
             iniparser_logf("syntax error in %s (%d):\n",
                     ininame,
                     lineno);
-            iniparser_logf("-> %s\n", line);
+            iniparser_logf("-> %.*s\n", len, line);
             errs++ ;
             break;
 
             default:
             break ;
         }
-        memset(line, 0, ASCIILINESZ);
-        last=0;
         if (errs<0) {
             iniparser_logf("memory allocation failure\n");
             break ;
@@ -757,7 +1006,9 @@ dictionary * iniparser_load(const char * ininame)
         dictionary_del(dict);
         dict = NULL ;
     }
-    fclose(in);
+    free(join);
+    free(secbuf);
+    free(tmp);
     return dict ;
 }
 
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "dictionary.h"
+
+/*
+ * Hash benchmark: compares dictionary_hash() with the Jenkins
+ * one-at-a-time function it replaced, on generated "section:key" strings
+ * of the kind found in configuration files. For each function it reports
+ * throughput, the number of keys sharing a full 32-bit hash with another,
+ * and the number of keys landing in an already-occupied cell of a
+ * half-full power-of-two table (as the dictionary index is sized).
+ */
+
+#define NKEYS       100000
+#define ROUNDS      20
+
+static const char * sections[] = {
+    "global", "log", "http", "db", "cache", "sparql", "s3", "auth",
+    "instance", "cluster"
+};
+
+static const char * names[] = {
+    "configFile", "level", "facility", "timeout", "host", "port", "uri",
+    "user", "password", "enabled", "maxConnections", "bucket", "endpoint",
+    "ident", "stderr", "syslog"
+};
+
+static unsigned one_at_a_time(const char * key)
+{
+    int         len ;
+    unsigned    hash ;
+    int         i ;
+
+    len = strlen(key);
+    for (hash=0, i=0 ; i<len ; i++) {
+        hash += (unsigned)key[i] ;
+        hash += (hash<<10);
+        hash ^= (hash>>6) ;
+    }
+    hash += (hash <<3);
+    hash ^= (hash >>11);
+    hash += (hash <<15);
+    return hash ;
+}
+
+static double now(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9 ;
+}
+
+static int cmp_unsigned(const void * a, const void * b)
+{
+    unsigned x = *(const unsigned *)a ;
+    unsigned y = *(const unsigned *)b ;
+
+    return (x > y) - (x < y) ;
+}
+
+static void run(const char * label, unsigned (*fn)(const char *),
+                char ** keys, size_t bytes)
+{
+    unsigned  * h ;
+    char      * used ;
+    unsigned    sink, mask ;
+    int         i, r, dup, clash ;
+    double      start, elapsed ;
+
+    h = (unsigned *)malloc(NKEYS * sizeof(unsigned));
+    sink = 0 ;
+    start = now();
+    for (r=0 ; r<ROUNDS ; r++) {
+        for (i=0 ; i<NKEYS ; i++) {
+            sink += fn(keys[i]);
+        }
+    }
+    elapsed = now() - start ;
+
+    for (i=0 ; i<NKEYS ; i++) {
+        h[i] = fn(keys[i]);
+    }
+    for (mask=1 ; mask < 2 * NKEYS ; mask <<= 1)
+        ;
+    used = (char *)calloc(mask, 1);
+    mask -- ;
+    clash = 0 ;
+    for (i=0 ; i<NKEYS ; i++) {
+        if (used[h[i] & mask]) {
+            clash ++ ;
+        }
+        used[h[i] & mask] = 1 ;
+    }
+    qsort(h, NKEYS, sizeof(unsigned), cmp_unsigned);
+    dup = 0 ;
+    for (i=1 ; i<NKEYS ; i++) {
+        if (h[i]==h[i-1]) {
+            dup ++ ;
+        }
+    }
+    printf("%-16s %8.1f MB/s %8.1f Mkeys/s %6d full collisions %6d cell collisions (%u)\n",
+           label,
+           (double)bytes * ROUNDS / elapsed / 1e6,
+           (double)NKEYS * ROUNDS / elapsed / 1e6,
+           dup, clash, sink & 1);
+    free(used);
+    free(h);
+}
+
+int main(void)
+{
+    char ** keys ;
+    char    buf[128];
+    size_t  bytes ;
+    int     i ;
+
+    keys = (char **)malloc(NKEYS * sizeof(char *));
+    bytes = 0 ;
+    for (i=0 ; i<NKEYS ; i++) {
+        sprintf(buf, "%s%d:%s%d",
+                sections[i % (sizeof(sections) / sizeof(sections[0]))],
+                i / 160,
+                names[(i / 10) % (sizeof(names) / sizeof(names[0]))],
+                i % 10);
+        keys[i] = strdup(buf);
+        bytes += strlen(buf);
+    }
+    printf("%d keys, %.1f bytes average\n", NKEYS, (double)bytes / NKEYS);
+    run("one-at-a-time", one_at_a_time, keys, bytes);
+    run("dictionary_hash", dictionary_hash, keys, bytes);
+    for (i=0 ; i<NKEYS ; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+    return 0 ;
+}
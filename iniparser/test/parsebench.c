@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "iniparser.h"
+
+/*
+ * Parse throughput benchmark: loads the same file repeatedly and reports
+ * the rate at which it is parsed. By default the file produced by
+ * twisted-genhuge.py is used.
+ */
+
+static double now(void)
+{
+    struct timespec ts ;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9 ;
+}
+
+int main(int argc, char * argv[])
+{
+    dictionary * ini ;
+    char       * ini_name ;
+    struct stat  st ;
+    int          iterations ;
+    int          i ;
+    int          entries ;
+    double       start, elapsed ;
+
+    ini_name = "twisted-massive.ini" ;
+    iterations = 100 ;
+    if (argc>1) {
+        ini_name = argv[1] ;
+    }
+    if (argc>2) {
+        iterations = atoi(argv[2]) ;
+    }
+    if (stat(ini_name, &st)) {
+        fprintf(stderr, "cannot stat %s (run twisted-genhuge.py first?)\n",
+                ini_name);
+        return 1 ;
+    }
+
+    entries = 0 ;
+    start = now();
+    for (i=0 ; i<iterations ; i++) {
+        ini = iniparser_load(ini_name);
+        if (ini==NULL) {
+            return 1 ;
+        }
+        entries = ini->n ;
+        iniparser_freedict(ini);
+    }
+    elapsed = now() - start ;
+
+    printf("%s: %ld bytes, %d entries, %d iterations in %.3f s\n",
+           ini_name, (long)st.st_size, entries, iterations, elapsed);
+    printf("%.2f MB/s, %.0f entries/s, %.1f us per load\n",
+           (double)st.st_size * iterations / elapsed / 1e6,
+           (double)entries * iterations / elapsed,
+           elapsed / iterations * 1e6);
+    return 0 ;
+}
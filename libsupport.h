@@ -24,8 +24,119 @@
 # include <syslog.h>
 # include <errno.h>
 
+/* Overflow policies for asynchronous logging */
+# define LOG_ASYNC_DROP_NEWEST         0
+# define LOG_ASYNC_DROP_OLDEST         1
+# define LOG_ASYNC_BLOCK               2
+
+/* Encodings of structured messages logged with log_kv() */
+# define LOG_KV_LOGFMT                 0
+# define LOG_KV_JSON                   1
+
+/* Types of the values passed to log_kv(); the list of fields is terminated
+ * by LOG_KV_END in place of a key
+ */
+# define LOG_KV_END                    ((const char *) 0)
+# define LOG_KV_STRING                 1
+# define LOG_KV_INT                    2
+# define LOG_KV_LONG                   3
+# define LOG_KV_ULONG                  4
+# define LOG_KV_DOUBLE                 5
+# define LOG_KV_BOOL                   6
+
+/* Identifiers of the built-in sinks, for log_set_sink_level(), and the
+ * maximum number of sinks including those registered with log_add_sink()
+ */
+# define LOG_SINK_SYSLOG               0
+# define LOG_SINK_STDERR               1
+# define LOG_SINK_FILE                 2
+# define LOG_SINK_MAX                  16
+
+/* Precision of the timestamps of lines written to stderr or a file */
+# define LOG_TIMESTAMP_NONE            0
+# define LOG_TIMESTAMP_SECONDS         1
+# define LOG_TIMESTAMP_MILLISECONDS    2
+
+/* Message formats for the native syslog sink */
+# define LOG_SYSLOG_RFC3164            0
+# define LOG_SYSLOG_RFC5424            1
+
+/* The least severe level for which the LOG_*F() macros generate any code;
+ * define this before including libsupport.h (e.g., to LOG_INFO) to
+ * remove less severe log calls from a build altogether
+ */
+# ifndef LIBSUPPORT_LOG_MIN_LEVEL
+#  define LIBSUPPORT_LOG_MIN_LEVEL     LOG_DEBUG
+# endif
+
+/* Maximum number of log categories, including the default category, 0 */
+# define LOG_CATEGORY_MAX              64
+
+/* Evaluates to nonzero if a message at the given level in the given
+ * category (as returned by log_category()) would currently be logged; the
+ * comparison against LIBSUPPORT_LOG_MIN_LEVEL is resolved at compile time
+ * for a constant level
+ */
+# define LOG_CATEGORY_ENABLED(category, level) \
+	((level) <= LIBSUPPORT_LOG_MIN_LEVEL && \
+	 (level) <= __atomic_load_n(&(log_thresholds[(category)]), __ATOMIC_RELAXED))
+
+# define LOG_LEVEL_ENABLED(level)      LOG_CATEGORY_ENABLED(0, level)
+
+/* Log a message in a category, evaluating the arguments only if it will be
+ * logged, either because of its level or because its call site has been
+ * enabled with log_site_enable(); each call site records a struct
+ * log_site in the libsupport_log_sites section so that it can be found at
+ * runtime. The format must be a string literal.
+ */
+# define LOG_CPRINTF(category, level, ...) \
+	do \
+	{ \
+		if((level) <= LIBSUPPORT_LOG_MIN_LEVEL) \
+		{ \
+			static struct log_site log_site_ \
+				__attribute__((section("libsupport_log_sites"), used, aligned(sizeof(void *)))) = \
+				{ __FILE__, __func__, LOG_SITE_FORMAT_(__VA_ARGS__, 0), __LINE__, (level), 0 }; \
+			if(__builtin_expect(__atomic_load_n(&(log_site_.enabled), __ATOMIC_RELAXED), 0) || \
+			   (level) <= __atomic_load_n(&(log_thresholds[(category)]), __ATOMIC_RELAXED)) \
+			{ \
+				log_site_printf(&log_site_, (category), __VA_ARGS__); \
+			} \
+		} \
+	} \
+	while(0)
+
+# define LOG_SITE_FORMAT_(fmt, ...)    fmt
+
+# define LOG_PRINTF(level, ...)        LOG_CPRINTF(0, level, __VA_ARGS__)
+
+# define LOG_EMERGF(...)               LOG_PRINTF(LOG_EMERG, __VA_ARGS__)
+# define LOG_ALERTF(...)               LOG_PRINTF(LOG_ALERT, __VA_ARGS__)
+# define LOG_CRITF(...)                LOG_PRINTF(LOG_CRIT, __VA_ARGS__)
+# define LOG_ERRF(...)                 LOG_PRINTF(LOG_ERR, __VA_ARGS__)
+# define LOG_WARNINGF(...)             LOG_PRINTF(LOG_WARNING, __VA_ARGS__)
+# define LOG_NOTICEF(...)              LOG_PRINTF(LOG_NOTICE, __VA_ARGS__)
+# define LOG_INFOF(...)                LOG_PRINTF(LOG_INFO, __VA_ARGS__)
+# define LOG_DEBUGF(...)               LOG_PRINTF(LOG_DEBUG, __VA_ARGS__)
+
+typedef struct config_key_struct *config_key_t;
+
+/* A LOG_*F() call site; enabled is set by log_site_enable() to log the
+ * site's messages regardless of the log level
+ */
+struct log_site
+{
+	const char *file;
+	const char *func;
+	const char *format;
+	int line;
+	int level;
+	int enabled;
+};
+
 int config_init(int (*defaults_cb)(void));
 int config_load(const char *default_path);
+int config_reload(int (*fn)(const char *key, const char *oldval, const char *newval, void *data), void *data);
 int config_set(const char *key, const char *value);
 int config_set_default(const char *key, const char *value);
 size_t config_get(const char *key, const char *defval, char *buf, size_t bufsize);
@@ -34,15 +145,51 @@ char *config_geta(const char *key, const char *defval);
 int config_get_int(const char *key, int defval);
 int config_get_bool(const char *key, int defval);
 int config_get_all(const char *section, const char *key, int (*fn)(const char *key, const char *value, void *data), void *data);
+config_key_t config_key(const char *key);
+size_t config_get_k(config_key_t key, const char *defval, char *buf, size_t bufsize);
+char *config_geta_k(config_key_t key, const char *defval);
+int config_get_int_k(config_key_t key, int defval);
+int config_get_bool_k(config_key_t key, int defval);
+
+/* Used by LOG_CATEGORY_ENABLED(); not to be modified directly */
+extern int log_thresholds[LOG_CATEGORY_MAX];
 
 void log_vprintf(int level, const char *fmt, va_list ap);
 void log_printf(int level, const char *fmt, ...);
+void log_cprintf(int category, int level, const char *fmt, ...);
+void log_vcprintf(int category, int level, const char *fmt, va_list ap);
+void log_kv(int level, const char *msg, ...);
+void log_vkv(int level, const char *msg, va_list ap);
+void log_site_printf(struct log_site *site, int category, const char *fmt, ...);
+void log_signal_vprintf(int level, const char *fmt, va_list ap);
+void log_signal_printf(int level, const char *fmt, ...);
+int log_site_enable(const char *pattern, int enable);
 int log_reset(void);
 int log_set_level(int level);
+int log_category(const char *name);
+int log_set_category_level(int category, int level);
 int log_set_ident(const char *ident);
 int log_set_facility(int facility);
 int log_set_syslog(int val);
 int log_set_stderr(int val);
+int log_set_syslog_socket(const char *path);
+int log_set_syslog_format(int format);
 int log_set_use_config(int val);
+int log_set_async(int val);
+int log_set_async_policy(int policy);
+int log_set_deferred(int val);
+int log_set_rate_limit(int rate, int burst);
+int log_set_coalesce(int val);
+int log_add_sink(int level, void (*fn)(int level, const char *msg, void *data), void *data);
+int log_remove_sink(int sink);
+int log_set_sink_level(int sink, int level);
+int log_set_timestamp(int precision);
+int log_set_thread_id(int val);
+int log_set_file(const char *path);
+int log_set_file_rotation(size_t size, int interval, int keep);
+int log_set_flight_recorder(const char *path, size_t size);
+int log_set_kv_format(int format);
+int log_flush(void);
+unsigned long log_dropped(void);
 
 #endif /*!LIBSUPPORT_H_*/
@@ -21,237 +21,2611 @@
 # include "config.h"
 #endif
 
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE                   1
+#endif
+
 #include "p_libsupport.h"
 
-static int log_open(void);
+/* Default number of messages which may be queued in asynchronous mode */
+#define LOG_ASYNC_QUEUE                1024
+
+/* Maximum length of a message queued in asynchronous mode, including the
+ * terminating NUL; longer messages are truncated
+ */
+#define LOG_ASYNC_MSGSIZE              1000
+
+/* Size of the per-thread buffer holding the stderr prefix */
+#define LOG_PREFIX_SIZE                256
+
+/* Size of a complete file line prefix: the timestamp, the above and the
+ * level
+ */
+#define LOG_LINE_PREFIX_SIZE           (LOG_PREFIX_SIZE + 64)
+
+/* Number of format strings whose rate of logging is tracked by each
+ * thread; formats which collide share a token bucket until one of them
+ * displaces the other
+ */
+#define LOG_LIMIT_SLOTS                64
+
+/* Defaults for log:rateBurst and log:suppressInterval (in seconds) */
+#define LOG_LIMIT_BURST                10
+#define LOG_SUPPRESS_INTERVAL          10
+
+#ifdef CLOCK_MONOTONIC_COARSE
+# define LOG_CLOCK                     CLOCK_MONOTONIC_COARSE
+#else
+# define LOG_CLOCK                     CLOCK_MONOTONIC
+#endif
+
+/* The clock read for timestamps with a resolution of one second, for which
+ * the coarse clock's resolution of a few milliseconds is ample
+ */
+#ifdef CLOCK_REALTIME_COARSE
+# define LOG_STAMP_CLOCK               CLOCK_REALTIME_COARSE
+#else
+# define LOG_STAMP_CLOCK               CLOCK_REALTIME
+#endif
+
+/* Default size of the flight recorder's circular buffer */
+#define LOG_RECORDER_SIZE              (1024 * 1024)
+
+/* Maximum number of queued messages written at once by the writer thread
+ * (and, for the native syslog sink, sent with a single sendmmsg())
+ */
+#define LOG_ASYNC_BATCH                32
+
+/* Size of a "last message repeated N times" summary, which must hold the
+ * largest possible unsigned long
+ */
+#define LOG_REPEAT_SUMMARY_SIZE        64
+
+/* Default path of the local syslog socket */
+#define LOG_SYSLOG_PATH                "/dev/log"
+
+/* Size of the per-message portion of a syslog header: the priority and
+ * timestamp
+ */
+#define LOG_SYSLOG_HDRSIZE             64
+
+#ifdef __linux__
+# define LOG_HAVE_SENDMMSG              1
+#else
+struct mmsghdr
+{
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+/* Maximum length of a single conversion specification in a format string
+ * whose formatting is deferred
+ */
+#define LOG_SPEC_SIZE                  32
+
+/* Argument types recorded for deferred formatting */
+#define LOG_ARG_NONE                   0
+#define LOG_ARG_INT                    1
+#define LOG_ARG_LONG                   2
+#define LOG_ARG_LLONG                  3
+#define LOG_ARG_SIZE                   4
+#define LOG_ARG_PTRDIFF                5
+#define LOG_ARG_INTMAX                 6
+#define LOG_ARG_DOUBLE                 7
+#define LOG_ARG_LDOUBLE                8
+#define LOG_ARG_POINTER                9
+#define LOG_ARG_STRING                 10
+
+/* Size of the per-thread buffer in which stderr lines are formatted;
+ * longer lines are formatted into a temporary heap allocation
+ */
+#define LOG_LINE_SIZE                  1024
+
+/* Space held back in a structured message so that, if it must be
+ * truncated, it can still be marked as such and closed: the length of
+ * ,"truncated":true}
+ */
+#define LOG_KV_RESERVE                 18
+
+/* Defaults for the file sink: the size of each of its two buffers, the
+ * interval in milliseconds after which buffered messages are written, and
+ * the number of rotated files kept
+ */
+#define LOG_FILE_BUFSIZE               (64 * 1024)
+#define LOG_FILE_FLUSH_INTERVAL        1000
+#define LOG_FILE_KEEP                  5
+
+/* Flags for log_settings_commit_(): LOG_COMMIT_OPEN opens the log if it is
+ * not yet open, and LOG_COMMIT_REOPEN re-reads the configuration (if in
+ * use) and re-opens the syslog socket, log file and flight recorder
+ */
+#define LOG_COMMIT_OPEN                1
+#define LOG_COMMIT_REOPEN              2
+
+/* The resources of a struct log_settings which it owns */
+#define LOG_OWN_SYSLOG                 1
+#define LOG_OWN_FILE                   2
+#define LOG_OWN_RECORDER               4
+
+/* When and by which thread a queued message was logged, so that the
+ * writer thread's prefixes and timestamps describe the logging thread
+ * rather than itself
+ */
+struct log_origin
+{
+	struct timespec time;
+	unsigned long tid;
+};
+
+/* A queued message; seq implements the bounded MPMC queue described by
+ * Dmitry Vyukov: a cell at position pos may be filled when seq == pos,
+ * and consumed when seq == pos + 1. If format is NULL, msg is the
+ * formatted message; otherwise it holds the len bytes of argument values
+ * recorded by log_defer_capture_(), to be formatted by the writer thread
+ */
+struct log_cell
+{
+	size_t seq;
+	int level;
+	int len;
+	const char *format;
+	struct log_origin origin;
+	char msg[LOG_ASYNC_MSGSIZE];
+};
+
+/* A per-thread token bucket for messages with a particular format; the
+ * category, level and call site (if any) of the last message decide
+ * whether the summary of those suppressed is written
+ */
+struct log_limit
+{
+	const char *format;
+	int category;
+	int level;
+	struct log_site *site;
+	unsigned long suppressed;
+	double tokens;
+	uint64_t last;
+};
+
+/* A thread's token buckets, registered so that the messages it has
+ * suppressed can be reported by other threads once it stops logging or
+ * exits. The thread alone uses the tokens, but lock must be held to change
+ * a bucket's format or its suppressed message count (and their details).
+ * Records are reused, but never freed, as reporting threads may be
+ * scanning them at any time.
+ */
+struct log_limiter
+{
+	struct log_limiter *next;
+	int active;
+	pthread_mutex_t lock;
+	struct log_limit limits[LOG_LIMIT_SLOTS];
+};
+
+/* The last message written by a thread, and the number of times it has
+ * since been repeated without being written
+ */
+struct log_repeat
+{
+	char msg[LOG_LINE_SIZE];
+	size_t len;
+	int level;
+	unsigned long count;
+	uint64_t first;
+};
+
+/* A sink: the built-in sinks, LOG_SINK_SYSLOG, LOG_SINK_STDERR and
+ * LOG_SINK_FILE, have no fn; a registered sink whose fn is NULL has been
+ * removed. level is the least severe level written to the sink.
+ */
+struct log_sink
+{
+	void (*fn)(int level, const char *msg, void *data);
+	void *data;
+	int level;
+};
+
+/* A thread's most recently rendered timestamp, with a trailing space */
+struct log_stamp
+{
+	time_t sec;
+	long msec;
+	int precision;
+	size_t len;
+	char text[32];
+};
+
+/* The remaining space in the buffer into which log_vkv() encodes a
+ * message, as JSON if json is set; one byte is always reserved for the
+ * terminating NUL. full is set once anything has been truncated.
+ */
+struct log_kv_buf
+{
+	char *p;
+	char *end;
+	int json;
+	int full;
+};
+
+/* A conversion specification parsed by log_spec_() */
+struct log_spec
+{
+	char text[LOG_SPEC_SIZE];
+	int nstar;
+	int pstar;
+	int type;
+	int precision;
+};
+
+/* The asynchronous queue; producers and the consumer each advance their
+ * own position, kept on separate cache lines
+ */
+struct log_ring
+{
+	struct log_cell *cells;
+	size_t mask;
+	char pad0[SNAPSHOT_LINE_SIZE - sizeof(void *) - sizeof(size_t)];
+	size_t enqueue;
+	char pad1[SNAPSHOT_LINE_SIZE - sizeof(size_t)];
+	size_t dequeue;
+	char pad2[SNAPSHOT_LINE_SIZE - sizeof(size_t)];
+};
+
+/* The native syslog sink: fd is a datagram socket connected to the
+ * settings' syslog path; the tag (and, for RFC 5424, the header fields
+ * which follow the timestamp) are rendered when it is opened. lock is
+ * held for reading while fd is in use and for writing to replace it, and
+ * pid is the process which opened it.
+ */
+struct log_syslog
+{
+	int fd;
+	int pid;
+	char *tag;
+	char *fields;
+	size_t taglen;
+	size_t fieldslen;
+	pthread_rwlock_t lock;
+};
+
+/* The file sink: messages are appended to active, which is swapped with
+ * the empty spare buffer when it fills, and the pending buffer written to
+ * fd by the flusher thread; the flusher also writes out the active buffer
+ * after interval milliseconds, or at once if a message at flush_level or
+ * more severe is logged, and rotates the file when it reaches maxsize
+ * bytes or at the end of each period seconds
+ */
+struct log_file
+{
+	char *path;
+	size_t bufsize;
+	size_t maxsize;
+	int interval;
+	int flush_level;
+	int period;
+	int keep;
+	int pid;
+	int running;
+	int fd;
+	int stopping;
+	int urgent;
+	char *active;
+	char *spare;
+	char *pending;
+	size_t len;
+	size_t pending_len;
+	unsigned long swaps;
+	unsigned long flushed;
+	off_t size;
+	time_t rotate_at;
+	pthread_t flusher;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t space;
+};
+
+/* The flight recorder: a circular buffer of all messages, at every level,
+ * in a shared mapping of path
+ */
+struct log_recorder
+{
+	char *path;
+	struct log_recorder_header *hdr;
+	char *data;
+	size_t maplen;
+	int pid;
+};
+
+/* The log's configuration, published in log_domain and never modified once
+ * published (other than owns, under the domain lock). The syslog socket,
+ * file sink and flight recorder are opened by the thread changing the
+ * settings, or carried over from the previous settings if their
+ * parameters are unchanged; owns records those which are closed when the
+ * settings are destroyed. gen is unique to each published snapshot.
+ */
+struct log_settings
+{
+	int use_config;
+	char *ident;
+	int level;
+	int facility;
+	int use_syslog;
+	int use_stderr;
+	char *syslog_path;
+	int syslog_format;
+	int async;
+	size_t async_queue;
+	int async_policy;
+	int deferred;
+	double rate;
+	int burst;
+	int coalesce;
+	uint64_t suppress_interval;
+	int kv_format;
+	int timestamp;
+	int thread_id;
+	char *file_path;
+	size_t file_bufsize;
+	size_t file_maxsize;
+	int file_interval;
+	int file_flush_level;
+	int file_period;
+	int file_keep;
+	char *recorder_path;
+	size_t recorder_size;
+	struct log_sink sinks[LOG_SINK_MAX];
+	int nsinks;
+	int direct;
+	int gen;
+	struct log_syslog *conn;
+	struct log_file *file;
+	struct log_recorder *recorder;
+	int owns;
+};
+
+/* What log_signal_printf() needs of the settings, which a signal handler
+ * cannot pin: fd is a duplicate of the syslog socket (or -1), fields the
+ * RFC 5424 HOSTNAME and APP-NAME, and file the absolute path of the log
+ * file, which is opened afresh for each message so as to follow rotation.
+ * The flight recorder belongs to the settings, which are never destroyed
+ * before this has been replaced.
+ */
+struct log_signal
+{
+	int facility;
+	int use_syslog;
+	int use_stderr;
+	int syslog_format;
+	int timestamp;
+	int levels[LOG_SINK_FILE + 1];
+	int fd;
+	char *ident;
+	char *fields;
+	char *syslog_path;
+	char *file;
+	struct log_recorder *recorder;
+};
+
+static void log_init_(void);
+static void log_open_(void);
+static struct log_settings *log_settings_begin_(void);
+static void log_settings_abort_(struct log_settings *set);
+static int log_settings_commit_(struct log_settings *set, int flags);
+static void log_settings_config_(struct log_settings *set);
+static void log_settings_free_(void *ptr);
+static struct log_settings *log_settings_acquire_(void);
+static void log_settings_release_(void);
+static int log_strdup_(char **dest, const char *src);
+static int log_strcmp_(const char *a, const char *b);
+static void log_vprintf_(int category, int level, struct log_site *site, const char *id, const char *fmt, va_list ap);
+static void log_printf_(int level, const char *id, const char *fmt, ...);
+static void log_kv_put_(struct log_kv_buf *b, const char *s, size_t len);
+static void log_kv_key_(struct log_kv_buf *b, const char *key);
+static void log_kv_string_(struct log_kv_buf *b, const char *s);
+static void log_kv_number_(struct log_kv_buf *b, int neg, unsigned long v);
+static void log_category_resolve_(const struct log_settings *set, int force);
+static struct log_recorder *log_recorder_open_(const char *path, size_t size);
+static void log_recorder_close_(struct log_recorder *rec);
+static void log_recorder_vprintf_(const struct log_settings *set, int level, const char *fmt, va_list ap);
+static void log_recorder_append_(struct log_recorder *recorder, int level, int pid, const char *msg, size_t len);
+static void log_recorder_copy_(struct log_recorder *rec, uint64_t pos, const void *src, size_t len);
+static int log_site_match_(const struct log_site *site, const char *pattern);
+static void log_site_config_(void);
 static int log_parse_level(const char *level);
 static int log_parse_facility(const char *facility);
+static int log_parse_policy(const char *policy);
+static int log_parse_timestamp(const char *precision);
+static const char *log_level_prefix_(int level);
+static int log_sink_threshold_(const struct log_settings *set);
+static int log_prefix_(const struct log_settings *set, int level, int pid, const struct log_origin *origin, struct iovec *iov);
+static size_t log_stamp_(int precision, const struct timespec *time);
+static unsigned long log_thread_id_(void);
+static void log_stderr_write_(struct iovec *iov, int iovcnt);
+static void log_dispatch_(const struct log_settings *set, int level, const char *fmt, int defer, va_list ap);
+static void log_dispatchf_(const struct log_settings *set, int level, const char *fmt, ...);
+static uint64_t log_clock_(void);
+static int log_limit_(const struct log_settings *set, int category, int level, struct log_site *site, const char *fmt);
+static void log_limit_tick_(const struct log_settings *set, int writer);
+static void log_limit_flush_(const struct log_settings *set, struct log_limiter *limiter, int writer);
+static void log_limit_report_(const struct log_settings *set, struct log_limit *limit, int writer);
+static struct log_limiter *log_limiter_(void);
+static void log_limiter_exit_(void *ptr);
+static void log_emit_(const struct log_settings *set, const int *levels, const char **msgs, const struct log_origin *origins, int n);
+static void log_repeat_flush_(const struct log_settings *set, int force);
+static void log_sink_(const struct log_settings *set, const int *levels, const char **msgs, const struct log_origin *origins, int n);
+static struct log_syslog *log_syslog_open_(const struct log_settings *set);
+static void log_syslog_close_(struct log_syslog *conn);
+static int log_syslog_connect_(struct log_syslog *conn, const char *path);
+static int log_syslog_socket_(const char *path);
+static void log_syslog_send_(const struct log_settings *set, const int *levels, const char **msgs, const struct log_origin *origins, int n);
+static struct log_file *log_file_open_(const struct log_settings *set);
+static void log_file_close_(struct log_file *file);
+static void log_file_write_(const struct log_settings *set, const int *levels, const char **msgs, const struct log_origin *origins, int n);
+static void log_file_flush_(struct log_file *file);
+static void *log_file_thread_(void *arg);
+static void log_file_output_(struct log_file *file, const char *buf, size_t len);
+static void log_file_rotate_(struct log_file *file);
+static time_t log_file_deadline_(const struct log_file *file, time_t now);
+static int log_async_start_(size_t size);
+static void log_async_stop_(void);
+static void log_async_update_(void);
+static int log_async_enqueue_(const struct log_settings *set, int level, const char *fmt, int defer, va_list ap);
+static int log_async_dequeue_(struct log_ring *ring, int *level, const char **format, struct log_origin *origin, char *buf);
+static const char *log_spec_(const char *p, struct log_spec *spec);
+static int log_defer_capture_(char *buf, size_t size, const char *fmt, va_list ap);
+static void log_defer_render_(char *buf, size_t size, const char *fmt, const char *args);
+static void *log_async_thread_(void *arg);
+static void log_async_wake_(void);
+static struct log_signal *log_signal_create_(const struct log_settings *set);
+static void log_signal_destroy_(struct log_signal *sig);
+static void log_signal_replace_(struct log_signal *sig);
+static int log_signal_enqueue_(int level, const char *msg, size_t len);
+static void log_signal_syslog_(const struct log_signal *sig, int level, char *msg, size_t len);
+static void log_signal_line_(const struct log_signal *sig, int fd, int stamp, int level, char *msg, size_t len);
+static size_t log_signal_stamp_(char *buf, size_t size, int precision);
+static size_t log_signal_format_(char *buf, size_t size, const char *fmt, va_list ap);
+static size_t log_signal_snprintf_(char *buf, size_t size, const char *fmt, ...);
+static void log_signal_put_(char **p, const char *end, const char *s, size_t len);
+static void log_signal_fill_(char **p, const char *end, char c, int n);
+static void log_atfork_child_(void);
+
+/* The current settings: log_pending holds those made before the log is
+ * first opened, which happens when the first message is logged.
+ * log_configuring is set while a thread is changing the settings, so that
+ * anything it logs meanwhile doesn't try to open the log again, and
+ * log_pinned counts its nested calls into the log. log_forked is set in a
+ * child process, whose first message re-opens the log.
+ */
+static struct snapshot_domain log_domain;
+static pthread_once_t log_control = PTHREAD_ONCE_INIT;
+static struct log_settings *log_pending;
+static int log_prefix_gen, log_forked;
+static __thread int log_configuring, log_pinned;
+
+/* The least severe level which will currently be logged in each category,
+ * consulted by the LOG_*F() macros before their arguments are evaluated;
+ * INT_MAX while the log is not open (or a category's level has yet to be
+ * determined), so that the next message opens it
+ */
+int log_thresholds[LOG_CATEGORY_MAX] = { [0 ... LOG_CATEGORY_MAX - 1] = INT_MAX };
+
+/* The effective level of each category, the lesser of its own level and
+ * that of the least selective sink, which may be less than its threshold
+ * if the flight recorder is capturing messages below it
+ */
+static int log_levels[LOG_CATEGORY_MAX];
+
+static __thread char log_record_line[LOG_LINE_SIZE];
+
+/* Registered categories: log_category_level is the level configured for
+ * each, or -1 to use the settings' level; log_category_stale is set when a
+ * category has been registered and its level not yet looked up, and
+ * log_category_gen is the generation of the settings from which the
+ * thresholds were last computed
+ */
+static char *log_category_name[LOG_CATEGORY_MAX];
+static int log_category_level[LOG_CATEGORY_MAX];
+static int log_ncategories = 1, log_category_stale, log_category_gen;
+static pthread_mutex_t log_category_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread char log_line[LOG_LINE_SIZE];
+
+/* Prefixes of stderr and file lines: each thread renders the
+ * "ident[pid/tid]: " part of the prefix into log_prefix (with and without
+ * the process ID, for files and stderr) when the settings or, for the
+ * writer thread, the thread ID being reported change, and its timestamp
+ * into log_stamp when the second (or millisecond) changes. log_tid caches
+ * the calling thread's own ID.
+ */
+static __thread char log_prefix[2][LOG_PREFIX_SIZE];
+static __thread size_t log_prefix_len[2];
+static __thread int log_prefix_valid[2];
+static __thread unsigned long log_prefix_tid[2];
+static __thread struct log_stamp log_stamp;
+static __thread unsigned long log_tid;
+
+/* State for rate limiting: every thread's token buckets, the calling
+ * thread's own, and when suppressed messages were last reported
+ */
+static struct log_limiter *log_limiters;
+static pthread_key_t log_limiter_key;
+static __thread struct log_limiter *log_limiter;
+static uint64_t log_limit_reported;
 
-static int log_is_open, log_use_config, log_stderr = 0, log_level = LOG_NOTICE, log_facility = LOG_DAEMON, log_syslog = 1;
-static char *log_ident;
+/* Per-thread state for coalescing of repeated messages */
+static __thread struct log_repeat log_repeat;
+
+/* Asynchronous mode: log_async_ring is non-NULL while the writer thread is
+ * running, and log_async_users counts producers which may be using it
+ */
+static __thread char log_kv_line[LOG_LINE_SIZE];
+static struct log_ring *log_async_ring;
+static int log_async_users, log_async_stopping, log_async_sleeping, log_async_waiters;
+static unsigned long log_async_dropped, log_async_written;
+static pthread_t log_async_writer;
+static pthread_mutex_t log_async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_async_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_async_space = PTHREAD_COND_INITIALIZER;
+
+/* Whether the writer thread should be running, and the size of its queue,
+ * as last committed; log_async_control serialises starting and stopping
+ * it, which happens after the settings lock has been released
+ */
+static int log_async_want;
+static size_t log_async_want_queue;
+static pthread_mutex_t log_async_control = PTHREAD_MUTEX_INITIALIZER;
+
+/* Month names for RFC 3164 timestamps, which are always in English */
+static const char *log_months[12] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+	"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/* The state used by log_signal_printf(), replaced along with the
+ * settings; log_signal_users counts handlers which may be using it
+ */
+static struct log_signal *log_signal;
+static int log_signal_users;
+
+/* The bounds of the libsupport_log_sites section, provided by the linker
+ * if any LOG_*F() call sites exist
+ */
+extern struct log_site __start_libsupport_log_sites[] __attribute__((weak));
+extern struct log_site __stop_libsupport_log_sites[] __attribute__((weak));
 
 int
 log_set_ident(const char *ident)
 {
-	char *p;
+	struct log_settings *set;
 
-	if(ident)
+	set = log_settings_begin_();
+	if(!set)
 	{
-		p = strdup(ident);
-		if(!p)
-		{
-			return -1;
-		}
-		free(log_ident);
-		log_ident = p;
+		return -1;
 	}
-	log_use_config = 0;	
-	log_reset();
-	return 0;
+	if(ident && log_strdup_(&(set->ident), ident))
+	{
+		log_settings_abort_(set);
+		return -1;
+	}
+	set->use_config = 0;
+	return log_settings_commit_(set, 0);
 }
 
 int
 log_set_level(int level)
 {
-	log_use_config = 0;
-	log_level = level;
-	log_reset();
-	return 0;
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->level = level;
+	return log_settings_commit_(set, 0);
 }
 
 int
 log_set_facility(int facility)
 {
-	log_use_config = 0;
-	log_facility = facility;
-	log_reset();
-	return 0;
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->facility = facility;
+	return log_settings_commit_(set, 0);
 }
 
 int
 log_set_stderr(int val)
 {
-	log_use_config = 0;
-	log_stderr = val;
-	log_reset();
-	return 0;	
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->use_stderr = val;
+	return log_settings_commit_(set, 0);
 }
 
 int
 log_set_syslog(int val)
 {
-	log_use_config = 0;
-	log_syslog = val;
-	log_reset();
-	return 0;	
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->use_syslog = val;
+	return log_settings_commit_(set, 0);
 }
 
+/* Set the path of the local syslog socket; NULL selects the default */
 int
-log_set_use_config(int val)
+log_set_syslog_socket(const char *path)
 {
-	if(log_use_config == val)
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
 	{
-		return 0;
+		return -1;
 	}
-	log_use_config = val;
-	log_reset();
-	return 0;
+	if(log_strdup_(&(set->syslog_path), path))
+	{
+		log_settings_abort_(set);
+		return -1;
+	}
+	set->use_config = 0;
+	return log_settings_commit_(set, 0);
 }
 
+/* Select the syslog message format, LOG_SYSLOG_RFC3164 or
+ * LOG_SYSLOG_RFC5424
+ */
 int
-log_reset(void)
+log_set_syslog_format(int format)
 {
-	if(log_is_open && log_syslog)
+	struct log_settings *set;
+
+	if(format != LOG_SYSLOG_RFC3164 && format != LOG_SYSLOG_RFC5424)
 	{
-		closelog();
+		errno = EINVAL;
+		return -1;
 	}
-	log_is_open = 0;
-	return 0;
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->syslog_format = format;
+	return log_settings_commit_(set, 0);
 }
 
-void
-log_vprintf(int level, const char *fmt, va_list ap)
+/* Enable or disable asynchronous logging: when enabled, log_vprintf()
+ * formats the message into a bounded queue and returns, and a background
+ * thread writes queued messages to syslog or stderr
+ */
+int
+log_set_async(int val)
 {
-	if(!log_is_open)
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
 	{
-		log_open();
+		return -1;
 	}
-	if(level > log_level)
+	set->use_config = 0;
+	set->async = val;
+	return log_settings_commit_(set, 0);
+}
+
+/* Set the action taken when a message is logged in asynchronous mode and
+ * the queue is full: LOG_ASYNC_DROP_NEWEST discards the new message,
+ * LOG_ASYNC_DROP_OLDEST discards the oldest queued message to make room,
+ * and LOG_ASYNC_BLOCK waits for the writer thread to make room
+ */
+int
+log_set_async_policy(int policy)
+{
+	struct log_settings *set;
+
+	if(policy != LOG_ASYNC_DROP_NEWEST && policy != LOG_ASYNC_DROP_OLDEST && policy != LOG_ASYNC_BLOCK)
 	{
-		return;
+		errno = EINVAL;
+		return -1;
 	}
-	if(log_syslog)
+	set = log_settings_begin_();
+	if(!set)
 	{
-		vsyslog(level, fmt, ap);
+		return -1;
 	}
-	else
+	set->use_config = 0;
+	set->async_policy = policy;
+	return log_settings_commit_(set, 0);
+}
+
+/* Enable or disable deferred formatting: in asynchronous mode, messages
+ * logged via the LOG_*F() macros are queued as the raw values of their
+ * arguments, and formatted by the writer thread
+ */
+int
+log_set_deferred(int val)
+{
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
 	{
-		fprintf(stderr, "%s: ", log_ident);
-		switch(level)
-		{
-		case LOG_DEBUG:
-			fprintf(stderr, "[Debug] ");
-			break;
-		case LOG_INFO:
-			break;
-		case LOG_NOTICE:
-			fprintf(stderr, "Notice: ");
-			break;
-		case LOG_WARNING:
-			fprintf(stderr, "Warning: ");
-			break;
-		case LOG_ERR:
-			fprintf(stderr, "Error: ");
-			break;
-		case LOG_CRIT:
-			fprintf(stderr, "Critical: ");
-			break;
-		case LOG_EMERG:
-			fprintf(stderr, "Emergency: ");
-			break;
-		}
-		vfprintf(stderr, fmt, ap);
+		return -1;
 	}
+	set->use_config = 0;
+	set->deferred = val;
+	return log_settings_commit_(set, 0);
 }
 
-void
-log_printf(int level, const char *fmt, ...)
+/* Limit the rate at which each thread may log messages with the same
+ * format to rate per second, with bursts of up to burst messages; a rate
+ * of zero disables the limit. The number of messages suppressed is
+ * reported once per suppression interval, and when the thread exits.
+ */
+int
+log_set_rate_limit(int rate, int burst)
 {
-	va_list ap;
-	
-	va_start(ap, fmt);
-	log_vprintf(level, fmt, ap);
-	va_end(ap);
+	struct log_settings *set;
+
+	if(rate < 0 || burst < 1)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->rate = rate;
+	set->burst = burst;
+	return log_settings_commit_(set, 0);
 }
 
-static int
-log_open(void)
+/* Enable or disable coalescing of repeated messages: a message identical
+ * to the previous one is counted rather than written, and the count
+ * reported as "last message repeated N times"
+ */
+int
+log_set_coalesce(int val)
 {
-	int logopt;
-	char buf[32];
-	const char *ident;
-	
-	if(log_is_open)
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->coalesce = val;
+	return log_settings_commit_(set, 0);
+}
+
+/* Record messages at all levels in a circular buffer of size bytes (or a
+ * default size if zero) in a shared mapping of the file at path, which
+ * may be decoded with logdump after a crash; a NULL path disables the
+ * flight recorder
+ */
+int
+log_set_flight_recorder(const char *path, size_t size)
+{
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
 	{
-		log_reset();
+		return -1;
 	}
-	logopt = LOG_NDELAY|LOG_PID;
-	if(log_use_config)
+	if(log_strdup_(&(set->recorder_path), path))
 	{
-		free(log_ident);
-		log_stderr = config_get_bool("log:stderr", 0);
-		log_syslog = config_get_bool("log:syslog", 1);
-		config_get("log:level", "notice", buf, sizeof(buf));
-		log_level = log_parse_level(buf);
-		config_get("log:facility", "user", buf, sizeof(buf));
-		log_facility = log_parse_facility(buf);
-		config_get("log:ident", "(none)", buf, sizeof(buf));
-		ident = strdup(buf);
-		if(!ident)
-		{
-			return -1;
-		}
-		log_ident = (char *) ident;
+		log_settings_abort_(set);
+		return -1;
 	}
-	else
+	set->recorder_size = (size ? size : LOG_RECORDER_SIZE);
+	set->use_config = 0;
+	return log_settings_commit_(set, 0);
+}
+
+/* Register a function to be called with each message at level or more
+ * severe (and enabled by log_set_level() or the category's level),
+ * returning a sink identifier for log_set_sink_level() and
+ * log_remove_sink(), or -1 if there are too many sinks. The message is
+ * formatted once for all sinks, and includes its trailing newline, if
+ * any; in asynchronous mode, fn is called by the writer thread. fn must
+ * not change the log's settings.
+ */
+int
+log_add_sink(int level, void (*fn)(int level, const char *msg, void *data), void *data)
+{
+	struct log_settings *set;
+	int c;
+
+	if(!fn)
 	{
-		if(!log_ident)
-		{
-			log_ident = strdup("(none)");
-			if(!log_ident)
-			{
-				return -1;
-			}
-		}
+		errno = EINVAL;
+		return -1;
 	}
-	if(log_stderr)
+	set = log_settings_begin_();
+	if(!set)
 	{
-		logopt |= LOG_PERROR;
+		return -1;
 	}
-	if(log_syslog)
+	for(c = LOG_SINK_FILE + 1; c < set->nsinks && set->sinks[c].fn; c++);
+	if(c == LOG_SINK_MAX)
 	{
-		openlog(log_ident, logopt, log_facility);
+		log_settings_abort_(set);
+		errno = ENOSPC;
+		return -1;
 	}
-	log_is_open = 1;
-	return 0;
+	set->sinks[c].fn = fn;
+	set->sinks[c].data = data;
+	set->sinks[c].level = level;
+	if(c == set->nsinks)
+	{
+		set->nsinks++;
+	}
+	if(log_settings_commit_(set, 0))
+	{
+		return -1;
+	}
+	return c;
 }
 
-static int
-log_parse_level(const char *level)
+/* Unregister a sink added with log_add_sink(); fn is not called again
+ * once this returns
+ */
+int
+log_remove_sink(int sink)
 {
-	if(!strcasecmp(level, "emerg") || !strcasecmp(level, "emergency")) return LOG_EMERG;
-	if(!strcasecmp(level, "alert")) return LOG_ALERT;
-	if(!strcasecmp(level, "crit") || !strcasecmp(level, "critical")) return LOG_CRIT;
-	if(!strcasecmp(level, "err") || !strcasecmp(level, "error")) return LOG_ERR;
-	if(!strcasecmp(level, "warn") || !strcasecmp(level, "warning")) return LOG_WARNING;
-	if(!strcasecmp(level, "notice")) return LOG_NOTICE;
-	if(!strcasecmp(level, "info")) return LOG_INFO;
-	if(!strcasecmp(level, "debug")) return LOG_DEBUG;
-	return atoi(level);
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	if(sink <= LOG_SINK_FILE || sink >= set->nsinks || !set->sinks[sink].fn)
+	{
+		log_settings_abort_(set);
+		errno = EINVAL;
+		return -1;
+	}
+	set->sinks[sink].fn = NULL;
+	set->sinks[sink].data = NULL;
+	return log_settings_commit_(set, 0);
 }
 
-static int
-log_parse_facility(const char *facility)
+/* Set the least severe level written to a sink, either one returned by
+ * log_add_sink() or LOG_SINK_SYSLOG, LOG_SINK_STDERR or LOG_SINK_FILE;
+ * messages must also be enabled by log_set_level() or their category's
+ * level, including those from call sites enabled by log_site_enable()
+ */
+int
+log_set_sink_level(int sink, int level)
 {
-#ifdef LOG_AUTH
-	if(!strcasecmp(facility, "auth")) return LOG_AUTH;
-#endif
-#ifdef LOG_AUTHPRIV
-	if(!strcasecmp(facility, "authpriv")) return LOG_AUTHPRIV;
-#endif
-#ifdef LOG_CRON
-	if(!strcasecmp(facility, "cron")) return LOG_CRON;
-#endif
-#ifdef LOG_DAEMON
-	if(!strcasecmp(facility, "daemon")) return LOG_DAEMON;
-#endif
-#ifdef LOG_FTP
-	if(!strcasecmp(facility, "ftp")) return LOG_FTP;
-#endif
-#ifdef LOG_KERN
-	if(!strcasecmp(facility, "kern")) return LOG_KERN;
-#endif
-#ifdef LOG_LPR
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	if(sink < 0 || sink >= set->nsinks || (sink > LOG_SINK_FILE && !set->sinks[sink].fn))
+	{
+		log_settings_abort_(set);
+		errno = EINVAL;
+		return -1;
+	}
+	if(sink <= LOG_SINK_FILE)
+	{
+		set->use_config = 0;
+	}
+	set->sinks[sink].level = level;
+	return log_settings_commit_(set, 0);
+}
+
+/* Begin each line written to stderr or the log file with an ISO 8601
+ * timestamp in UTC, to the precision LOG_TIMESTAMP_SECONDS or
+ * LOG_TIMESTAMP_MILLISECONDS, or not if LOG_TIMESTAMP_NONE; lines written
+ * to a file are always timestamped, to the second by default
+ */
+int
+log_set_timestamp(int precision)
+{
+	struct log_settings *set;
+
+	if(precision != LOG_TIMESTAMP_NONE && precision != LOG_TIMESTAMP_SECONDS && precision != LOG_TIMESTAMP_MILLISECONDS)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->timestamp = precision;
+	return log_settings_commit_(set, 0);
+}
+
+/* Include the process and thread IDs in lines written to stderr or the
+ * log file
+ */
+int
+log_set_thread_id(int val)
+{
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->thread_id = val;
+	return log_settings_commit_(set, 0);
+}
+
+/* Write messages to the file at path, or stop doing so if path is NULL;
+ * when a file is in use, messages are written to stderr only if
+ * log_set_stderr() has been enabled
+ */
+int
+log_set_file(const char *path)
+{
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	if(log_strdup_(&(set->file_path), path))
+	{
+		log_settings_abort_(set);
+		return -1;
+	}
+	set->use_config = 0;
+	return log_settings_commit_(set, 0);
+}
+
+/* Rotate the log file when it reaches size bytes, and at the end of every
+ * interval seconds (measured from the Unix epoch, so that a daily
+ * rotation happens at midnight UTC), keeping keep rotated files as
+ * path.1, path.2, and so on; a size or interval of zero disables that
+ * trigger
+ */
+int
+log_set_file_rotation(size_t size, int interval, int keep)
+{
+	struct log_settings *set;
+
+	if(interval < 0 || keep < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->file_maxsize = size;
+	set->file_period = interval;
+	set->file_keep = keep;
+	return log_settings_commit_(set, 0);
+}
+
+/* Select the encoding of messages logged with log_kv(), LOG_KV_LOGFMT or
+ * LOG_KV_JSON
+ */
+int
+log_set_kv_format(int format)
+{
+	struct log_settings *set;
+
+	if(format != LOG_KV_LOGFMT && format != LOG_KV_JSON)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	set->kv_format = format;
+	return log_settings_commit_(set, 0);
+}
+
+/* Return the number of messages discarded because the asynchronous queue
+ * was full
+ */
+unsigned long
+log_dropped(void)
+{
+	return __atomic_load_n(&log_async_dropped, __ATOMIC_RELAXED);
+}
+
+/* Wait until every message queued or buffered before the call has been
+ * written
+ */
+int
+log_flush(void)
+{
+	struct log_settings *set;
+	struct log_ring *ring;
+	size_t target;
+
+	pthread_once(&log_control, log_init_);
+	__atomic_add_fetch(&log_async_users, 1, __ATOMIC_SEQ_CST);
+	ring = __atomic_load_n(&log_async_ring, __ATOMIC_SEQ_CST);
+	if(ring)
+	{
+		target = __atomic_load_n(&(ring->enqueue), __ATOMIC_ACQUIRE);
+		__atomic_sub_fetch(&log_async_users, 1, __ATOMIC_RELEASE);
+		pthread_mutex_lock(&log_async_lock);
+		__atomic_add_fetch(&log_async_waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_cond_signal(&log_async_cond);
+		while(__atomic_load_n(&log_async_ring, __ATOMIC_SEQ_CST) == ring && __atomic_load_n(&log_async_written, __ATOMIC_SEQ_CST) < target)
+		{
+			pthread_cond_wait(&log_async_space, &log_async_lock);
+		}
+		__atomic_sub_fetch(&log_async_waiters, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&log_async_lock);
+	}
+	else
+	{
+		__atomic_sub_fetch(&log_async_users, 1, __ATOMIC_RELEASE);
+	}
+	set = (struct log_settings *) snapshot_acquire(&log_domain);
+	if(set && set->file)
+	{
+		log_file_flush_(set->file);
+	}
+	snapshot_release(&log_domain);
+	return 0;
+}
+
+int
+log_set_use_config(int val)
+{
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	if(set->use_config == val)
+	{
+		log_settings_abort_(set);
+		return 0;
+	}
+	set->use_config = val;
+	return log_settings_commit_(set, LOG_COMMIT_REOPEN);
+}
+
+/* Re-read the configuration, if it is in use, and re-open the syslog
+ * socket, log file and flight recorder (for example, after the log file
+ * has been renamed by an external rotation); has no effect until the log
+ * has been opened.
+ *
+ * This takes locks and allocates memory, and so is not async-signal-safe:
+ * a SIGHUP handler must not call it directly, but should only set a
+ * volatile sig_atomic_t flag, which the application's main loop checks
+ * before calling log_reset().
+ */
+int
+log_reset(void)
+{
+	struct log_settings *set;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	return log_settings_commit_(set, LOG_COMMIT_REOPEN);
+}
+
+void
+log_vprintf(int level, const char *fmt, va_list ap)
+{
+	log_vprintf_(0, level, NULL, fmt, fmt, ap);
+}
+
+void
+log_printf(int level, const char *fmt, ...)
+{
+	va_list ap;
+	
+	va_start(ap, fmt);
+	log_vprintf_(0, level, NULL, fmt, fmt, ap);
+	va_end(ap);
+}
+
+void
+log_vcprintf(int category, int level, const char *fmt, va_list ap)
+{
+	log_vprintf_(category, level, NULL, fmt, fmt, ap);
+}
+
+void
+log_cprintf(int category, int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_vprintf_(category, level, NULL, fmt, fmt, ap);
+	va_end(ap);
+}
+
+/* Log a message from a LOG_*F() call site, regardless of the log level if
+ * the site has been enabled
+ */
+void
+log_site_printf(struct log_site *site, int category, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_vprintf_(category, site->level, site, fmt, fmt, ap);
+	va_end(ap);
+}
+
+/* Log a message from a signal handler, or from a child process between
+ * fork() and exec(), using only async-signal-safe functions. The message
+ * is formatted by log_signal_format_(), which supports a subset of
+ * printf() conversions, into a buffer on the stack, and recorded in the
+ * flight recorder if there is one. If asynchronous logging is enabled, a
+ * message less severe than LOG_CRIT is queued for the writer thread (which
+ * notices it within 100ms, as it cannot be woken from a signal handler)
+ * if there is room; otherwise it is written directly, with a single
+ * write() or send() to each of the syslog socket, stderr and the log file
+ * which are in use and whose level it meets. Registered sinks are called
+ * only when the message is queued, coalescing and rate limiting don't
+ * apply, and lines include the process ID. If the log has not been
+ * opened, the message is written to stderr.
+ */
+void
+log_signal_vprintf(int level, const char *fmt, va_list ap)
+{
+	struct log_signal *sig;
+	char buf[LOG_PREFIX_SIZE + LOG_LINE_SIZE + 1], *msg;
+	size_t len;
+	int e, fd;
+
+	e = errno;
+	msg = buf + LOG_PREFIX_SIZE;
+	len = log_signal_format_(msg, LOG_LINE_SIZE, fmt, ap);
+	if(len && msg[len - 1] == '\n')
+	{
+		len--;
+	}
+	__atomic_add_fetch(&log_signal_users, 1, __ATOMIC_SEQ_CST);
+	sig = __atomic_load_n(&log_signal, __ATOMIC_SEQ_CST);
+	if(!sig)
+	{
+		log_signal_line_(NULL, STDERR_FILENO, 0, level, msg, len);
+	}
+	else
+	{
+		if(sig->recorder)
+		{
+			log_recorder_append_(sig->recorder, level, (int) getpid(), msg, len);
+		}
+		if(level <= __atomic_load_n(&(log_levels[0]), __ATOMIC_RELAXED) &&
+		   (level <= LOG_CRIT || log_signal_enqueue_(level, msg, len)))
+		{
+			if(sig->use_syslog && level <= sig->levels[LOG_SINK_SYSLOG])
+			{
+				log_signal_syslog_(sig, level, msg, len);
+			}
+			if(sig->use_stderr && level <= sig->levels[LOG_SINK_STDERR])
+			{
+				log_signal_line_(sig, STDERR_FILENO, sig->timestamp, level, msg, len);
+			}
+			if(sig->file && level <= sig->levels[LOG_SINK_FILE])
+			{
+				fd = open(sig->file, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+				if(fd != -1)
+				{
+					log_signal_line_(sig, fd, (sig->timestamp ? sig->timestamp : LOG_TIMESTAMP_SECONDS), level, msg, len);
+					close(fd);
+				}
+			}
+		}
+	}
+	__atomic_sub_fetch(&log_signal_users, 1, __ATOMIC_RELEASE);
+	errno = e;
+}
+
+void
+log_signal_printf(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_signal_vprintf(level, fmt, ap);
+	va_end(ap);
+}
+
+/* Log a structured message: msg, followed by (key, type, value) triples
+ * terminated by LOG_KV_END, encoded as logfmt or JSON (according to
+ * log_set_kv_format() or log:kvFormat) into a per-thread buffer and
+ * written to the same sinks as log_printf(); messages too long for the
+ * buffer are truncated
+ */
+void
+log_kv(int level, const char *msg, ...)
+{
+	va_list ap;
+
+	va_start(ap, msg);
+	log_vkv(level, msg, ap);
+	va_end(ap);
+}
+
+void
+log_vkv(int level, const char *msg, va_list ap)
+{
+	struct log_settings *set;
+	struct log_kv_buf b;
+	const char *key;
+	char *mark;
+	double d;
+	long l;
+	unsigned long u;
+	int type, json, len;
+	char num[32];
+
+	if(level > __atomic_load_n(&(log_thresholds[0]), __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	set = log_settings_acquire_();
+	json = (set && set->kv_format == LOG_KV_JSON);
+	b.p = log_kv_line;
+	b.end = log_kv_line + sizeof(log_kv_line) - 1 - LOG_KV_RESERVE;
+	b.json = json;
+	b.full = 0;
+	log_kv_put_(&b, json ? "{" : "", json);
+	/* mark is the end of the last complete field */
+	mark = b.p;
+	log_kv_key_(&b, "msg");
+	log_kv_string_(&b, msg);
+	while(!b.full && (key = va_arg(ap, const char *)))
+	{
+		mark = b.p;
+		type = va_arg(ap, int);
+		log_kv_put_(&b, json ? "," : " ", 1);
+		log_kv_key_(&b, key);
+		switch(type)
+		{
+		case LOG_KV_STRING:
+			log_kv_string_(&b, va_arg(ap, const char *));
+			break;
+		case LOG_KV_INT:
+			l = va_arg(ap, int);
+			log_kv_number_(&b, l < 0, l < 0 ? -(unsigned long) l : (unsigned long) l);
+			break;
+		case LOG_KV_LONG:
+			l = va_arg(ap, long);
+			log_kv_number_(&b, l < 0, l < 0 ? -(unsigned long) l : (unsigned long) l);
+			break;
+		case LOG_KV_ULONG:
+			u = va_arg(ap, unsigned long);
+			log_kv_number_(&b, 0, u);
+			break;
+		case LOG_KV_DOUBLE:
+			d = va_arg(ap, double);
+			if(json && (isnan(d) || isinf(d)))
+			{
+				log_kv_put_(&b, "null", 4);
+				break;
+			}
+			len = snprintf(num, sizeof(num), "%.15g", d);
+			log_kv_put_(&b, num, len);
+			break;
+		case LOG_KV_BOOL:
+			if(va_arg(ap, int))
+			{
+				log_kv_put_(&b, "true", 4);
+			}
+			else
+			{
+				log_kv_put_(&b, "false", 5);
+			}
+			break;
+		default:
+			/* The remaining arguments cannot be interpreted */
+			log_kv_put_(&b, json ? "null" : "?", json ? 4 : 1);
+			key = NULL;
+			break;
+		}
+		if(!key)
+		{
+			break;
+		}
+	}
+	if(b.full)
+	{
+		/* Drop the incomplete field, which may end part-way through a
+		 * string or an escape sequence, and say that it was dropped
+		 */
+		b.p = mark;
+		b.end += LOG_KV_RESERVE;
+		if(b.p > log_kv_line + json)
+		{
+			log_kv_put_(&b, json ? "," : " ", 1);
+		}
+		log_kv_put_(&b, json ? "\"truncated\":true" : "truncated=true", json ? 16 : 14);
+	}
+	if(json)
+	{
+		*(b.p++) = '}';
+	}
+	*b.p = 0;
+	log_printf_(level, msg, "%s\n", log_kv_line);
+	log_settings_release_();
+}
+
+/* Register a named log category, or find one already registered, whose
+ * level may be set with log_set_category_level() or the configuration key
+ * "log:level.NAME"; returns the default category, 0, if no more categories
+ * can be registered
+ */
+int
+log_category(const char *name)
+{
+	char *p;
+	int c;
+
+	pthread_mutex_lock(&log_category_lock);
+	for(c = 1; c < log_ncategories; c++)
+	{
+		if(!strcmp(log_category_name[c], name))
+		{
+			pthread_mutex_unlock(&log_category_lock);
+			return c;
+		}
+	}
+	p = (log_ncategories < LOG_CATEGORY_MAX ? strdup(name) : NULL);
+	if(!p)
+	{
+		pthread_mutex_unlock(&log_category_lock);
+		return 0;
+	}
+	c = log_ncategories;
+	log_category_name[c] = p;
+	log_category_level[c] = -1;
+	__atomic_store_n(&(log_thresholds[c]), INT_MAX, __ATOMIC_RELAXED);
+	__atomic_store_n(&log_ncategories, c + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&log_category_stale, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log_category_lock);
+	return c;
+}
+
+/* Set the level of a category, or -1 to follow the global level */
+int
+log_set_category_level(int category, int level)
+{
+	struct log_settings *set;
+
+	if(category < 0 || category >= __atomic_load_n(&log_ncategories, __ATOMIC_ACQUIRE))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return -1;
+	}
+	set->use_config = 0;
+	if(category)
+	{
+		pthread_mutex_lock(&log_category_lock);
+		log_category_level[category] = level;
+		pthread_mutex_unlock(&log_category_lock);
+	}
+	else
+	{
+		set->level = level;
+	}
+	return log_settings_commit_(set, 0);
+}
+
+/* Enable or disable the LOG_*F() call sites matching a glob pattern, which
+ * is compared against the source file's path and base name, the function
+ * name, and "file:line" (using the base name); returns the number of
+ * sites matched
+ */
+int
+log_site_enable(const char *pattern, int enable)
+{
+	struct log_site *site;
+	int count;
+
+	count = 0;
+	if(!__start_libsupport_log_sites)
+	{
+		return 0;
+	}
+	for(site = __start_libsupport_log_sites; site < __stop_libsupport_log_sites; site++)
+	{
+		if(log_site_match_(site, pattern))
+		{
+			__atomic_store_n(&(site->enabled), enable, __ATOMIC_RELAXED);
+			count++;
+		}
+	}
+	return count;
+}
+
+static void
+log_init_(void)
+{
+	snapshot_init(&log_domain, log_settings_free_);
+	pthread_key_create(&log_limiter_key, log_limiter_exit_);
+	pthread_atfork(NULL, NULL, log_atfork_child_);
+}
+
+/* Open the log, unless another thread has done so first, or re-open it in
+ * a child process
+ */
+static void
+log_open_(void)
+{
+	struct log_settings *set;
+	int flags;
+
+	set = log_settings_begin_();
+	if(!set)
+	{
+		return;
+	}
+	flags = LOG_COMMIT_OPEN;
+	if(__atomic_load_n(&log_forked, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&log_forked, 0, __ATOMIC_RELAXED);
+		flags |= LOG_COMMIT_REOPEN;
+	}
+	else if(snapshot_current(&log_domain))
+	{
+		log_settings_abort_(set);
+		return;
+	}
+	log_settings_commit_(set, flags);
+}
+
+/* Lock the settings and return a copy of the current ones (or those made
+ * before the log was opened, or the defaults) for the caller to modify and
+ * pass to log_settings_commit_() or log_settings_abort_(); returns NULL,
+ * with the lock released, if the copy could not be made
+ */
+static struct log_settings *
+log_settings_begin_(void)
+{
+	struct log_settings *set, *cur;
+	int c;
+
+	pthread_once(&log_control, log_init_);
+	snapshot_lock(&log_domain);
+	set = (struct log_settings *) calloc(1, sizeof(struct log_settings));
+	if(!set)
+	{
+		snapshot_unlock(&log_domain);
+		return NULL;
+	}
+	cur = (struct log_settings *) snapshot_current(&log_domain);
+	if(!cur)
+	{
+		cur = log_pending;
+	}
+	if(cur)
+	{
+		*set = *cur;
+		set->ident = NULL;
+		set->syslog_path = NULL;
+		set->file_path = NULL;
+		set->recorder_path = NULL;
+		set->conn = NULL;
+		set->file = NULL;
+		set->recorder = NULL;
+		set->owns = 0;
+		if(log_strdup_(&(set->ident), cur->ident) ||
+		   log_strdup_(&(set->syslog_path), cur->syslog_path) ||
+		   log_strdup_(&(set->file_path), cur->file_path) ||
+		   log_strdup_(&(set->recorder_path), cur->recorder_path))
+		{
+			log_settings_abort_(set);
+			return NULL;
+		}
+		return set;
+	}
+	if(log_strdup_(&(set->ident), "(none)"))
+	{
+		log_settings_abort_(set);
+		return NULL;
+	}
+	set->level = LOG_NOTICE;
+	set->facility = LOG_DAEMON;
+	set->use_syslog = 1;
+	set->syslog_format = LOG_SYSLOG_RFC3164;
+	set->async_queue = LOG_ASYNC_QUEUE;
+	set->async_policy = LOG_ASYNC_DROP_NEWEST;
+	set->burst = LOG_LIMIT_BURST;
+	set->suppress_interval = LOG_SUPPRESS_INTERVAL * 1000000000ULL;
+	set->kv_format = LOG_KV_LOGFMT;
+	set->timestamp = LOG_TIMESTAMP_NONE;
+	set->file_bufsize = LOG_FILE_BUFSIZE;
+	set->file_interval = LOG_FILE_FLUSH_INTERVAL;
+	set->file_flush_level = LOG_ERR;
+	set->file_keep = LOG_FILE_KEEP;
+	set->recorder_size = LOG_RECORDER_SIZE;
+	for(c = 0; c < LOG_SINK_MAX; c++)
+	{
+		set->sinks[c].level = LOG_DEBUG;
+	}
+	set->nsinks = LOG_SINK_FILE + 1;
+	return set;
+}
+
+/* Discard settings obtained from log_settings_begin_() and release the lock */
+static void
+log_settings_abort_(struct log_settings *set)
+{
+	log_settings_free_(set);
+	snapshot_unlock(&log_domain);
+}
+
+/* Publish settings obtained from log_settings_begin_(), opening the
+ * resources they describe (or carrying them over from the current
+ * settings), and bring the thresholds and the writer thread into line;
+ * the lock is released. Until the log is opened, which flags may request,
+ * the settings are merely recorded.
+ *
+ * All of this happens on the thread changing the settings: a logging
+ * thread pins whichever settings are current when it starts, and the old
+ * settings are destroyed (closing their resources) only once no thread
+ * has them pinned; unless the calling thread is itself logging, this waits
+ * for that to happen. The wait, the destruction and starting or stopping
+ * the writer thread all happen after the lock is released, so that other
+ * threads changing the settings are not held up behind a blocked logger.
+ */
+static int
+log_settings_commit_(struct log_settings *set, int flags)
+{
+	struct log_settings *old, *prev;
+	int c, r;
+
+	old = (struct log_settings *) snapshot_current(&log_domain);
+	if(!old && !(flags & LOG_COMMIT_OPEN))
+	{
+		/* Nothing is opened until the first message is logged */
+		log_settings_free_(log_pending);
+		log_pending = set;
+		snapshot_unlock(&log_domain);
+		return 0;
+	}
+	log_configuring = 1;
+	if(set->use_config && (!old || (flags & LOG_COMMIT_REOPEN)))
+	{
+		log_settings_config_(set);
+	}
+	prev = ((flags & LOG_COMMIT_REOPEN) ? NULL : old);
+	if(set->use_syslog)
+	{
+		if(prev && prev->conn && !strcmp(prev->ident, set->ident) &&
+		   !log_strcmp_(prev->syslog_path, set->syslog_path) && prev->syslog_format == set->syslog_format)
+		{
+			set->conn = prev->conn;
+		}
+		else
+		{
+			set->conn = log_syslog_open_(set);
+		}
+		if(!set->conn)
+		{
+			/* Fall back to syslog(3), which keeps a pointer to the ident */
+			openlog(set->ident, LOG_NDELAY|LOG_PID, set->facility);
+		}
+	}
+	if(set->file_path)
+	{
+		if(prev && prev->file && !strcmp(prev->file_path, set->file_path) &&
+		   prev->file_bufsize == set->file_bufsize && prev->file_interval == set->file_interval &&
+		   prev->file_flush_level == set->file_flush_level && prev->file_maxsize == set->file_maxsize &&
+		   prev->file_period == set->file_period && prev->file_keep == set->file_keep)
+		{
+			set->file = prev->file;
+		}
+		else
+		{
+			/* On failure, fall back to syslog or stderr alone */
+			set->file = log_file_open_(set);
+		}
+	}
+	if(set->recorder_path)
+	{
+		if(prev && prev->recorder && !strcmp(prev->recorder_path, set->recorder_path) &&
+		   prev->recorder_size == set->recorder_size)
+		{
+			set->recorder = prev->recorder;
+		}
+		else
+		{
+			set->recorder = log_recorder_open_(set->recorder_path, set->recorder_size);
+		}
+	}
+	set->owns = (set->conn ? LOG_OWN_SYSLOG : 0) | (set->file ? LOG_OWN_FILE : 0) | (set->recorder ? LOG_OWN_RECORDER : 0);
+	if(old)
+	{
+		/* Anything carried over is no longer closed with the old settings */
+		if(set->conn && set->conn == old->conn)
+		{
+			old->owns &= ~LOG_OWN_SYSLOG;
+		}
+		if(set->file && set->file == old->file)
+		{
+			old->owns &= ~LOG_OWN_FILE;
+		}
+		if(set->recorder && set->recorder == old->recorder)
+		{
+			old->owns &= ~LOG_OWN_RECORDER;
+		}
+	}
+	/* Before the old settings, and so their flight recorder, can be
+	 * destroyed; on failure, signal handlers log to stderr
+	 */
+	log_signal_replace_(log_signal_create_(set));
+	set->direct = (set->use_syslog && !set->conn && !set->coalesce && !set->use_stderr && !set->file);
+	for(c = LOG_SINK_FILE + 1; c < set->nsinks; c++)
+	{
+		if(set->sinks[c].fn)
+		{
+			set->direct = 0;
+		}
+	}
+	if(old && old->use_syslog && !old->conn && !(set->use_syslog && !set->conn))
+	{
+		/* Before the old ident, to which syslog(3) may point, is freed */
+		closelog();
+	}
+	/* Threads re-render their prefixes, which include the ident and the
+	 * process ID, when they see a new generation
+	 */
+	set->gen = ++log_prefix_gen;
+	r = snapshot_publish(&log_domain, set);
+	log_settings_free_(log_pending);
+	log_pending = NULL;
+	log_category_resolve_(set, 1);
+	__atomic_store_n(&log_async_want_queue, set->async_queue, __ATOMIC_RELAXED);
+	__atomic_store_n(&log_async_want, set->async, __ATOMIC_RELEASE);
+	snapshot_unlock(&log_domain);
+	if(!log_pinned)
+	{
+		snapshot_synchronize(&log_domain);
+	}
+	log_async_update_();
+	log_configuring = 0;
+	return r;
+}
+
+/* Read the settings from the configuration */
+static void
+log_settings_config_(struct log_settings *set)
+{
+	char buf[32];
+
+	set->use_stderr = config_get_bool("log:stderr", 0);
+	set->use_syslog = config_get_bool("log:syslog", 1);
+	free(set->syslog_path);
+	set->syslog_path = config_geta("log:syslogSocket", NULL);
+	config_get("log:syslogFormat", "rfc3164", buf, sizeof(buf));
+	set->syslog_format = (strcasecmp(buf, "rfc5424") ? LOG_SYSLOG_RFC3164 : LOG_SYSLOG_RFC5424);
+	config_get("log:level", "notice", buf, sizeof(buf));
+	set->level = log_parse_level(buf);
+	config_get("log:facility", "user", buf, sizeof(buf));
+	set->facility = log_parse_facility(buf);
+	config_get("log:ident", "(none)", buf, sizeof(buf));
+	/* On failure, the previous ident is kept */
+	log_strdup_(&(set->ident), buf);
+	set->async = config_get_bool("log:async", 0);
+	config_get("log:asyncOverflow", "drop-newest", buf, sizeof(buf));
+	set->async_policy = log_parse_policy(buf);
+	set->async_queue = config_get_int("log:asyncQueue", LOG_ASYNC_QUEUE);
+	set->deferred = config_get_bool("log:deferred", 0);
+	set->rate = config_get_int("log:rateLimit", 0);
+	set->burst = config_get_int("log:rateBurst", LOG_LIMIT_BURST);
+	if(set->burst < 1)
+	{
+		set->burst = 1;
+	}
+	set->coalesce = config_get_bool("log:coalesce", 0);
+	set->suppress_interval = config_get_int("log:suppressInterval", LOG_SUPPRESS_INTERVAL) * 1000000000ULL;
+	config_get("log:timestamp", "none", buf, sizeof(buf));
+	set->timestamp = log_parse_timestamp(buf);
+	set->thread_id = config_get_bool("log:threadId", 0);
+	config_get("log:kvFormat", "logfmt", buf, sizeof(buf));
+	set->kv_format = (strcasecmp(buf, "json") ? LOG_KV_LOGFMT : LOG_KV_JSON);
+	config_get("log:syslogLevel", "debug", buf, sizeof(buf));
+	set->sinks[LOG_SINK_SYSLOG].level = log_parse_level(buf);
+	config_get("log:stderrLevel", "debug", buf, sizeof(buf));
+	set->sinks[LOG_SINK_STDERR].level = log_parse_level(buf);
+	config_get("log:fileLevel", "debug", buf, sizeof(buf));
+	set->sinks[LOG_SINK_FILE].level = log_parse_level(buf);
+	free(set->file_path);
+	set->file_path = config_geta("log:file", NULL);
+	set->file_bufsize = config_get_int("log:fileBuffer", LOG_FILE_BUFSIZE);
+	set->file_interval = config_get_int("log:fileFlushInterval", LOG_FILE_FLUSH_INTERVAL);
+	config_get("log:fileFlushLevel", "err", buf, sizeof(buf));
+	set->file_flush_level = log_parse_level(buf);
+	set->file_maxsize = config_get_int("log:fileMaxSize", 0);
+	set->file_period = config_get_int("log:fileRotateInterval", 0);
+	set->file_keep = config_get_int("log:fileKeep", LOG_FILE_KEEP);
+	free(set->recorder_path);
+	set->recorder_path = config_geta("log:flightRecorder", NULL);
+	set->recorder_size = config_get_int("log:flightRecorderSize", LOG_RECORDER_SIZE);
+	log_site_config_();
+}
+
+/* Destroy settings, closing the resources they own */
+static void
+log_settings_free_(void *ptr)
+{
+	struct log_settings *set;
+
+	set = (struct log_settings *) ptr;
+	if(!set)
+	{
+		return;
+	}
+	if(set->owns & LOG_OWN_SYSLOG)
+	{
+		log_syslog_close_(set->conn);
+	}
+	if(set->owns & LOG_OWN_FILE)
+	{
+		log_file_close_(set->file);
+	}
+	if(set->owns & LOG_OWN_RECORDER)
+	{
+		log_recorder_close_(set->recorder);
+	}
+	free(set->ident);
+	free(set->syslog_path);
+	free(set->file_path);
+	free(set->recorder_path);
+	free(set);
+}
+
+/* Pin the current settings for the duration of a call into the log,
+ * opening the log first if that hasn't happened yet (or since the process
+ * forked); log_settings_release_() must be called afterwards even if NULL
+ * is returned, which happens if the log could not be opened
+ */
+static struct log_settings *
+log_settings_acquire_(void)
+{
+	struct log_settings *set;
+
+	pthread_once(&log_control, log_init_);
+	set = (struct log_settings *) snapshot_acquire(&log_domain);
+	if((!set || __atomic_load_n(&log_forked, __ATOMIC_RELAXED)) && !log_pinned && !log_configuring)
+	{
+		snapshot_release(&log_domain);
+		log_open_();
+		set = (struct log_settings *) snapshot_acquire(&log_domain);
+	}
+	log_pinned++;
+	return set;
+}
+
+static void
+log_settings_release_(void)
+{
+	log_pinned--;
+	snapshot_release(&log_domain);
+}
+
+/* Replace *dest with a copy of src, which may be NULL */
+static int
+log_strdup_(char **dest, const char *src)
+{
+	char *p;
+
+	p = NULL;
+	if(src)
+	{
+		p = strdup(src);
+		if(!p)
+		{
+			return -1;
+		}
+	}
+	free(*dest);
+	*dest = p;
+	return 0;
+}
+
+/* Compare two strings, either of which may be NULL */
+static int
+log_strcmp_(const char *a, const char *b)
+{
+	if(!a || !b)
+	{
+		return (a != b);
+	}
+	return strcmp(a, b);
+}
+
+/* Log a message if its level is enabled or it comes from an enabled call
+ * site; the site is checked after opening the log, which may enable it.
+ * id identifies the message for rate limiting, and is normally the format.
+ */
+static void
+log_vprintf_(int category, int level, struct log_site *site, const char *id, const char *fmt, va_list ap)
+{
+	struct log_settings *set;
+	va_list cp;
+	int sink;
+
+	if(!site && level > __atomic_load_n(&(log_thresholds[category]), __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	set = log_settings_acquire_();
+	if(!set)
+	{
+		log_settings_release_();
+		return;
+	}
+	if(__atomic_load_n(&log_category_stale, __ATOMIC_ACQUIRE))
+	{
+		log_category_resolve_(set, 0);
+	}
+	sink = (level <= __atomic_load_n(&(log_levels[category]), __ATOMIC_RELAXED) ||
+			(site && __atomic_load_n(&(site->enabled), __ATOMIC_RELAXED)));
+	/* The flight recorder captures every message, however many the rate
+	 * limit would suppress
+	 */
+	if(set->recorder)
+	{
+		va_copy(cp, ap);
+		log_recorder_vprintf_(set, level, fmt, cp);
+		va_end(cp);
+	}
+	if(sink && !(set->rate > 0 && log_limit_(set, category, level, site, id)))
+	{
+		log_dispatch_(set, level, fmt, set->deferred && site && fmt == site->format, ap);
+	}
+	log_settings_release_();
+}
+
+/* Queue a message, or format and write it immediately */
+static void
+log_dispatch_(const struct log_settings *set, int level, const char *fmt, int defer, va_list ap)
+{
+	const char *msg;
+	va_list cp;
+	char *buf;
+	int len;
+
+	if(set->async && !log_async_enqueue_(set, level, fmt, defer, ap))
+	{
+		return;
+	}
+	if(set->direct)
+	{
+		if(level <= set->sinks[LOG_SINK_SYSLOG].level)
+		{
+			vsyslog(level, fmt, ap);
+		}
+		return;
+	}
+	buf = log_line;
+	va_copy(cp, ap);
+	len = vsnprintf(buf, LOG_LINE_SIZE, fmt, cp);
+	va_end(cp);
+	if(len < 0)
+	{
+		return;
+	}
+	if(len >= LOG_LINE_SIZE)
+	{
+		buf = (char *) malloc(len + 1);
+		if(buf)
+		{
+			vsnprintf(buf, len + 1, fmt, ap);
+		}
+		else
+		{
+			/* Write as much as fitted in the line buffer */
+			buf = log_line;
+		}
+	}
+	msg = buf;
+	log_emit_(set, &level, &msg, NULL, 1);
+	if(buf != log_line)
+	{
+		free(buf);
+	}
+}
+
+static void
+log_dispatchf_(const struct log_settings *set, int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_dispatch_(set, level, fmt, 0, ap);
+	va_end(ap);
+}
+
+static uint64_t
+log_clock_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(LOG_CLOCK, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+log_printf_(int level, const char *id, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	log_vprintf_(0, level, NULL, id, fmt, ap);
+	va_end(ap);
+}
+
+/* Append len bytes to a structured message, truncating it if full */
+static void
+log_kv_put_(struct log_kv_buf *b, const char *s, size_t len)
+{
+	if(len > (size_t) (b->end - b->p))
+	{
+		len = b->end - b->p;
+		b->full = 1;
+	}
+	memcpy(b->p, s, len);
+	b->p += len;
+}
+
+static void
+log_kv_key_(struct log_kv_buf *b, const char *key)
+{
+	if(b->json)
+	{
+		log_kv_string_(b, key);
+		log_kv_put_(b, ":", 1);
+	}
+	else
+	{
+		log_kv_put_(b, key, strlen(key));
+		log_kv_put_(b, "=", 1);
+	}
+}
+
+/* Append a string value, quoted and escaped as JSON requires, or for
+ * logfmt only if it is empty or contains spaces, quotes, '=' or control
+ * characters
+ */
+static void
+log_kv_string_(struct log_kv_buf *b, const char *s)
+{
+	const char *p, *start;
+	char esc[8];
+	int json;
+
+	json = b->json;
+	if(!s)
+	{
+		log_kv_put_(b, json ? "null" : "\"\"", json ? 4 : 2);
+		return;
+	}
+	if(!json)
+	{
+		for(p = s; *p && *p != ' ' && *p != '"' && *p != '=' && *p != '\\' && (unsigned char) *p >= 0x20; p++);
+		if(*s && !*p)
+		{
+			log_kv_put_(b, s, p - s);
+			return;
+		}
+	}
+	log_kv_put_(b, "\"", 1);
+	for(start = p = s; *p; p++)
+	{
+		if(*p != '"' && *p != '\\' && (unsigned char) *p >= 0x20)
+		{
+			continue;
+		}
+		log_kv_put_(b, start, p - start);
+		start = p + 1;
+		switch(*p)
+		{
+		case '"':
+			log_kv_put_(b, "\\\"", 2);
+			break;
+		case '\\':
+			log_kv_put_(b, "\\\\", 2);
+			break;
+		case '\n':
+			log_kv_put_(b, "\\n", 2);
+			break;
+		case '\t':
+			log_kv_put_(b, "\\t", 2);
+			break;
+		default:
+			snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char) *p);
+			log_kv_put_(b, esc, 6);
+			break;
+		}
+	}
+	log_kv_put_(b, start, p - start);
+	log_kv_put_(b, "\"", 1);
+}
+
+static void
+log_kv_number_(struct log_kv_buf *b, int neg, unsigned long v)
+{
+	char num[24], *p;
+
+	p = num + sizeof(num);
+	do
+	{
+		*(--p) = '0' + (v % 10);
+		v /= 10;
+	}
+	while(v);
+	if(neg)
+	{
+		*(--p) = '-';
+	}
+	log_kv_put_(b, p, num + sizeof(num) - p);
+}
+
+/* Take a token from the calling thread's bucket for fmt, returning nonzero
+ * if the message should be suppressed; also reports the messages which
+ * every thread has suppressed, if the suppression interval has elapsed
+ * since that was last done
+ */
+static int
+log_limit_(const struct log_settings *set, int category, int level, struct log_site *site, const char *fmt)
+{
+	struct log_limiter *limiter;
+	struct log_limit *limit, report;
+	uint64_t now;
+
+	log_limit_tick_(set, 0);
+	limiter = log_limiter_();
+	if(!limiter)
+	{
+		return 0;
+	}
+	now = log_clock_();
+	limit = &(limiter->limits[(((uintptr_t) fmt >> 4) ^ ((uintptr_t) fmt >> 10)) & (LOG_LIMIT_SLOTS - 1)]);
+	if(limit->format != fmt)
+	{
+		pthread_mutex_lock(&(limiter->lock));
+		report = *limit;
+		limit->format = fmt;
+		limit->suppressed = 0;
+		pthread_mutex_unlock(&(limiter->lock));
+		if(report.suppressed)
+		{
+			log_limit_report_(set, &report, 0);
+		}
+		limit->tokens = set->burst;
+		limit->last = now;
+	}
+	limit->tokens += (double) (now - limit->last) * set->rate / 1e9;
+	if(limit->tokens > set->burst)
+	{
+		limit->tokens = set->burst;
+	}
+	limit->last = now;
+	if(limit->tokens < 1)
+	{
+		pthread_mutex_lock(&(limiter->lock));
+		limit->category = category;
+		limit->level = level;
+		limit->site = site;
+		limit->suppressed++;
+		pthread_mutex_unlock(&(limiter->lock));
+		return 1;
+	}
+	limit->tokens -= 1;
+	return 0;
+}
+
+/* Report the messages suppressed by every thread, if the suppression
+ * interval has elapsed since that was last done; called by threads as they
+ * log, and periodically by the writer thread (writer nonzero), so that the
+ * messages suppressed by a thread are reported even if it logs nothing
+ * further
+ */
+static void
+log_limit_tick_(const struct log_settings *set, int writer)
+{
+	struct log_limiter *limiter;
+	uint64_t now, last;
+
+	now = log_clock_();
+	last = __atomic_load_n(&log_limit_reported, __ATOMIC_RELAXED);
+	if(now - last < set->suppress_interval ||
+	   !__atomic_compare_exchange_n(&log_limit_reported, &last, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	for(limiter = __atomic_load_n(&log_limiters, __ATOMIC_ACQUIRE); limiter; limiter = limiter->next)
+	{
+		log_limit_flush_(set, limiter, writer);
+	}
+}
+
+/* Report the messages suppressed by one thread's buckets; the details are
+ * taken under the lock (but not the tokens, which belong to the thread),
+ * and the summaries written after releasing it, as writing them may cause
+ * the same thread to log again
+ */
+static void
+log_limit_flush_(const struct log_settings *set, struct log_limiter *limiter, int writer)
+{
+	struct log_limit report[LOG_LIMIT_SLOTS], *limit;
+	int c, n;
+
+	pthread_mutex_lock(&(limiter->lock));
+	for(c = n = 0; c < LOG_LIMIT_SLOTS; c++)
+	{
+		limit = &(limiter->limits[c]);
+		if(limit->suppressed)
+		{
+			report[n].format = limit->format;
+			report[n].category = limit->category;
+			report[n].level = limit->level;
+			report[n].site = limit->site;
+			report[n++].suppressed = limit->suppressed;
+			limit->suppressed = 0;
+		}
+	}
+	pthread_mutex_unlock(&(limiter->lock));
+	for(c = 0; c < n; c++)
+	{
+		log_limit_report_(set, &(report[c]), writer);
+	}
+}
+
+static void
+log_limit_report_(const struct log_settings *set, struct log_limit *limit, int writer)
+{
+	const char *msg;
+	char summary[LOG_LINE_SIZE];
+	size_t len;
+
+	len = strlen(limit->format);
+	if(len && limit->format[len - 1] == '\n')
+	{
+		len--;
+	}
+	/* The summary is written only where the messages would have been,
+	 * which may have changed since they were suppressed
+	 */
+	if(!(limit->level <= __atomic_load_n(&(log_levels[limit->category]), __ATOMIC_RELAXED) ||
+	     (limit->site && __atomic_load_n(&(limit->site->enabled), __ATOMIC_RELAXED))))
+	{
+		return;
+	}
+	if(!writer)
+	{
+		log_dispatchf_(set, limit->level, "%lu messages suppressed by rate limit: %.*s\n", limit->suppressed, (int) len, limit->format);
+		return;
+	}
+	/* The writer thread cannot queue messages for itself, so writes the
+	 * summary directly, as for repeated messages
+	 */
+	snprintf(summary, sizeof(summary), "%lu messages suppressed by rate limit: %.*s\n", limit->suppressed, (int) len, limit->format);
+	msg = summary;
+	log_sink_(set, &(limit->level), &msg, NULL, 1);
+}
+
+/* Return the calling thread's token buckets, claiming a record left behind
+ * by an exited thread or allocating a new one if necessary; returns NULL
+ * if that fails, in which case nothing is suppressed
+ */
+static struct log_limiter *
+log_limiter_(void)
+{
+	struct log_limiter *limiter, *head;
+	int idle;
+
+	if(log_limiter)
+	{
+		return log_limiter;
+	}
+	for(limiter = __atomic_load_n(&log_limiters, __ATOMIC_ACQUIRE); limiter; limiter = limiter->next)
+	{
+		idle = 0;
+		if(__atomic_compare_exchange_n(&(limiter->active), &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+	if(!limiter)
+	{
+		limiter = (struct log_limiter *) calloc(1, sizeof(struct log_limiter));
+		if(!limiter)
+		{
+			return NULL;
+		}
+		limiter->active = 1;
+		pthread_mutex_init(&(limiter->lock), NULL);
+		head = __atomic_load_n(&log_limiters, __ATOMIC_RELAXED);
+		do
+		{
+			limiter->next = head;
+		}
+		while(!__atomic_compare_exchange_n(&log_limiters, &head, limiter, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	log_limiter = limiter;
+	pthread_setspecific(log_limiter_key, limiter);
+	return limiter;
+}
+
+/* Report the messages suppressed by an exiting thread, and release its
+ * token buckets, emptied, for reuse
+ */
+static void
+log_limiter_exit_(void *ptr)
+{
+	struct log_limiter *limiter;
+	struct log_settings *set;
+
+	limiter = (struct log_limiter *) ptr;
+	set = log_settings_acquire_();
+	if(set)
+	{
+		log_limit_flush_(set, limiter, 0);
+	}
+	log_settings_release_();
+	pthread_mutex_lock(&(limiter->lock));
+	memset(limiter->limits, 0, sizeof(limiter->limits));
+	pthread_mutex_unlock(&(limiter->lock));
+	log_limiter = NULL;
+	__atomic_store_n(&(limiter->active), 0, __ATOMIC_RELEASE);
+}
+
+/* Look up the levels of registered categories in the configuration, if it
+ * is in use, and publish the thresholds of all categories, if any are
+ * stale or force is set; nothing is done with settings older than those
+ * last used, which a thread logging with them may still have pinned
+ */
+static void
+log_category_resolve_(const struct log_settings *set, int force)
+{
+	char key[64], buf[32];
+	int c, level, sinks;
+
+	pthread_mutex_lock(&log_category_lock);
+	if((!force && !__atomic_load_n(&log_category_stale, __ATOMIC_RELAXED)) || set->gen < log_category_gen)
+	{
+		pthread_mutex_unlock(&log_category_lock);
+		return;
+	}
+	log_category_gen = set->gen;
+	sinks = log_sink_threshold_(set);
+	for(c = 0; c < log_ncategories; c++)
+	{
+		if(c && set->use_config)
+		{
+			snprintf(key, sizeof(key), "log:level.%s", log_category_name[c]);
+			log_category_level[c] = (config_get(key, NULL, buf, sizeof(buf)) ? log_parse_level(buf) : -1);
+		}
+		level = (c && log_category_level[c] >= 0 ? log_category_level[c] : set->level);
+		if(level > sinks)
+		{
+			/* No sink would write the less severe messages */
+			level = sinks;
+		}
+		__atomic_store_n(&log_levels[c], level, __ATOMIC_RELAXED);
+		/* The flight recorder captures messages at every level */
+		__atomic_store_n(&log_thresholds[c], (set->recorder && level < LOG_DEBUG ? LOG_DEBUG : level), __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&log_category_stale, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&log_category_lock);
+}
+
+/* Return the least severe level written to any sink in use, or -1 if there
+ * are none; stderr is used if neither syslog nor a file is, or if
+ * explicitly enabled
+ */
+static int
+log_sink_threshold_(const struct log_settings *set)
+{
+	int c, level;
+
+	level = -1;
+	if(set->use_syslog && set->sinks[LOG_SINK_SYSLOG].level > level)
+	{
+		level = set->sinks[LOG_SINK_SYSLOG].level;
+	}
+	if((set->use_stderr || (!set->use_syslog && !set->file)) && set->sinks[LOG_SINK_STDERR].level > level)
+	{
+		level = set->sinks[LOG_SINK_STDERR].level;
+	}
+	if(set->file && set->sinks[LOG_SINK_FILE].level > level)
+	{
+		level = set->sinks[LOG_SINK_FILE].level;
+	}
+	for(c = LOG_SINK_FILE + 1; c < set->nsinks; c++)
+	{
+		if(set->sinks[c].fn && set->sinks[c].level > level)
+		{
+			level = set->sinks[c].level;
+		}
+	}
+	return level;
+}
+
+/* Map the flight recorder file, creating or resetting it if necessary;
+ * returns NULL on failure
+ */
+static struct log_recorder *
+log_recorder_open_(const char *path, size_t size)
+{
+	struct log_recorder *rec;
+	struct log_recorder_header *hdr;
+	size_t datasize, maplen;
+	void *map;
+	int fd;
+
+	for(datasize = 4096; datasize < size; datasize <<= 1);
+	maplen = sizeof(struct log_recorder_header) + datasize;
+	rec = (struct log_recorder *) calloc(1, sizeof(struct log_recorder));
+	if(!rec)
+	{
+		return NULL;
+	}
+	rec->path = strdup(path);
+	if(!rec->path)
+	{
+		free(rec);
+		return NULL;
+	}
+	fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+	if(fd == -1)
+	{
+		log_recorder_close_(rec);
+		return NULL;
+	}
+	if(ftruncate(fd, maplen))
+	{
+		close(fd);
+		log_recorder_close_(rec);
+		return NULL;
+	}
+	map = mmap(NULL, maplen, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		log_recorder_close_(rec);
+		return NULL;
+	}
+	hdr = (struct log_recorder_header *) map;
+	if(memcmp(hdr->magic, LOG_RECORDER_MAGIC, sizeof(hdr->magic)) || hdr->version != LOG_RECORDER_VERSION ||
+	   hdr->hdrsize != sizeof(struct log_recorder_header) || hdr->datasize != datasize)
+	{
+		/* Start afresh; otherwise, records are appended to those left
+		 * by a previous process
+		 */
+		memset(map, 0, maplen);
+		memcpy(hdr->magic, LOG_RECORDER_MAGIC, sizeof(hdr->magic));
+		hdr->version = LOG_RECORDER_VERSION;
+		hdr->hdrsize = sizeof(struct log_recorder_header);
+		hdr->datasize = datasize;
+	}
+	rec->maplen = maplen;
+	rec->data = (char *) map + sizeof(struct log_recorder_header);
+	rec->pid = (int) getpid();
+	rec->hdr = hdr;
+	return rec;
+}
+
+static void
+log_recorder_close_(struct log_recorder *rec)
+{
+	if(rec->hdr)
+	{
+		munmap(rec->hdr, rec->maplen);
+	}
+	free(rec->path);
+	free(rec);
+}
+
+/* Format a message into the flight recorder; the sinks format their own
+ * copy, which is neither truncated to LOG_LINE_SIZE nor prevented from
+ * being deferred
+ */
+static void
+log_recorder_vprintf_(const struct log_settings *set, int level, const char *fmt, va_list ap)
+{
+	size_t len;
+	int r;
+
+	r = vsnprintf(log_record_line, sizeof(log_record_line), fmt, ap);
+	if(r < 0)
+	{
+		return;
+	}
+	len = ((size_t) r >= sizeof(log_record_line) ? sizeof(log_record_line) - 1 : (size_t) r);
+	log_recorder_append_(set->recorder, level, set->recorder->pid, log_record_line, len);
+}
+
+/* Append a record of a message to the flight recorder; only atomic
+ * operations and memcpy() are used, so this is async-signal-safe
+ */
+static void
+log_recorder_append_(struct log_recorder *recorder, int level, int pid, const char *msg, size_t len)
+{
+	struct log_record rec;
+	struct timespec ts;
+	uint64_t pos;
+	size_t max;
+
+	max = recorder->hdr->datasize / 4 - sizeof(struct log_record);
+	if(len > max)
+	{
+		len = max;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.magic = LOG_RECORD_MAGIC;
+	rec.len = len;
+	rec.time = (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec.level = level;
+	rec.pid = pid;
+	pos = __atomic_fetch_add(&(recorder->hdr->head),
+		(sizeof(struct log_record) + len + LOG_RECORD_ALIGN - 1) & ~(uint64_t) (LOG_RECORD_ALIGN - 1), __ATOMIC_RELAXED);
+	log_recorder_copy_(recorder, pos + sizeof(struct log_record), msg, len);
+	rec.pos = 0;
+	log_recorder_copy_(recorder, pos, &rec, sizeof(struct log_record));
+	/* Writing pos marks the record as complete; it is aligned within the
+	 * buffer, so is never split by the end of the buffer
+	 */
+	__atomic_store_n((uint64_t *) (recorder->data + ((pos + offsetof(struct log_record, pos)) & (recorder->hdr->datasize - 1))),
+		pos, __ATOMIC_RELEASE);
+}
+
+/* Copy len bytes to absolute position pos in the flight recorder,
+ * wrapping around the end of the buffer
+ */
+static void
+log_recorder_copy_(struct log_recorder *rec, uint64_t pos, const void *src, size_t len)
+{
+	size_t off, n;
+
+	off = pos & (rec->hdr->datasize - 1);
+	n = rec->hdr->datasize - off;
+	if(n > len)
+	{
+		n = len;
+	}
+	memcpy(rec->data + off, src, n);
+	if(n < len)
+	{
+		memcpy(rec->data, (const char *) src + n, len - n);
+	}
+}
+
+static int
+log_site_match_(const struct log_site *site, const char *pattern)
+{
+	char buf[256];
+	const char *base;
+
+	base = strrchr(site->file, '/');
+	base = (base ? base + 1 : site->file);
+	if(!fnmatch(pattern, site->file, 0) || !fnmatch(pattern, base, 0) ||
+	   !fnmatch(pattern, site->func, 0))
+	{
+		return 1;
+	}
+	snprintf(buf, sizeof(buf), "%s:%d", base, site->line);
+	return !fnmatch(pattern, buf, 0);
+}
+
+/* Apply the log:sites configuration key, a list of patterns separated by
+ * whitespace or commas: matching call sites are enabled, and all others
+ * disabled
+ */
+static void
+log_site_config_(void)
+{
+	char *patterns, *p, *save;
+
+	if(!__start_libsupport_log_sites)
+	{
+		return;
+	}
+	patterns = config_geta("log:sites", NULL);
+	log_site_enable("*", 0);
+	if(!patterns)
+	{
+		return;
+	}
+	for(p = strtok_r(patterns, " \t,", &save); p; p = strtok_r(NULL, " \t,", &save))
+	{
+		log_site_enable(p, 1);
+	}
+	free(patterns);
+}
+
+static int
+log_parse_level(const char *level)
+{
+	if(!strcasecmp(level, "emerg") || !strcasecmp(level, "emergency")) return LOG_EMERG;
+	if(!strcasecmp(level, "alert")) return LOG_ALERT;
+	if(!strcasecmp(level, "crit") || !strcasecmp(level, "critical")) return LOG_CRIT;
+	if(!strcasecmp(level, "err") || !strcasecmp(level, "error")) return LOG_ERR;
+	if(!strcasecmp(level, "warn") || !strcasecmp(level, "warning")) return LOG_WARNING;
+	if(!strcasecmp(level, "notice")) return LOG_NOTICE;
+	if(!strcasecmp(level, "info")) return LOG_INFO;
+	if(!strcasecmp(level, "debug")) return LOG_DEBUG;
+	return atoi(level);
+}
+
+static int
+log_parse_facility(const char *facility)
+{
+#ifdef LOG_AUTH
+	if(!strcasecmp(facility, "auth")) return LOG_AUTH;
+#endif
+#ifdef LOG_AUTHPRIV
+	if(!strcasecmp(facility, "authpriv")) return LOG_AUTHPRIV;
+#endif
+#ifdef LOG_CRON
+	if(!strcasecmp(facility, "cron")) return LOG_CRON;
+#endif
+#ifdef LOG_DAEMON
+	if(!strcasecmp(facility, "daemon")) return LOG_DAEMON;
+#endif
+#ifdef LOG_FTP
+	if(!strcasecmp(facility, "ftp")) return LOG_FTP;
+#endif
+#ifdef LOG_KERN
+	if(!strcasecmp(facility, "kern")) return LOG_KERN;
+#endif
+#ifdef LOG_LPR
 	if(!strcasecmp(facility, "lpr")) return LOG_LPR;
 #endif
 #ifdef LOG_MAIL
@@ -266,20 +2640,2313 @@ log_parse_facility(const char *facility)
 #ifdef LOG_SYSLOG
 	if(!strcasecmp(facility, "syslog")) return LOG_SYSLOG;
 #endif
-#ifdef LOG_REMOTAUTH
-	if(!strcasecmp(facility, "remoteauth")) return LOG_REMOTEAUTH;
+#ifdef LOG_REMOTAUTH
+	if(!strcasecmp(facility, "remoteauth")) return LOG_REMOTEAUTH;
+#endif
+#ifdef LOG_UUCP
+	if(!strcasecmp(facility, "uucp")) return LOG_UUCP;
+#endif
+	if(!strcasecmp(facility, "user")) return LOG_USER;
+	if(!strcasecmp(facility, "local0")) return LOG_LOCAL0;
+	if(!strcasecmp(facility, "local1")) return LOG_LOCAL1;
+	if(!strcasecmp(facility, "local2")) return LOG_LOCAL2;
+	if(!strcasecmp(facility, "local3")) return LOG_LOCAL3;
+	if(!strcasecmp(facility, "local4")) return LOG_LOCAL4;
+	if(!strcasecmp(facility, "local5")) return LOG_LOCAL5;
+	if(!strcasecmp(facility, "local6")) return LOG_LOCAL6;
+	if(!strcasecmp(facility, "local7")) return LOG_LOCAL7;
+	return LOG_USER;
+}
+
+static int
+log_parse_policy(const char *policy)
+{
+	if(!strcasecmp(policy, "drop-oldest")) return LOG_ASYNC_DROP_OLDEST;
+	if(!strcasecmp(policy, "block")) return LOG_ASYNC_BLOCK;
+	return LOG_ASYNC_DROP_NEWEST;
+}
+
+static int
+log_parse_timestamp(const char *precision)
+{
+	if(!strcasecmp(precision, "seconds") || !strcasecmp(precision, "s")) return LOG_TIMESTAMP_SECONDS;
+	if(!strcasecmp(precision, "milliseconds") || !strcasecmp(precision, "ms")) return LOG_TIMESTAMP_MILLISECONDS;
+	return LOG_TIMESTAMP_NONE;
+}
+
+static const char *
+log_level_prefix_(int level)
+{
+	switch(level)
+	{
+	case LOG_DEBUG:
+		return "[Debug] ";
+	case LOG_NOTICE:
+		return "Notice: ";
+	case LOG_WARNING:
+		return "Warning: ";
+	case LOG_ERR:
+		return "Error: ";
+	case LOG_CRIT:
+		return "Critical: ";
+	case LOG_EMERG:
+		return "Emergency: ";
+	}
+	return "";
+}
+
+/* Point iov at the parts of the "timestamp ident[pid/tid]: Level: " prefix
+ * of a stderr or file line, from the calling thread's cache, returning the
+ * number used; pid is set to include the process ID even if thread IDs
+ * are not enabled, and a file line is always timestamped. The time and
+ * thread ID are those of origin, if not NULL, or else the current ones.
+ * The parts remain valid only until the thread's next call.
+ */
+static int
+log_prefix_(const struct log_settings *set, int level, int pid, const struct log_origin *origin, struct iovec *iov)
+{
+	const char *lp;
+	unsigned long tid;
+	int n, len;
+
+	n = 0;
+	if(set->timestamp || pid)
+	{
+		iov[n].iov_len = log_stamp_(set->timestamp ? set->timestamp : LOG_TIMESTAMP_SECONDS, origin ? &(origin->time) : NULL);
+		iov[n].iov_base = log_stamp.text;
+		n++;
+	}
+	pid = !!pid;
+	tid = (set->thread_id ? (origin ? origin->tid : log_thread_id_()) : 0);
+	if(log_prefix_valid[pid] != set->gen || log_prefix_tid[pid] != tid)
+	{
+		if(set->thread_id)
+		{
+#ifdef SYS_gettid
+			len = snprintf(log_prefix[pid], LOG_PREFIX_SIZE, "%s[%d/%lu]: ", set->ident, (int) getpid(), tid);
+#else
+			len = snprintf(log_prefix[pid], LOG_PREFIX_SIZE, "%s[%d/%lx]: ", set->ident, (int) getpid(), tid);
+#endif
+		}
+		else if(pid)
+		{
+			len = snprintf(log_prefix[pid], LOG_PREFIX_SIZE, "%s[%d]: ", set->ident, (int) getpid());
+		}
+		else
+		{
+			len = snprintf(log_prefix[pid], LOG_PREFIX_SIZE, "%s: ", set->ident);
+		}
+		log_prefix_len[pid] = (len < 0 ? 0 : (len >= LOG_PREFIX_SIZE ? LOG_PREFIX_SIZE - 1 : (size_t) len));
+		log_prefix_valid[pid] = set->gen;
+		log_prefix_tid[pid] = tid;
+	}
+	iov[n].iov_base = log_prefix[pid];
+	iov[n].iov_len = log_prefix_len[pid];
+	n++;
+	lp = log_level_prefix_(level);
+	if(*lp)
+	{
+		iov[n].iov_base = (void *) lp;
+		iov[n].iov_len = strlen(lp);
+		n++;
+	}
+	return n;
+}
+
+/* Return the length of the calling thread's timestamp of time (or, if it
+ * is NULL, the current time), re-rendering it only if the time has changed
+ * at the requested precision
+ */
+static size_t
+log_stamp_(int precision, const struct timespec *time)
+{
+	struct timespec ts;
+	struct tm tm;
+	long msec;
+
+	if(time)
+	{
+		ts = *time;
+	}
+	else
+	{
+		clock_gettime(precision == LOG_TIMESTAMP_MILLISECONDS ? CLOCK_REALTIME : LOG_STAMP_CLOCK, &ts);
+	}
+	msec = (precision == LOG_TIMESTAMP_MILLISECONDS ? ts.tv_nsec / 1000000 : 0);
+	if(ts.tv_sec == log_stamp.sec && precision == log_stamp.precision && log_stamp.len)
+	{
+		if(msec != log_stamp.msec)
+		{
+			/* Only the milliseconds digits of "...:SS.mmmZ " change */
+			log_stamp.text[20] = '0' + msec / 100;
+			log_stamp.text[21] = '0' + (msec / 10) % 10;
+			log_stamp.text[22] = '0' + msec % 10;
+			log_stamp.msec = msec;
+		}
+		return log_stamp.len;
+	}
+	gmtime_r(&(ts.tv_sec), &tm);
+	log_stamp.len = strftime(log_stamp.text, sizeof(log_stamp.text), "%Y-%m-%dT%H:%M:%S", &tm);
+	if(log_stamp.len != 19)
+	{
+		/* A year beyond 9999 */
+		log_stamp.len = 0;
+		return 0;
+	}
+	if(precision == LOG_TIMESTAMP_MILLISECONDS)
+	{
+		strcpy(log_stamp.text + 19, ".000Z ");
+		log_stamp.text[20] = '0' + msec / 100;
+		log_stamp.text[21] = '0' + (msec / 10) % 10;
+		log_stamp.text[22] = '0' + msec % 10;
+		log_stamp.len = 25;
+	}
+	else
+	{
+		strcpy(log_stamp.text + 19, "Z ");
+		log_stamp.len = 21;
+	}
+	log_stamp.sec = ts.tv_sec;
+	log_stamp.msec = msec;
+	log_stamp.precision = precision;
+	return log_stamp.len;
+}
+
+/* Return the calling thread's ID, as shown in prefixes */
+static unsigned long
+log_thread_id_(void)
+{
+	if(!log_tid)
+	{
+#ifdef SYS_gettid
+		log_tid = (unsigned long) syscall(SYS_gettid);
+#else
+		log_tid = (unsigned long) pthread_self();
+#endif
+	}
+	return log_tid;
+}
+
+/* Write the contents of iov to stderr, resuming after short writes;
+ * errno is preserved
+ */
+static void
+log_stderr_write_(struct iovec *iov, int iovcnt)
+{
+	ssize_t r;
+	int e;
+
+	e = errno;
+	while(iovcnt)
+	{
+		r = writev(STDERR_FILENO, iov, iovcnt);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		while(iovcnt && (size_t) r >= iov->iov_len)
+		{
+			r -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt)
+		{
+			iov->iov_base = (char *) iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+	errno = e;
+}
+
+/* Write already-formatted messages, coalescing repeated messages if
+ * enabled; repeats are tracked per thread (in asynchronous mode, all
+ * messages are written by the writer thread). origins is NULL if the
+ * messages were logged by the calling thread just now.
+ */
+static void
+log_emit_(const struct log_settings *set, const int *levels, const char **msgs, const struct log_origin *origins, int n)
+{
+	char summary[LOG_ASYNC_BATCH][LOG_REPEAT_SUMMARY_SIZE];
+	const char *out[2 * LOG_ASYNC_BATCH];
+	int outlevels[2 * LOG_ASYNC_BATCH];
+	struct log_origin outorigins[2 * LOG_ASYNC_BATCH];
+	uint64_t now;
+	size_t len;
+	int c, nout;
+
+	if(!set->coalesce)
+	{
+		log_sink_(set, levels, msgs, origins, n);
+		return;
+	}
+	now = log_clock_();
+	nout = 0;
+	for(c = 0; c < n; c++)
+	{
+		len = strlen(msgs[c]);
+		if(log_repeat.len && len == log_repeat.len && levels[c] == log_repeat.level &&
+		   !memcmp(msgs[c], log_repeat.msg, len))
+		{
+			if(!log_repeat.count)
+			{
+				log_repeat.first = now;
+			}
+			log_repeat.count++;
+			if(now - log_repeat.first < set->suppress_interval)
+			{
+				continue;
+			}
+		}
+		else
+		{
+			log_repeat.len = 0;
+		}
+		if(log_repeat.count)
+		{
+			snprintf(summary[c], sizeof(summary[c]), "last message repeated %lu times\n", log_repeat.count);
+			outlevels[nout] = log_repeat.level;
+			out[nout] = summary[c];
+			if(origins)
+			{
+				outorigins[nout] = origins[c];
+			}
+			nout++;
+			log_repeat.count = 0;
+		}
+		if(log_repeat.len)
+		{
+			/* The summary is written in place of the repeated message */
+			continue;
+		}
+		outlevels[nout] = levels[c];
+		out[nout] = msgs[c];
+		if(origins)
+		{
+			outorigins[nout] = origins[c];
+		}
+		nout++;
+		if(len < sizeof(log_repeat.msg))
+		{
+			memcpy(log_repeat.msg, msgs[c], len);
+			log_repeat.len = len;
+			log_repeat.level = levels[c];
+		}
+	}
+	if(nout)
+	{
+		log_sink_(set, outlevels, out, origins ? outorigins : NULL, nout);
+	}
+}
+
+/* Report the number of times the last message has been repeated, if any,
+ * and if either force is set or the suppression interval has elapsed
+ */
+static void
+log_repeat_flush_(const struct log_settings *set, int force)
+{
+	const char *msg;
+	char summary[LOG_REPEAT_SUMMARY_SIZE];
+
+	if(!log_repeat.count || (!force && log_clock_() - log_repeat.first < set->suppress_interval))
+	{
+		return;
+	}
+	snprintf(summary, sizeof(summary), "last message repeated %lu times\n", log_repeat.count);
+	msg = summary;
+	log_sink_(set, &(log_repeat.level), &msg, NULL, 1);
+	log_repeat.count = 0;
+}
+
+/* Write already-formatted messages to each sink in use whose level they
+ * meet; origins is as for log_emit_()
+ */
+static void
+log_sink_(const struct log_settings *set, const int *levels, const char **msgs, const struct log_origin *origins, int n)
+{
+	const char *sel[2 * LOG_ASYNC_BATCH];
+	int sellevels[2 * LOG_ASYNC_BATCH];
+	struct log_origin selorigins[2 * LOG_ASYNC_BATCH];
+	struct iovec iov[4];
+	int c, i, s, nsel;
+
+	if(set->file)
+	{
+		for(c = nsel = 0; c < n; c++)
+		{
+			if(levels[c] <= set->sinks[LOG_SINK_FILE].level)
+			{
+				if(origins)
+				{
+					selorigins[nsel] = origins[c];
+				}
+				sellevels[nsel] = levels[c];
+				sel[nsel++] = msgs[c];
+			}
+		}
+		if(nsel)
+		{
+			log_file_write_(set, sellevels, sel, origins ? selorigins : NULL, nsel);
+		}
+	}
+	if(set->use_syslog)
+	{
+		for(c = nsel = 0; c < n; c++)
+		{
+			if(levels[c] <= set->sinks[LOG_SINK_SYSLOG].level)
+			{
+				if(origins)
+				{
+					selorigins[nsel] = origins[c];
+				}
+				sellevels[nsel] = levels[c];
+				sel[nsel++] = msgs[c];
+			}
+		}
+		/* Coalescing may add a summary to each batch of messages, so
+		 * there may be more than log_syslog_send_() can handle at once
+		 */
+		for(c = 0; c < nsel && set->conn; c += LOG_ASYNC_BATCH)
+		{
+			log_syslog_send_(set, sellevels + c, sel + c, origins ? selorigins + c : NULL,
+				(nsel - c > LOG_ASYNC_BATCH ? LOG_ASYNC_BATCH : nsel - c));
+		}
+		for(c = 0; c < nsel && !set->conn; c++)
+		{
+			syslog(sellevels[c], "%s", sel[c]);
+		}
+	}
+	if(set->use_stderr || (!set->use_syslog && !set->file))
+	{
+		for(c = 0; c < n; c++)
+		{
+			if(levels[c] > set->sinks[LOG_SINK_STDERR].level)
+			{
+				continue;
+			}
+			/* Alongside syslog, include the process ID as syslog(3)
+			 * does with LOG_PERROR
+			 */
+			i = log_prefix_(set, levels[c], set->use_syslog, origins ? &(origins[c]) : NULL, iov);
+			iov[i].iov_base = (void *) msgs[c];
+			iov[i].iov_len = strlen(msgs[c]);
+			log_stderr_write_(iov, i + 1);
+		}
+	}
+	for(s = LOG_SINK_FILE + 1; s < set->nsinks; s++)
+	{
+		if(!set->sinks[s].fn)
+		{
+			continue;
+		}
+		for(c = 0; c < n; c++)
+		{
+			if(levels[c] <= set->sinks[s].level)
+			{
+				set->sinks[s].fn(levels[c], msgs[c], set->sinks[s].data);
+			}
+		}
+	}
+}
+
+/* Render the constant parts of syslog messages and connect to the local
+ * syslog socket; returns NULL if syslog(3) should be used instead
+ */
+static struct log_syslog *
+log_syslog_open_(const struct log_settings *set)
+{
+	struct log_syslog *conn;
+	char host[256], *p;
+	size_t len;
+	int pid;
+
+	conn = (struct log_syslog *) calloc(1, sizeof(struct log_syslog));
+	if(!conn)
+	{
+		return NULL;
+	}
+	pid = (int) getpid();
+	conn->fd = -1;
+	conn->pid = pid;
+	pthread_rwlock_init(&(conn->lock), NULL);
+	len = strlen(set->ident) + 32;
+	conn->tag = (char *) malloc(len);
+	if(!conn->tag)
+	{
+		log_syslog_close_(conn);
+		return NULL;
+	}
+	conn->taglen = snprintf(conn->tag, len, "%s[%d]: ", set->ident, pid);
+	if(set->syslog_format == LOG_SYSLOG_RFC5424)
+	{
+		if(gethostname(host, sizeof(host)) || !host[0])
+		{
+			strcpy(host, "-");
+		}
+		host[sizeof(host) - 1] = 0;
+		len += strlen(host) + 8;
+		conn->fields = (char *) malloc(len);
+		if(!conn->fields)
+		{
+			log_syslog_close_(conn);
+			return NULL;
+		}
+		conn->fieldslen = snprintf(conn->fields, len, "%s %s %d - - ", host, set->ident, pid);
+		/* Neither HOSTNAME nor APP-NAME may contain spaces */
+		len = strlen(host) + 1 + strlen(set->ident);
+		for(p = conn->fields; p < conn->fields + len; p++)
+		{
+			if(isspace((unsigned char) *p) && p != conn->fields + strlen(host))
+			{
+				*p = '_';
+			}
+		}
+	}
+	if(log_syslog_connect_(conn, set->syslog_path))
+	{
+		log_syslog_close_(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+static void
+log_syslog_close_(struct log_syslog *conn)
+{
+	if(conn->fd != -1)
+	{
+		close(conn->fd);
+	}
+	if(conn->pid == (int) getpid())
+	{
+		/* In a child process, the lock may have been held by one of the
+		 * parent's other threads
+		 */
+		pthread_rwlock_destroy(&(conn->lock));
+	}
+	free(conn->tag);
+	free(conn->fields);
+	free(conn);
+}
+
+/* (Re-)connect the syslog socket; the caller must hold conn->lock for
+ * writing unless no other thread can be using conn
+ */
+static int
+log_syslog_connect_(struct log_syslog *conn, const char *path)
+{
+	int fd;
+
+	fd = log_syslog_socket_(path);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	if(conn->fd != -1)
+	{
+		close(conn->fd);
+	}
+	conn->fd = fd;
+	return 0;
+}
+
+/* Return a new datagram socket connected to the syslog socket at path (or
+ * the default), or -1; this is async-signal-safe
+ */
+static int
+log_syslog_socket_(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if(!path)
+	{
+		path = LOG_SYSLOG_PATH;
+	}
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if(fd == -1)
+	{
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	if(connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Send messages to the syslog socket, as a single sendmmsg() where
+ * available; each datagram is the
+ * per-message header, the pre-rendered tag or fields, and the message
+ * without its trailing newline. Messages are stamped with the times in
+ * origins, if not NULL, or else the current time.
+ */
+static void
+log_syslog_send_(const struct log_settings *set, const int *levels, const char **msgs, const struct log_origin *origins, int n)
+{
+	struct log_syslog *conn;
+	char hdr[LOG_ASYNC_BATCH][LOG_SYSLOG_HDRSIZE], stamp[40];
+	struct iovec iov[LOG_ASYNC_BATCH][3];
+	struct mmsghdr mmsg[LOG_ASYNC_BATCH];
+	struct timespec now;
+	const struct timespec *ts;
+	struct tm tm;
+	time_t sec;
+	int c, r, sent, retried, e, fd;
+	size_t len;
+
+	e = errno;
+	conn = set->conn;
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(mmsg, 0, sizeof(struct mmsghdr) * n);
+	for(c = 0; c < n; c++)
+	{
+		/* The stamp is only re-rendered when the second changes */
+		ts = (origins ? &(origins[c].time) : &now);
+		if(!c || ts->tv_sec != sec)
+		{
+			sec = ts->tv_sec;
+			if(set->syslog_format == LOG_SYSLOG_RFC5424)
+			{
+				gmtime_r(&sec, &tm);
+				strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+			}
+			else
+			{
+				/* Not strftime()'s %b, which depends upon the locale */
+				localtime_r(&sec, &tm);
+				snprintf(stamp, sizeof(stamp), "%s %2d %02d:%02d:%02d", log_months[tm.tm_mon], tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+			}
+		}
+		iov[c][0].iov_base = hdr[c];
+		if(set->syslog_format == LOG_SYSLOG_RFC5424)
+		{
+			iov[c][0].iov_len = snprintf(hdr[c], LOG_SYSLOG_HDRSIZE, "<%d>1 %s.%06ldZ ",
+				set->facility | (levels[c] & LOG_PRIMASK), stamp, (long) ts->tv_nsec / 1000);
+		}
+		else
+		{
+			iov[c][0].iov_len = snprintf(hdr[c], LOG_SYSLOG_HDRSIZE, "<%d>%s ",
+				set->facility | (levels[c] & LOG_PRIMASK), stamp);
+		}
+		if(set->syslog_format == LOG_SYSLOG_RFC5424)
+		{
+			iov[c][1].iov_base = conn->fields;
+			iov[c][1].iov_len = conn->fieldslen;
+		}
+		else
+		{
+			iov[c][1].iov_base = conn->tag;
+			iov[c][1].iov_len = conn->taglen;
+		}
+		len = strlen(msgs[c]);
+		if(len && msgs[c][len - 1] == '\n')
+		{
+			len--;
+		}
+		iov[c][2].iov_base = (void *) msgs[c];
+		iov[c][2].iov_len = len;
+		mmsg[c].msg_hdr.msg_iov = iov[c];
+		mmsg[c].msg_hdr.msg_iovlen = 3;
+	}
+	retried = 0;
+	pthread_rwlock_rdlock(&(conn->lock));
+	fd = conn->fd;
+	for(sent = 0; sent < n; sent += r)
+	{
+#ifdef LOG_HAVE_SENDMMSG
+		r = sendmmsg(fd, &(mmsg[sent]), n - sent, MSG_NOSIGNAL);
+#else
+		r = (sendmsg(fd, &(mmsg[sent].msg_hdr), 0) < 0 ? -1 : 1);
 #endif
-#ifdef LOG_UUCP
-	if(!strcasecmp(facility, "uucp")) return LOG_UUCP;
+		if(r > 0)
+		{
+			continue;
+		}
+		if(r < 0 && errno == EINTR)
+		{
+			r = 0;
+			continue;
+		}
+		if(r < 0 && !retried && (errno == ECONNREFUSED || errno == ENOTCONN || errno == ECONNRESET))
+		{
+			/* The syslog daemon may have been restarted; the old socket
+			 * can only be closed once no other thread is sending with
+			 * it, and one of them may have reconnected already
+			 */
+			retried = 1;
+			pthread_rwlock_unlock(&(conn->lock));
+			pthread_rwlock_wrlock(&(conn->lock));
+			r = (conn->fd == fd ? log_syslog_connect_(conn, set->syslog_path) : 0);
+			pthread_rwlock_unlock(&(conn->lock));
+			pthread_rwlock_rdlock(&(conn->lock));
+			fd = conn->fd;
+			if(!r)
+			{
+				continue;
+			}
+		}
+		break;
+	}
+	pthread_rwlock_unlock(&(conn->lock));
+	errno = e;
+}
+
+/* Open the log file described by the settings and start its flusher
+ * thread; returns NULL on failure
+ */
+static struct log_file *
+log_file_open_(const struct log_settings *set)
+{
+	struct log_file *file;
+	struct stat sb;
+
+	file = (struct log_file *) calloc(1, sizeof(struct log_file));
+	if(!file)
+	{
+		return NULL;
+	}
+	file->fd = -1;
+	file->pid = (int) getpid();
+	pthread_mutex_init(&(file->lock), NULL);
+	pthread_cond_init(&(file->cond), NULL);
+	pthread_cond_init(&(file->space), NULL);
+	file->bufsize = (set->file_bufsize < LOG_LINE_SIZE ? LOG_LINE_SIZE : set->file_bufsize);
+	file->interval = (set->file_interval < 1 ? 1 : set->file_interval);
+	file->flush_level = set->file_flush_level;
+	file->maxsize = set->file_maxsize;
+	file->period = set->file_period;
+	file->keep = set->file_keep;
+	file->path = strdup(set->file_path);
+	file->active = (char *) malloc(file->bufsize);
+	file->spare = (char *) malloc(file->bufsize);
+	if(!file->path || !file->active || !file->spare)
+	{
+		log_file_close_(file);
+		return NULL;
+	}
+	file->fd = open(file->path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+	if(file->fd == -1)
+	{
+		log_file_close_(file);
+		return NULL;
+	}
+	file->size = (fstat(file->fd, &sb) ? 0 : sb.st_size);
+	file->rotate_at = log_file_deadline_(file, time(NULL));
+	if(pthread_create(&(file->flusher), NULL, log_file_thread_, file))
+	{
+		log_file_close_(file);
+		return NULL;
+	}
+	file->running = 1;
+	return file;
+}
+
+/* Stop the flusher thread, once it has written everything buffered, and
+ * close the log file. In a child process, the flusher does not exist and
+ * the parent writes whatever was buffered, so the buffers are discarded.
+ */
+static void
+log_file_close_(struct log_file *file)
+{
+	int self;
+
+	self = (file->pid == (int) getpid());
+	if(file->running && self)
+	{
+		pthread_mutex_lock(&(file->lock));
+		file->stopping = 1;
+		pthread_cond_signal(&(file->cond));
+		pthread_mutex_unlock(&(file->lock));
+		pthread_join(file->flusher, NULL);
+	}
+	if(file->fd != -1)
+	{
+		close(file->fd);
+	}
+	if(self)
+	{
+		pthread_mutex_destroy(&(file->lock));
+		pthread_cond_destroy(&(file->cond));
+		pthread_cond_destroy(&(file->space));
+	}
+	free(file->path);
+	free(file->active);
+	free(file->spare);
+	free(file->pending);
+	free(file);
+}
+
+/* Append messages to the settings' log file's active buffer, each preceded
+ * by a timestamp and the process ID as well as the usual prefix. When the
+ * buffer fills, it is swapped with the spare for the flusher to write; a caller waits only if the flusher has not
+ * yet finished writing the previous one. Lines too long for the buffer
+ * are truncated.
+ */
+static void
+log_file_write_(const struct log_settings *set, const int *levels, const char **msgs, const struct log_origin *origins, int n)
+{
+	struct log_file *file;
+	struct iovec iov[3];
+	char prefix[2 * LOG_ASYNC_BATCH][LOG_LINE_PREFIX_SIZE];
+	size_t plen[2 * LOG_ASYNC_BATCH], mlen;
+	int c, i, niov, nl, wake;
+	char *p;
+
+	/* The prefixes are gathered before taking the lock; they are copied
+	 * out of this thread's cache, which each call may re-render when the
+	 * messages have different origins
+	 */
+	for(c = 0; c < n; c++)
+	{
+		niov = log_prefix_(set, levels[c], 1, origins ? &(origins[c]) : NULL, iov);
+		for(i = 0, plen[c] = 0; i < niov; i++)
+		{
+			memcpy(prefix[c] + plen[c], iov[i].iov_base, iov[i].iov_len);
+			plen[c] += iov[i].iov_len;
+		}
+	}
+	file = set->file;
+	wake = 0;
+	pthread_mutex_lock(&(file->lock));
+	for(c = 0; c < n; c++)
+	{
+		mlen = strlen(msgs[c]);
+		nl = !(mlen && msgs[c][mlen - 1] == '\n');
+		if(plen[c] + mlen + nl > file->bufsize)
+		{
+			mlen = file->bufsize - plen[c] - 1;
+			nl = 1;
+		}
+		if(plen[c] + mlen + nl > file->bufsize - file->len)
+		{
+			while(file->pending)
+			{
+				pthread_cond_wait(&(file->space), &(file->lock));
+			}
+			file->pending = file->active;
+			file->pending_len = file->len;
+			file->active = file->spare;
+			file->spare = NULL;
+			file->len = 0;
+			file->swaps++;
+			wake = 1;
+		}
+		p = file->active + file->len;
+		memcpy(p, prefix[c], plen[c]);
+		p += plen[c];
+		memcpy(p, msgs[c], mlen);
+		if(nl)
+		{
+			p[mlen] = '\n';
+		}
+		file->len += plen[c] + mlen + nl;
+		if(levels[c] <= file->flush_level)
+		{
+			file->urgent = 1;
+			wake = 1;
+		}
+	}
+	if(wake)
+	{
+		pthread_cond_signal(&(file->cond));
+	}
+	pthread_mutex_unlock(&(file->lock));
+}
+
+/* Wait until everything buffered before the call has been written */
+static void
+log_file_flush_(struct log_file *file)
+{
+	unsigned long target;
+
+	if(file->pid != (int) getpid())
+	{
+		return;
+	}
+	pthread_mutex_lock(&(file->lock));
+	target = file->swaps + (file->len ? 1 : 0);
+	file->urgent = 1;
+	pthread_cond_signal(&(file->cond));
+	while(file->flushed < target)
+	{
+		pthread_cond_wait(&(file->space), &(file->lock));
+	}
+	pthread_mutex_unlock(&(file->lock));
+}
+
+/* The flusher thread: write out each buffer handed over by
+ * log_file_write_(), or the active buffer when the flush interval expires
+ * or a flush is requested, and rotate the file when required; the file is
+ * written without holding the file's lock
+ */
+static void *
+log_file_thread_(void *arg)
+{
+	struct log_file *file;
+	struct timespec ts;
+	char *buf;
+	size_t len;
+
+	file = (struct log_file *) arg;
+	pthread_mutex_lock(&(file->lock));
+	for(;;)
+	{
+		if(!file->pending && !file->urgent && !file->stopping)
+		{
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += file->interval / 1000;
+			ts.tv_nsec += (file->interval % 1000) * 1000000L;
+			if(ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&(file->cond), &(file->lock), &ts);
+		}
+		if(!file->pending && file->len)
+		{
+			/* Take the partially-filled active buffer */
+			file->pending = file->active;
+			file->pending_len = file->len;
+			file->active = file->spare;
+			file->spare = NULL;
+			file->len = 0;
+			file->swaps++;
+		}
+		if(!file->len)
+		{
+			file->urgent = 0;
+		}
+		buf = file->pending;
+		len = file->pending_len;
+		pthread_mutex_unlock(&(file->lock));
+		if(file->period && time(NULL) >= file->rotate_at)
+		{
+			log_file_rotate_(file);
+		}
+		if(buf)
+		{
+			log_file_output_(file, buf, len);
+		}
+		pthread_mutex_lock(&(file->lock));
+		if(buf)
+		{
+			file->spare = buf;
+			file->pending = NULL;
+			file->pending_len = 0;
+			file->flushed++;
+			pthread_cond_broadcast(&(file->space));
+			continue;
+		}
+		if(file->stopping)
+		{
+			break;
+		}
+	}
+	pthread_mutex_unlock(&(file->lock));
+	return NULL;
+}
+
+/* Write a buffer to the log file, rotating it first if it would exceed
+ * its maximum size; errors are ignored, and errno is preserved
+ */
+static void
+log_file_output_(struct log_file *file, const char *buf, size_t len)
+{
+	ssize_t r;
+	int e;
+
+	e = errno;
+	if(file->maxsize && file->size && (size_t) file->size + len > file->maxsize)
+	{
+		log_file_rotate_(file);
+	}
+	while(len)
+	{
+		r = write(file->fd, buf, len);
+		if(r < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		buf += r;
+		len -= r;
+		file->size += r;
+	}
+	errno = e;
+}
+
+/* Rename the log file to path.1 (after renaming path.1 to path.2, and so
+ * on, replacing path.N where N is the number kept) and open a fresh one;
+ * only the flusher thread uses the descriptor, so needs no lock to replace
+ * it
+ */
+static void
+log_file_rotate_(struct log_file *file)
+{
+	char *from, *to;
+	size_t len;
+	int c, fd;
+
+	file->rotate_at = log_file_deadline_(file, time(NULL));
+	len = strlen(file->path) + 16;
+	from = (char *) malloc(len);
+	to = (char *) malloc(len);
+	if(!from || !to)
+	{
+		free(from);
+		free(to);
+		return;
+	}
+	if(!file->keep)
+	{
+		unlink(file->path);
+	}
+	for(c = file->keep; c > 0; c--)
+	{
+		snprintf(from, len, (c > 1 ? "%s.%d" : "%s"), file->path, c - 1);
+		snprintf(to, len, "%s.%d", file->path, c);
+		rename(from, to);
+	}
+	free(from);
+	free(to);
+	fd = open(file->path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+	if(fd == -1)
+	{
+		/* Carry on writing to the renamed file */
+		return;
+	}
+	close(file->fd);
+	file->fd = fd;
+	file->size = 0;
+}
+
+/* Return the time at which the file should next be rotated: the end of
+ * the current period, or the far future if there is none
+ */
+static time_t
+log_file_deadline_(const struct log_file *file, time_t now)
+{
+	if(!file->period)
+	{
+		return (time_t) LONG_MAX;
+	}
+	return (now / file->period + 1) * file->period;
+}
+
+/* Allocate a queue of (a power of two no smaller than) size cells and start
+ * the writer thread
+ */
+static int
+log_async_start_(size_t size)
+{
+	struct log_ring *ring;
+	size_t n, c;
+
+	for(n = 2; n < size; n <<= 1);
+	ring = (struct log_ring *) calloc(1, sizeof(struct log_ring));
+	if(!ring)
+	{
+		return -1;
+	}
+	if(posix_memalign((void **) &(ring->cells), SNAPSHOT_LINE_SIZE, n * sizeof(struct log_cell)))
+	{
+		free(ring);
+		return -1;
+	}
+	for(c = 0; c < n; c++)
+	{
+		ring->cells[c].seq = c;
+	}
+	ring->mask = n - 1;
+	log_async_stopping = 0;
+	__atomic_store_n(&log_async_ring, ring, __ATOMIC_RELEASE);
+	if(pthread_create(&log_async_writer, NULL, log_async_thread_, ring))
+	{
+		__atomic_store_n(&log_async_ring, NULL, __ATOMIC_SEQ_CST);
+		while(__atomic_load_n(&log_async_users, __ATOMIC_SEQ_CST))
+		{
+			sched_yield();
+		}
+		free(ring->cells);
+		free(ring);
+		return -1;
+	}
+	return 0;
+}
+
+/* Start, stop or resize the queue to match the settings most recently
+ * committed; when two threads commit at once, whichever gets here last
+ * sees the later settings
+ */
+static void
+log_async_update_(void)
+{
+	struct log_ring *ring;
+	size_t size, want;
+	int async;
+
+	pthread_mutex_lock(&log_async_control);
+	async = __atomic_load_n(&log_async_want, __ATOMIC_ACQUIRE);
+	want = __atomic_load_n(&log_async_want_queue, __ATOMIC_RELAXED);
+	ring = __atomic_load_n(&log_async_ring, __ATOMIC_ACQUIRE);
+	for(size = 2; size < want; size <<= 1);
+	if(ring && (!async || size != ring->mask + 1))
+	{
+		log_async_stop_();
+		ring = NULL;
+	}
+	if(async && !ring)
+	{
+		/* On failure, messages are logged synchronously */
+		log_async_start_(want);
+	}
+	pthread_mutex_unlock(&log_async_control);
+}
+
+/* Stop accepting queued messages, then wait for the writer thread to
+ * write those already queued and exit
+ */
+static void
+log_async_stop_(void)
+{
+	struct log_ring *ring;
+
+	ring = __atomic_exchange_n(&log_async_ring, NULL, __ATOMIC_SEQ_CST);
+	if(!ring)
+	{
+		return;
+	}
+	/* Wait for producers which picked up the ring before it was
+	 * withdrawn to finish with it
+	 */
+	while(__atomic_load_n(&log_async_users, __ATOMIC_SEQ_CST))
+	{
+		sched_yield();
+	}
+	pthread_mutex_lock(&log_async_lock);
+	log_async_stopping = 1;
+	pthread_cond_broadcast(&log_async_cond);
+	pthread_cond_broadcast(&log_async_space);
+	pthread_mutex_unlock(&log_async_lock);
+	pthread_join(log_async_writer, NULL);
+	free(ring->cells);
+	free(ring);
+}
+
+/* Format a message into the queue, or if defer is set and the format
+ * allows it, record its arguments for the writer thread to format;
+ * returns nonzero if the message should be logged synchronously instead
+ */
+static int
+log_async_enqueue_(const struct log_settings *set, int level, const char *fmt, int defer, va_list ap)
+{
+	struct log_ring *ring;
+	struct log_cell *cell;
+	size_t pos, seq;
+	int len;
+	va_list cp;
+
+	__atomic_add_fetch(&log_async_users, 1, __ATOMIC_SEQ_CST);
+	ring = __atomic_load_n(&log_async_ring, __ATOMIC_SEQ_CST);
+	if(!ring)
+	{
+		__atomic_sub_fetch(&log_async_users, 1, __ATOMIC_RELEASE);
+		return -1;
+	}
+	pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		cell = &(ring->cells[pos & ring->mask]);
+		seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+		if(seq == pos)
+		{
+			if(__atomic_compare_exchange_n(&(ring->enqueue), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+			continue;
+		}
+		if(seq > pos)
+		{
+			/* Another producer claimed this cell */
+			pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+			continue;
+		}
+		/* The queue is full */
+		if(set->async_policy == LOG_ASYNC_DROP_OLDEST)
+		{
+			if(!log_async_dequeue_(ring, NULL, NULL, NULL, NULL))
+			{
+				__atomic_add_fetch(&log_async_dropped, 1, __ATOMIC_RELAXED);
+				__atomic_add_fetch(&log_async_written, 1, __ATOMIC_SEQ_CST);
+			}
+		}
+		else if(set->async_policy == LOG_ASYNC_BLOCK)
+		{
+			pthread_mutex_lock(&log_async_lock);
+			__atomic_add_fetch(&log_async_waiters, 1, __ATOMIC_SEQ_CST);
+			pthread_cond_signal(&log_async_cond);
+			if(__atomic_load_n(&(cell->seq), __ATOMIC_SEQ_CST) < pos && !log_async_stopping)
+			{
+				pthread_cond_wait(&log_async_space, &log_async_lock);
+			}
+			__atomic_sub_fetch(&log_async_waiters, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&log_async_lock);
+		}
+		else
+		{
+			__atomic_add_fetch(&log_async_dropped, 1, __ATOMIC_RELAXED);
+			__atomic_sub_fetch(&log_async_users, 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+	}
+	cell->level = level;
+	cell->format = NULL;
+	clock_gettime(CLOCK_REALTIME, &(cell->origin.time));
+	cell->origin.tid = log_thread_id_();
+	if(defer)
+	{
+		va_copy(cp, ap);
+		len = log_defer_capture_(cell->msg, sizeof(cell->msg), fmt, cp);
+		va_end(cp);
+		if(len >= 0)
+		{
+			cell->format = fmt;
+			cell->len = len;
+		}
+	}
+	if(!cell->format)
+	{
+		len = vsnprintf(cell->msg, sizeof(cell->msg), fmt, ap);
+		cell->len = (len < 0 ? 0 : (len >= (int) sizeof(cell->msg) ? (int) sizeof(cell->msg) - 1 : len));
+	}
+	__atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&log_async_users, 1, __ATOMIC_RELEASE);
+	if(__atomic_load_n(&log_async_sleeping, __ATOMIC_SEQ_CST))
+	{
+		log_async_wake_();
+	}
+	return 0;
+}
+
+/* Remove the oldest message from the queue, copying it, its level, its
+ * deferred format (if any) and its origin unless buf is NULL; returns
+ * nonzero if the queue is empty
+ */
+static int
+log_async_dequeue_(struct log_ring *ring, int *level, const char **format, struct log_origin *origin, char *buf)
+{
+	struct log_cell *cell;
+	size_t pos, seq;
+
+	pos = __atomic_load_n(&(ring->dequeue), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		cell = &(ring->cells[pos & ring->mask]);
+		seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+		if(seq == pos + 1)
+		{
+			if(__atomic_compare_exchange_n(&(ring->dequeue), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if(seq < pos + 1)
+		{
+			return -1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&(ring->dequeue), __ATOMIC_RELAXED);
+		}
+	}
+	if(buf)
+	{
+		*level = cell->level;
+		*format = cell->format;
+		*origin = cell->origin;
+		memcpy(buf, cell->msg, cell->format ? cell->len : cell->len + 1);
+	}
+	/* Hand the cell back to producers for the next lap of the ring */
+	__atomic_store_n(&(cell->seq), pos + ring->mask + 1, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+/* The writer thread, which pins the current settings while writing each
+ * batch of messages; it only exists while the log is open
+ */
+static void *
+log_async_thread_(void *arg)
+{
+	struct log_settings *set;
+	struct log_ring *ring;
+	struct timespec ts;
+	const char *format, *msgs[LOG_ASYNC_BATCH];
+	char buf[LOG_ASYNC_BATCH][LOG_ASYNC_MSGSIZE], line[LOG_ASYNC_MSGSIZE];
+	struct log_origin origins[LOG_ASYNC_BATCH];
+	size_t pos;
+	int levels[LOG_ASYNC_BATCH], n;
+
+	ring = (struct log_ring *) arg;
+	for(;;)
+	{
+		for(n = 0; n < LOG_ASYNC_BATCH && !log_async_dequeue_(ring, &(levels[n]), &format, &(origins[n]), buf[n]); n++)
+		{
+			if(format)
+			{
+				log_defer_render_(line, sizeof(line), format, buf[n]);
+				strcpy(buf[n], line);
+			}
+			msgs[n] = buf[n];
+		}
+		if(n)
+		{
+			set = log_settings_acquire_();
+			if(set)
+			{
+				log_emit_(set, levels, msgs, origins, n);
+			}
+			log_settings_release_();
+			__atomic_add_fetch(&log_async_written, n, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&log_async_waiters, __ATOMIC_SEQ_CST))
+			{
+				pthread_mutex_lock(&log_async_lock);
+				pthread_cond_broadcast(&log_async_space);
+				pthread_mutex_unlock(&log_async_lock);
+			}
+			continue;
+		}
+		/* The queue is empty: announce that we are going to sleep, and
+		 * re-check that nothing was queued before the announcement was
+		 * visible to producers
+		 */
+		pthread_mutex_lock(&log_async_lock);
+		__atomic_store_n(&log_async_sleeping, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&log_async_waiters, __ATOMIC_SEQ_CST))
+		{
+			pthread_cond_broadcast(&log_async_space);
+		}
+		pos = __atomic_load_n(&(ring->dequeue), __ATOMIC_SEQ_CST);
+		if(!log_async_stopping &&
+		   __atomic_load_n(&(ring->cells[pos & ring->mask].seq), __ATOMIC_SEQ_CST) != pos + 1)
+		{
+			/* Producers only wake the writer when they see the flag, so
+			 * the timeout merely bounds the cost of any missed wakeup
+			 */
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if(ts.tv_nsec >= 1000000000)
+			{
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&log_async_cond, &log_async_lock, &ts);
+		}
+		set = log_settings_acquire_();
+		if(set && set->coalesce)
+		{
+			log_repeat_flush_(set, 0);
+		}
+		if(set && set->rate > 0)
+		{
+			log_limit_tick_(set, 1);
+		}
+		log_settings_release_();
+		__atomic_store_n(&log_async_sleeping, 0, __ATOMIC_SEQ_CST);
+		pos = __atomic_load_n(&(ring->dequeue), __ATOMIC_SEQ_CST);
+		if(log_async_stopping &&
+		   __atomic_load_n(&(ring->cells[pos & ring->mask].seq), __ATOMIC_SEQ_CST) != pos + 1)
+		{
+			pthread_cond_broadcast(&log_async_space);
+			pthread_mutex_unlock(&log_async_lock);
+			set = log_settings_acquire_();
+			if(set)
+			{
+				log_repeat_flush_(set, 1);
+			}
+			log_settings_release_();
+			break;
+		}
+		pthread_mutex_unlock(&log_async_lock);
+	}
+	return NULL;
+}
+
+/* Parse the conversion specification starting at p (just after the '%'),
+ * returning a pointer to the character following it, or NULL if it
+ * cannot be deferred: positional arguments, %n, %m (which depends upon
+ * errno) and wide strings are formatted immediately instead
+ */
+static const char *
+log_spec_(const char *p, struct log_spec *spec)
+{
+	const char *start;
+	int longs, size;
+
+	start = p - 1;
+	spec->nstar = 0;
+	spec->pstar = -1;
+	spec->precision = -1;
+	longs = 0;
+	size = LOG_ARG_INT;
+	while(*p && strchr("-+ #0'I", *p))
+	{
+		p++;
+	}
+	if(*p == '*')
+	{
+		spec->nstar++;
+		p++;
+	}
+	while(isdigit((unsigned char) *p))
+	{
+		p++;
+	}
+	if(*p == '$')
+	{
+		return NULL;
+	}
+	if(*p == '.')
+	{
+		p++;
+		spec->precision = 0;
+		if(*p == '*')
+		{
+			spec->pstar = spec->nstar;
+			spec->nstar++;
+			spec->precision = -1;
+			p++;
+		}
+		while(isdigit((unsigned char) *p))
+		{
+			spec->precision = spec->precision * 10 + (*p - '0');
+			p++;
+		}
+	}
+	for(;; p++)
+	{
+		if(*p == 'h')
+		{
+			continue;
+		}
+		if(*p == 'l')
+		{
+			longs++;
+			size = (longs > 1 ? LOG_ARG_LLONG : LOG_ARG_LONG);
+		}
+		else if(*p == 'L' || *p == 'q')
+		{
+			longs = 2;
+			size = LOG_ARG_LLONG;
+		}
+		else if(*p == 'j')
+		{
+			size = LOG_ARG_INTMAX;
+		}
+		else if(*p == 'z' || *p == 'Z')
+		{
+			size = LOG_ARG_SIZE;
+		}
+		else if(*p == 't')
+		{
+			size = LOG_ARG_PTRDIFF;
+		}
+		else
+		{
+			break;
+		}
+	}
+	switch(*p)
+	{
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+		spec->type = size;
+		break;
+	case 'c':
+		spec->type = LOG_ARG_INT;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		spec->type = (longs > 1 ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE);
+		break;
+	case 's':
+		if(longs)
+		{
+			return NULL;
+		}
+		spec->type = LOG_ARG_STRING;
+		break;
+	case 'p':
+		spec->type = LOG_ARG_POINTER;
+		break;
+	case '%':
+		spec->type = LOG_ARG_NONE;
+		break;
+	default:
+		return NULL;
+	}
+	p++;
+	if((size_t) (p - start) >= sizeof(spec->text))
+	{
+		return NULL;
+	}
+	memcpy(spec->text, start, p - start);
+	spec->text[p - start] = 0;
+	return p;
+}
+
+/* Append a value of type t, taken from ap, to the buffer */
+#define LOG_CAPTURE_(t) \
+	do \
+	{ \
+		t v_ = va_arg(ap, t); \
+		if(len + sizeof(t) > size) \
+		{ \
+			return -1; \
+		} \
+		memcpy(buf + len, &v_, sizeof(t)); \
+		len += sizeof(t); \
+	} \
+	while(0)
+
+/* Record the values of the arguments described by fmt in buf, returning
+ * the number of bytes used, or -1 if the format cannot be deferred or the
+ * values do not fit; strings are copied, preceded by their length
+ */
+static int
+log_defer_capture_(char *buf, size_t size, const char *fmt, va_list ap)
+{
+	struct log_spec spec;
+	const char *p, *str;
+	size_t len, slen;
+	int star[2], c;
+
+	len = 0;
+	for(p = strchr(fmt, '%'); p; p = strchr(p, '%'))
+	{
+		p = log_spec_(p + 1, &spec);
+		if(!p)
+		{
+			return -1;
+		}
+		for(c = 0; c < spec.nstar; c++)
+		{
+			star[c] = va_arg(ap, int);
+			if(len + sizeof(int) > size)
+			{
+				return -1;
+			}
+			memcpy(buf + len, &(star[c]), sizeof(int));
+			len += sizeof(int);
+		}
+		switch(spec.type)
+		{
+		case LOG_ARG_NONE:
+			break;
+		case LOG_ARG_INT:
+			LOG_CAPTURE_(int);
+			break;
+		case LOG_ARG_LONG:
+			LOG_CAPTURE_(long);
+			break;
+		case LOG_ARG_LLONG:
+			LOG_CAPTURE_(long long);
+			break;
+		case LOG_ARG_SIZE:
+			LOG_CAPTURE_(size_t);
+			break;
+		case LOG_ARG_PTRDIFF:
+			LOG_CAPTURE_(ptrdiff_t);
+			break;
+		case LOG_ARG_INTMAX:
+			LOG_CAPTURE_(intmax_t);
+			break;
+		case LOG_ARG_DOUBLE:
+			LOG_CAPTURE_(double);
+			break;
+		case LOG_ARG_LDOUBLE:
+			LOG_CAPTURE_(long double);
+			break;
+		case LOG_ARG_POINTER:
+			LOG_CAPTURE_(void *);
+			break;
+		case LOG_ARG_STRING:
+			str = va_arg(ap, const char *);
+			if(spec.pstar >= 0)
+			{
+				spec.precision = star[spec.pstar];
+			}
+			if(!str)
+			{
+				slen = (size_t) -1;
+			}
+			else if(spec.precision >= 0)
+			{
+				slen = strnlen(str, spec.precision);
+			}
+			else
+			{
+				slen = strlen(str);
+			}
+			if(len + sizeof(size_t) + (str ? slen + 1 : 0) > size)
+			{
+				return -1;
+			}
+			memcpy(buf + len, &slen, sizeof(size_t));
+			len += sizeof(size_t);
+			if(str)
+			{
+				memcpy(buf + len, str, slen);
+				buf[len + slen] = 0;
+				len += slen + 1;
+			}
+			break;
+		}
+	}
+	return len;
+}
+
+/* Format a value of type t, read from args, according to spec */
+#define LOG_RENDER_(t) \
+	do \
+	{ \
+		t v_; \
+		memcpy(&v_, args, sizeof(t)); \
+		args += sizeof(t); \
+		r = (spec.nstar == 0 ? snprintf(out, rem, spec.text, v_) : \
+			 spec.nstar == 1 ? snprintf(out, rem, spec.text, star[0], v_) : \
+			 snprintf(out, rem, spec.text, star[0], star[1], v_)); \
+	} \
+	while(0)
+
+/* Format a message whose arguments were recorded by log_defer_capture_() */
+static void
+log_defer_render_(char *buf, size_t size, const char *fmt, const char *args)
+{
+	struct log_spec spec;
+	const char *p, *q, *str;
+	char *out;
+	size_t rem, slen;
+	int star[2], c, r;
+
+	out = buf;
+	rem = size;
+	for(p = fmt; *p && rem > 1; p = q)
+	{
+		q = strchr(p, '%');
+		if(!q)
+		{
+			q = p + strlen(p);
+		}
+		if(q > p)
+		{
+			r = (size_t) (q - p) < rem ? (int) (q - p) : (int) rem - 1;
+			memcpy(out, p, r);
+			out += r;
+			rem -= r;
+			continue;
+		}
+		q = log_spec_(p + 1, &spec);
+		for(c = 0; c < spec.nstar; c++)
+		{
+			memcpy(&(star[c]), args, sizeof(int));
+			args += sizeof(int);
+		}
+		r = 0;
+		switch(spec.type)
+		{
+		case LOG_ARG_NONE:
+			r = snprintf(out, rem, "%%");
+			break;
+		case LOG_ARG_INT:
+			LOG_RENDER_(int);
+			break;
+		case LOG_ARG_LONG:
+			LOG_RENDER_(long);
+			break;
+		case LOG_ARG_LLONG:
+			LOG_RENDER_(long long);
+			break;
+		case LOG_ARG_SIZE:
+			LOG_RENDER_(size_t);
+			break;
+		case LOG_ARG_PTRDIFF:
+			LOG_RENDER_(ptrdiff_t);
+			break;
+		case LOG_ARG_INTMAX:
+			LOG_RENDER_(intmax_t);
+			break;
+		case LOG_ARG_DOUBLE:
+			LOG_RENDER_(double);
+			break;
+		case LOG_ARG_LDOUBLE:
+			LOG_RENDER_(long double);
+			break;
+		case LOG_ARG_POINTER:
+			LOG_RENDER_(void *);
+			break;
+		case LOG_ARG_STRING:
+			memcpy(&slen, args, sizeof(size_t));
+			args += sizeof(size_t);
+			str = NULL;
+			if(slen != (size_t) -1)
+			{
+				str = args;
+				args += slen + 1;
+			}
+			r = (spec.nstar == 0 ? snprintf(out, rem, spec.text, str) :
+				 spec.nstar == 1 ? snprintf(out, rem, spec.text, star[0], str) :
+				 snprintf(out, rem, spec.text, star[0], star[1], str));
+			break;
+		}
+		if(r < 0)
+		{
+			break;
+		}
+		if((size_t) r >= rem)
+		{
+			r = rem - 1;
+		}
+		out += r;
+		rem -= r;
+	}
+	*out = 0;
+}
+
+static void
+log_async_wake_(void)
+{
+	pthread_mutex_lock(&log_async_lock);
+	pthread_cond_signal(&log_async_cond);
+	pthread_mutex_unlock(&log_async_lock);
+}
+
+/* Capture what log_signal_printf() needs of newly-committed settings;
+ * returns NULL on failure
+ */
+static struct log_signal *
+log_signal_create_(const struct log_settings *set)
+{
+	struct log_signal *sig;
+	char cwd[PATH_MAX], *p;
+	size_t len;
+	int c;
+
+	sig = (struct log_signal *) calloc(1, sizeof(struct log_signal));
+	if(!sig)
+	{
+		return NULL;
+	}
+	sig->fd = -1;
+	sig->facility = set->facility;
+	sig->use_syslog = set->use_syslog;
+	sig->use_stderr = (set->use_stderr || (!set->use_syslog && !set->file));
+	/* syslog(3), used in the absence of a connection, sends RFC 3164 */
+	sig->syslog_format = (set->conn ? set->syslog_format : LOG_SYSLOG_RFC3164);
+	sig->timestamp = set->timestamp;
+	for(c = 0; c <= LOG_SINK_FILE; c++)
+	{
+		sig->levels[c] = set->sinks[c].level;
+	}
+	sig->recorder = set->recorder;
+	if(log_strdup_(&(sig->ident), set->ident) || log_strdup_(&(sig->syslog_path), set->syslog_path))
+	{
+		log_signal_destroy_(sig);
+		return NULL;
+	}
+	if(set->conn)
+	{
+		/* Another thread may be reconnecting the socket meanwhile */
+		pthread_rwlock_rdlock(&(set->conn->lock));
+		if(set->conn->fd != -1)
+		{
+			sig->fd = fcntl(set->conn->fd, F_DUPFD_CLOEXEC, 0);
+		}
+		pthread_rwlock_unlock(&(set->conn->lock));
+		if(set->conn->fields)
+		{
+			/* "HOSTNAME APP-NAME PROCID - - ": the process ID is rendered
+			 * for each message, which may be logged after fork()
+			 */
+			p = strchr(set->conn->fields, ' ');
+			p = (p ? strchr(p + 1, ' ') : NULL);
+			len = (p ? (size_t) (p - set->conn->fields) : strlen(set->conn->fields));
+			sig->fields = (char *) malloc(len + 1);
+			if(!sig->fields)
+			{
+				log_signal_destroy_(sig);
+				return NULL;
+			}
+			memcpy(sig->fields, set->conn->fields, len);
+			sig->fields[len] = 0;
+		}
+	}
+	if(set->file)
+	{
+		if(set->file_path[0] != '/' && getcwd(cwd, sizeof(cwd)))
+		{
+			/* The file is re-opened by name, possibly after chdir() */
+			len = strlen(cwd) + strlen(set->file_path) + 2;
+			sig->file = (char *) malloc(len);
+			if(sig->file)
+			{
+				snprintf(sig->file, len, "%s/%s", cwd, set->file_path);
+			}
+		}
+		else
+		{
+			sig->file = strdup(set->file_path);
+		}
+		if(!sig->file)
+		{
+			log_signal_destroy_(sig);
+			return NULL;
+		}
+	}
+	return sig;
+}
+
+static void
+log_signal_destroy_(struct log_signal *sig)
+{
+	if(!sig)
+	{
+		return;
+	}
+	if(sig->fd != -1)
+	{
+		close(sig->fd);
+	}
+	free(sig->ident);
+	free(sig->fields);
+	free(sig->syslog_path);
+	free(sig->file);
+	free(sig);
+}
+
+/* Replace the state used by log_signal_printf(), destroying the old state
+ * once no signal handler is using it; handlers never wait for anything,
+ * so this cannot be held up indefinitely by one which interrupted the
+ * calling thread
+ */
+static void
+log_signal_replace_(struct log_signal *sig)
+{
+	struct log_signal *old;
+
+	old = __atomic_exchange_n(&log_signal, sig, __ATOMIC_SEQ_CST);
+	while(__atomic_load_n(&log_signal_users, __ATOMIC_SEQ_CST))
+	{
+		sched_yield();
+	}
+	log_signal_destroy_(old);
+}
+
+/* Queue a message from log_signal_printf() if there is room, without
+ * waking the writer thread; returns nonzero if it should be written
+ * directly instead
+ */
+static int
+log_signal_enqueue_(int level, const char *msg, size_t len)
+{
+	struct log_ring *ring;
+	struct log_cell *cell;
+	size_t pos, seq;
+
+	__atomic_add_fetch(&log_async_users, 1, __ATOMIC_SEQ_CST);
+	ring = __atomic_load_n(&log_async_ring, __ATOMIC_SEQ_CST);
+	if(!ring)
+	{
+		__atomic_sub_fetch(&log_async_users, 1, __ATOMIC_RELEASE);
+		return -1;
+	}
+	pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		cell = &(ring->cells[pos & ring->mask]);
+		seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+		if(seq == pos)
+		{
+			if(__atomic_compare_exchange_n(&(ring->enqueue), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+			continue;
+		}
+		if(seq > pos)
+		{
+			pos = __atomic_load_n(&(ring->enqueue), __ATOMIC_RELAXED);
+			continue;
+		}
+		/* The queue is full, and a signal handler cannot wait for space
+		 * (or drop the oldest message, which the overflow policy may not
+		 * allow)
+		 */
+		__atomic_sub_fetch(&log_async_users, 1, __ATOMIC_RELEASE);
+		return -1;
+	}
+	if(len > sizeof(cell->msg) - 2)
+	{
+		len = sizeof(cell->msg) - 2;
+	}
+	memcpy(cell->msg, msg, len);
+	cell->msg[len++] = '\n';
+	cell->msg[len] = 0;
+	cell->level = level;
+	cell->format = NULL;
+	cell->len = len;
+	/* Not log_thread_id_(), as thread-local storage may be allocated on
+	 * first use, which is not async-signal-safe
+	 */
+	clock_gettime(CLOCK_REALTIME, &(cell->origin.time));
+#ifdef SYS_gettid
+	cell->origin.tid = (unsigned long) syscall(SYS_gettid);
+#else
+	cell->origin.tid = (unsigned long) pthread_self();
 #endif
-	if(!strcasecmp(facility, "user")) return LOG_USER;
-	if(!strcasecmp(facility, "local0")) return LOG_LOCAL0;
-	if(!strcasecmp(facility, "local1")) return LOG_LOCAL1;
-	if(!strcasecmp(facility, "local2")) return LOG_LOCAL2;
-	if(!strcasecmp(facility, "local3")) return LOG_LOCAL3;
-	if(!strcasecmp(facility, "local4")) return LOG_LOCAL4;
-	if(!strcasecmp(facility, "local5")) return LOG_LOCAL5;
-	if(!strcasecmp(facility, "local6")) return LOG_LOCAL6;
-	if(!strcasecmp(facility, "local7")) return LOG_LOCAL7;
-	return LOG_USER;
+	__atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&log_async_users, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Send a message from log_signal_printf() to the syslog socket, preceded
+ * (in the space before msg) by its header; an RFC 3164 message has no
+ * timestamp, as that would need localtime_r(), and so is stamped by the
+ * syslog daemon. If the socket isn't connected, a new one is used. The
+ * message is dropped rather than wait for a busy syslog daemon.
+ */
+static void
+log_signal_syslog_(const struct log_signal *sig, int level, char *msg, size_t len)
+{
+	char hdr[LOG_PREFIX_SIZE], stamp[32];
+	size_t hlen;
+	ssize_t r;
+	int fd, pri;
+
+	pri = sig->facility | (level & LOG_PRIMASK);
+	if(sig->syslog_format == LOG_SYSLOG_RFC5424)
+	{
+		log_signal_stamp_(stamp, sizeof(stamp), LOG_TIMESTAMP_MILLISECONDS);
+		hlen = log_signal_snprintf_(hdr, sizeof(hdr), "<%d>1 %s %s %d - - ", pri, stamp,
+			(sig->fields ? sig->fields : "- -"), (int) getpid());
+	}
+	else
+	{
+		hlen = log_signal_snprintf_(hdr, sizeof(hdr), "<%d>%s[%d]: ", pri, sig->ident, (int) getpid());
+	}
+	memcpy(msg - hlen, hdr, hlen);
+	r = -1;
+	errno = ENOTCONN;
+	if(sig->fd != -1)
+	{
+		while((r = send(sig->fd, msg - hlen, hlen + len, MSG_NOSIGNAL|MSG_DONTWAIT)) < 0 && errno == EINTR);
+	}
+	if(r < 0 && (errno == ECONNREFUSED || errno == ENOTCONN || errno == ECONNRESET))
+	{
+		/* The syslog daemon may have been restarted */
+		fd = log_syslog_socket_(sig->syslog_path);
+		if(fd != -1)
+		{
+			send(fd, msg - hlen, hlen + len, MSG_NOSIGNAL|MSG_DONTWAIT);
+			close(fd);
+		}
+	}
+}
+
+/* Write a message from log_signal_printf() to fd as a single line,
+ * preceded (in the space before msg) by a timestamp of the given
+ * precision (if any) and the "ident[pid]: Level: " prefix; sig is NULL if
+ * the log has not been opened
+ */
+static void
+log_signal_line_(const struct log_signal *sig, int fd, int stamp, int level, char *msg, size_t len)
+{
+	char prefix[LOG_PREFIX_SIZE], ts[32];
+	size_t plen;
+
+	ts[0] = 0;
+	if(stamp)
+	{
+		log_signal_stamp_(ts, sizeof(ts), stamp);
+	}
+	plen = log_signal_snprintf_(prefix, sizeof(prefix), "%s%s%s[%d]: %s", ts, (stamp ? " " : ""),
+		(sig ? sig->ident : ""), (int) getpid(), log_level_prefix_(level));
+	memcpy(msg - plen, prefix, plen);
+	msg[len] = '\n';
+	while(write(fd, msg - plen, plen + len + 1) < 0 && errno == EINTR);
+}
+
+/* Render the current time as "YYYY-MM-DDTHH:MM:SSZ", or with milliseconds
+ * if precision is LOG_TIMESTAMP_MILLISECONDS; the date is computed here
+ * (using Howard Hinnant's civil_from_days()), as gmtime_r() is not
+ * async-signal-safe
+ */
+static size_t
+log_signal_stamp_(char *buf, size_t size, int precision)
+{
+	struct timespec ts;
+	long days, secs, era, doe, yoe, doy, mp, year, month, day;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	days = ts.tv_sec / 86400 + 719468;
+	secs = ts.tv_sec % 86400;
+	era = days / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	day = doy - (153 * mp + 2) / 5 + 1;
+	month = (mp < 10 ? mp + 3 : mp - 9);
+	year = yoe + era * 400 + (month <= 2);
+	if(precision == LOG_TIMESTAMP_MILLISECONDS)
+	{
+		return log_signal_snprintf_(buf, size, "%04ld-%02ld-%02ldT%02ld:%02ld:%02ld.%03ldZ",
+			year, month, day, secs / 3600, (secs / 60) % 60, secs % 60, ts.tv_nsec / 1000000);
+	}
+	return log_signal_snprintf_(buf, size, "%04ld-%02ld-%02ldT%02ld:%02ld:%02ldZ",
+		year, month, day, secs / 3600, (secs / 60) % 60, secs % 60);
+}
+
+/* Format a message as vsnprintf() would, but without allocating memory,
+ * taking locks or consulting the locale, so that it may be used in a
+ * signal handler. Only the conversions d, i, u, o, x, X, c, s, p and %
+ * are supported, with flags, field widths, precisions (either of which
+ * may be '*') and the length modifiers hh, h, l, ll, j, z and t.
+ * Floating-point conversions consume their argument but are copied to the
+ * output as they appear in the format, as are any other conversions,
+ * which consume nothing. Returns the length of the result, which is
+ * truncated to fit size bytes including its terminating NUL.
+ */
+static size_t
+log_signal_format_(char *buf, size_t size, const char *fmt, va_list ap)
+{
+	char digits[24], *p, *end;
+	const char *start, *s, *sign, *xdigits;
+	unsigned long long v;
+	long long n;
+	size_t len;
+	int left, zero, plus, space, alt, width, prec, mod, base, lead, pad;
+
+	p = buf;
+	end = buf + size - 1;
+	for(; *fmt; fmt++)
+	{
+		if(*fmt != '%')
+		{
+			log_signal_put_(&p, end, fmt, 1);
+			continue;
+		}
+		start = fmt++;
+		left = zero = plus = space = alt = 0;
+		for(; *fmt == '-' || *fmt == '0' || *fmt == '+' || *fmt == ' ' || *fmt == '#'; fmt++)
+		{
+			left |= (*fmt == '-');
+			zero |= (*fmt == '0');
+			plus |= (*fmt == '+');
+			space |= (*fmt == ' ');
+			alt |= (*fmt == '#');
+		}
+		width = 0;
+		if(*fmt == '*')
+		{
+			width = va_arg(ap, int);
+			if(width < 0)
+			{
+				left = 1;
+				width = -width;
+			}
+			fmt++;
+		}
+		for(; *fmt >= '0' && *fmt <= '9'; fmt++)
+		{
+			width = width * 10 + (*fmt - '0');
+		}
+		prec = -1;
+		if(*fmt == '.')
+		{
+			fmt++;
+			if(*fmt == '*')
+			{
+				prec = va_arg(ap, int);
+				prec = (prec < 0 ? -1 : prec);
+				fmt++;
+			}
+			else
+			{
+				for(prec = 0; *fmt >= '0' && *fmt <= '9'; fmt++)
+				{
+					prec = prec * 10 + (*fmt - '0');
+				}
+			}
+		}
+		/* 'H' stands for hh, and 'q' for ll */
+		mod = 0;
+		if(*fmt == 'h' || *fmt == 'l')
+		{
+			mod = *fmt++;
+			if(*fmt == mod)
+			{
+				mod = (mod == 'h' ? 'H' : 'q');
+				fmt++;
+			}
+		}
+		else if(*fmt == 'j' || *fmt == 'z' || *fmt == 't' || *fmt == 'L')
+		{
+			mod = *fmt++;
+		}
+		sign = "";
+		xdigits = "0123456789abcdef";
+		base = 0;
+		v = 0;
+		s = NULL;
+		len = 0;
+		switch(*fmt)
+		{
+		case 'd':
+		case 'i':
+			switch(mod)
+			{
+			case 'l':
+				n = va_arg(ap, long);
+				break;
+			case 'q':
+				n = va_arg(ap, long long);
+				break;
+			case 'j':
+				n = va_arg(ap, intmax_t);
+				break;
+			case 'z':
+			case 't':
+				n = va_arg(ap, ptrdiff_t);
+				break;
+			case 'h':
+				n = (short) va_arg(ap, int);
+				break;
+			case 'H':
+				n = (signed char) va_arg(ap, int);
+				break;
+			default:
+				n = va_arg(ap, int);
+			}
+			sign = (n < 0 ? "-" : (plus ? "+" : (space ? " " : "")));
+			v = (n < 0 ? -(unsigned long long) n : (unsigned long long) n);
+			base = 10;
+			break;
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			switch(mod)
+			{
+			case 'l':
+				v = va_arg(ap, unsigned long);
+				break;
+			case 'q':
+				v = va_arg(ap, unsigned long long);
+				break;
+			case 'j':
+				v = va_arg(ap, uintmax_t);
+				break;
+			case 'z':
+			case 't':
+				v = va_arg(ap, size_t);
+				break;
+			case 'h':
+				v = (unsigned short) va_arg(ap, unsigned);
+				break;
+			case 'H':
+				v = (unsigned char) va_arg(ap, unsigned);
+				break;
+			default:
+				v = va_arg(ap, unsigned);
+			}
+			base = (*fmt == 'u' ? 10 : (*fmt == 'o' ? 8 : 16));
+			if(*fmt == 'X')
+			{
+				xdigits = "0123456789ABCDEF";
+			}
+			if(alt && v)
+			{
+				sign = (*fmt == 'o' ? "0" : (*fmt == 'X' ? "0X" : (*fmt == 'x' ? "0x" : "")));
+			}
+			break;
+		case 'p':
+			v = (uintptr_t) va_arg(ap, void *);
+			sign = "0x";
+			base = 16;
+			break;
+		case 'c':
+			digits[0] = (char) va_arg(ap, int);
+			s = digits;
+			len = 1;
+			break;
+		case 's':
+			s = va_arg(ap, const char *);
+			if(!s)
+			{
+				s = "(null)";
+			}
+			for(len = 0; s[len] && (prec < 0 || len < (size_t) prec); len++);
+			break;
+		case '%':
+			s = "%";
+			len = 1;
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			if(mod == 'L')
+			{
+				(void) va_arg(ap, long double);
+			}
+			else
+			{
+				(void) va_arg(ap, double);
+			}
+			s = start;
+			len = fmt + 1 - start;
+			width = 0;
+			break;
+		default:
+			s = start;
+			len = fmt - start;
+			width = 0;
+			if(!*fmt)
+			{
+				/* A '%' at the end of the format */
+				fmt--;
+			}
+			else
+			{
+				len++;
+			}
+		}
+		lead = 0;
+		if(base)
+		{
+			/* A precision of zero renders a zero value as nothing */
+			for(len = 0; v || (!len && prec); v /= base)
+			{
+				digits[sizeof(digits) - ++len] = xdigits[v % base];
+			}
+			s = digits + sizeof(digits) - len;
+			if(prec > (int) len)
+			{
+				lead = prec - (int) len;
+			}
+			else if(zero && !left && prec < 0 && width > (int) (strlen(sign) + len))
+			{
+				lead = width - (int) (strlen(sign) + len);
+			}
+		}
+		pad = width - (int) (strlen(sign) + lead + len);
+		if(!left)
+		{
+			log_signal_fill_(&p, end, ' ', pad);
+		}
+		log_signal_put_(&p, end, sign, strlen(sign));
+		log_signal_fill_(&p, end, '0', lead);
+		log_signal_put_(&p, end, s, len);
+		if(left)
+		{
+			log_signal_fill_(&p, end, ' ', pad);
+		}
+	}
+	*p = 0;
+	return p - buf;
+}
+
+static size_t
+log_signal_snprintf_(char *buf, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	size_t len;
+
+	va_start(ap, fmt);
+	len = log_signal_format_(buf, size, fmt, ap);
+	va_end(ap);
+	return len;
+}
+
+/* Append up to len bytes of s to the output of log_signal_format_() */
+static void
+log_signal_put_(char **p, const char *end, const char *s, size_t len)
+{
+	if(len > (size_t) (end - *p))
+	{
+		len = end - *p;
+	}
+	memcpy(*p, s, len);
+	*p += len;
+}
+
+/* Append up to n copies of c to the output of log_signal_format_() */
+static void
+log_signal_fill_(char **p, const char *end, char c, int n)
+{
+	for(; n > 0 && *p < end; n--)
+	{
+		*(*p)++ = c;
+	}
+}
+
+/* In a child process created by fork(), which has none of the parent's
+ * other threads, log synchronously and re-open the log (rendering the
+ * syslog tag and prefixes with the child's process ID) when the first
+ * message is logged; the parent's settings are destroyed then, without
+ * waiting for their flusher thread
+ */
+static void
+log_atfork_child_(void)
+{
+	struct log_limiter *limiter;
+
+	pthread_mutex_init(&log_async_lock, NULL);
+	pthread_mutex_init(&log_async_control, NULL);
+	pthread_cond_init(&log_async_cond, NULL);
+	pthread_cond_init(&log_async_space, NULL);
+	log_async_ring = NULL;
+	log_async_users = 0;
+	log_async_sleeping = 0;
+	log_async_waiters = 0;
+	log_signal_users = 0;
+	log_tid = 0;
+	for(limiter = log_limiters; limiter; limiter = limiter->next)
+	{
+		/* The parent's other threads' suppressed messages are theirs to
+		 * report, and they may have held the lock
+		 */
+		pthread_mutex_init(&(limiter->lock), NULL);
+		if(limiter != log_limiter)
+		{
+			memset(limiter->limits, 0, sizeof(limiter->limits));
+			limiter->active = 0;
+		}
+	}
+	pthread_mutex_init(&log_category_lock, NULL);
+	snapshot_atfork_child(&log_domain);
+	log_forked = 1;
 }
@@ -0,0 +1,127 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright 2014-2016 BBC
+ *
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* logdump: print the messages held in a flight recorder file written by
+ * log.c (see log_set_flight_recorder() and log:flightRecorder), oldest
+ * first
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsupport.h"
+
+static const char *levels[] = {
+	"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+static void
+copy_(const char *data, uint64_t datasize, uint64_t pos, void *dest, size_t len)
+{
+	size_t off, n;
+
+	off = pos & (datasize - 1);
+	n = datasize - off;
+	if(n > len)
+	{
+		n = len;
+	}
+	memcpy(dest, data + off, n);
+	if(n < len)
+	{
+		memcpy((char *) dest + n, data, len - n);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	struct log_recorder_header hdr;
+	struct log_record rec;
+	struct tm tm;
+	time_t t;
+	FILE *f;
+	char *data, *text, stamp[32];
+	uint64_t pos, head, size;
+	size_t len;
+
+	if(argc != 2)
+	{
+		fprintf(stderr, "Usage: %s FILE\n", argv[0]);
+		return 1;
+	}
+	f = fopen(argv[1], "rb");
+	if(!f)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+	if(fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, LOG_RECORDER_MAGIC, sizeof(hdr.magic)) ||
+	   hdr.version != LOG_RECORDER_VERSION || hdr.hdrsize != sizeof(hdr) ||
+	   !hdr.datasize || (hdr.datasize & (hdr.datasize - 1)))
+	{
+		fprintf(stderr, "%s: %s: not a flight recorder file\n", argv[0], argv[1]);
+		return 1;
+	}
+	data = (char *) malloc(hdr.datasize);
+	text = (char *) malloc(hdr.datasize);
+	if(!data || !text)
+	{
+		perror(argv[0]);
+		return 1;
+	}
+	if(fread(data, hdr.datasize, 1, f) != 1)
+	{
+		fprintf(stderr, "%s: %s: file is truncated\n", argv[0], argv[1]);
+		return 1;
+	}
+	fclose(f);
+	size = hdr.datasize;
+	head = hdr.head;
+	/* Records which began before head - size have been overwritten; those
+	 * which were still being written are skipped, and scanning resumes
+	 * at the next complete record
+	 */
+	pos = (head > size ? head - size : 0);
+	while(pos + sizeof(rec) <= head)
+	{
+		copy_(data, size, pos, &rec, sizeof(rec));
+		len = (sizeof(rec) + rec.len + LOG_RECORD_ALIGN - 1) & ~(size_t) (LOG_RECORD_ALIGN - 1);
+		if(rec.magic != LOG_RECORD_MAGIC || rec.pos != pos || rec.len > size / 4 || pos + len > head)
+		{
+			pos += LOG_RECORD_ALIGN;
+			continue;
+		}
+		copy_(data, size, pos + sizeof(rec), text, rec.len);
+		while(rec.len && text[rec.len - 1] == '\n')
+		{
+			rec.len--;
+		}
+		t = (time_t) (rec.time / 1000000000ULL);
+		localtime_r(&t, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		printf("%s.%06u [%d] %s: %.*s\n", stamp, (unsigned) (rec.time % 1000000000ULL / 1000), (int) rec.pid,
+			(rec.level >= 0 && rec.level <= LOG_DEBUG ? levels[rec.level] : "?"), (int) rec.len, text);
+		pos += len;
+	}
+	free(text);
+	free(data);
+	return 0;
+}
@@ -23,14 +23,122 @@
 # include <stdio.h>
 # include <stdlib.h>
 # include <stdarg.h>
+# include <stddef.h>
+# include <stdint.h>
 # include <string.h>
 # include <syslog.h>
 # include <unistd.h>
 # include <pthread.h>
+# include <sched.h>
+# include <time.h>
 # include <ctype.h>
+# include <math.h>
+# include <fnmatch.h>
+# include <limits.h>
+# include <fcntl.h>
+# include <sys/uio.h>
+# include <sys/time.h>
+# include <sys/stat.h>
+# include <sys/mman.h>
+# include <sys/socket.h>
+# include <sys/un.h>
+# include <sys/syscall.h>
 
 # include "iniparser.h"
 
 # include "libsupport.h"
 
+# define SNAPSHOT_LINE_SIZE            64
+
+/* Per-thread reader record within a snapshot domain */
+struct snapshot_reader
+{
+	struct snapshot_reader *next;
+	void *hazard;
+	int depth;
+	int active;
+	char pad[SNAPSHOT_LINE_SIZE - 2 * sizeof(void *) - 2 * sizeof(int)];
+};
+
+/* A snapshot which has been replaced but may still be in use; seq orders
+ * it among those retired from the same domain
+ */
+struct snapshot_retired
+{
+	struct snapshot_retired *next;
+	void *ptr;
+	unsigned long seq;
+};
+
+/* An atomically-published immutable object, with hazard-pointer
+ * reclamation of the objects it replaces; dead holds retired objects which
+ * are no longer pinned, to be destroyed once the lock is released
+ */
+struct snapshot_domain
+{
+	void *current;
+	struct snapshot_reader *readers;
+	struct snapshot_retired *retired;
+	struct snapshot_retired *dead;
+	unsigned long seq;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	void (*destroy)(void *ptr);
+};
+
+/* An interned configuration key, resolved once by config_key(), along
+ * with the slot at which it was last found in the configuration; the slot
+ * is only a hint, and is updated without locking
+ */
+struct config_key_struct
+{
+	struct config_key_struct *next;
+	char *key;
+	int len;
+	unsigned hash;
+	int slot;
+};
+
+/* The layout of a flight recorder file: a header, followed by a circular
+ * buffer of datasize bytes (a power of two) holding records, each aligned
+ * to LOG_RECORD_ALIGN bytes. head is the total number of bytes ever
+ * reserved; a record at absolute position pos is stored at offset
+ * pos % datasize, and is complete once its pos member equals pos.
+ */
+# define LOG_RECORDER_MAGIC            "LSFLTREC"
+# define LOG_RECORDER_VERSION          1
+# define LOG_RECORD_MAGIC              0x52474f4cU
+# define LOG_RECORD_ALIGN              8
+
+struct log_recorder_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t hdrsize;
+	uint64_t datasize;
+	uint64_t head;
+	char pad[SNAPSHOT_LINE_SIZE - 32];
+};
+
+/* A record, followed by len bytes of message text */
+struct log_record
+{
+	uint32_t magic;
+	uint32_t len;
+	uint64_t pos;
+	uint64_t time;
+	int32_t level;
+	int32_t pid;
+};
+
+int snapshot_init(struct snapshot_domain *dom, void (*destroy)(void *ptr));
+void *snapshot_acquire(struct snapshot_domain *dom);
+void snapshot_release(struct snapshot_domain *dom);
+void *snapshot_current(struct snapshot_domain *dom);
+void snapshot_lock(struct snapshot_domain *dom);
+void snapshot_unlock(struct snapshot_domain *dom);
+int snapshot_publish(struct snapshot_domain *dom, void *snap);
+void snapshot_synchronize(struct snapshot_domain *dom);
+void snapshot_atfork_child(struct snapshot_domain *dom);
+
 #endif /*!P_LIBSUPPORT_H_*/
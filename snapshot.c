@@ -0,0 +1,335 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright 2014-2016 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libsupport.h"
+
+/* A snapshot domain holds a pointer to an immutable object which is
+ * replaced, never modified, by writers. Readers pin the current object by
+ * publishing it in a per-thread hazard slot; writers swap in a new object
+ * and only destroy an old one once no reader's hazard slot refers to it.
+ *
+ * The read side touches only the calling thread's own reader record and
+ * the (read-only, once published) current pointer, so concurrent readers
+ * on different cores never write to a shared cache line.
+ */
+
+static struct snapshot_reader *snapshot_reader_(struct snapshot_domain *dom);
+static void snapshot_reader_destroy_(void *ptr);
+static void snapshot_reclaim_(struct snapshot_domain *dom);
+static int snapshot_pending_(struct snapshot_domain *dom, unsigned long seq);
+
+int
+snapshot_init(struct snapshot_domain *dom, void (*destroy)(void *ptr))
+{
+	memset(dom, 0, sizeof(struct snapshot_domain));
+	if(pthread_key_create(&(dom->key), snapshot_reader_destroy_))
+	{
+		return -1;
+	}
+	pthread_mutex_init(&(dom->lock), NULL);
+	dom->destroy = destroy;
+	return 0;
+}
+
+/* Obtain a reference to the current snapshot, which remains valid until
+ * the matching call to snapshot_release(). Calls may be nested within a
+ * single thread, in which case the inner calls return the snapshot pinned
+ * by the outermost one.
+ *
+ * Returns NULL if nothing has been published yet, or (with errno set) if a
+ * reader record could not be allocated; in both cases snapshot_release()
+ * must still be called.
+ */
+void *
+snapshot_acquire(struct snapshot_domain *dom)
+{
+	struct snapshot_reader *rec;
+	void *snap, *check;
+
+	rec = snapshot_reader_(dom);
+	if(!rec)
+	{
+		return NULL;
+	}
+	if(rec->depth++)
+	{
+		return rec->hazard;
+	}
+	snap = __atomic_load_n(&(dom->current), __ATOMIC_ACQUIRE);
+	for(;;)
+	{
+		__atomic_store_n(&(rec->hazard), snap, __ATOMIC_SEQ_CST);
+		/* Re-check that the snapshot wasn't retired before the hazard
+		 * became visible to writers
+		 */
+		check = __atomic_load_n(&(dom->current), __ATOMIC_SEQ_CST);
+		if(check == snap)
+		{
+			return snap;
+		}
+		snap = check;
+	}
+}
+
+void
+snapshot_release(struct snapshot_domain *dom)
+{
+	struct snapshot_reader *rec;
+
+	rec = (struct snapshot_reader *) pthread_getspecific(dom->key);
+	if(!rec || !rec->depth)
+	{
+		return;
+	}
+	if(!--rec->depth)
+	{
+		__atomic_store_n(&(rec->hazard), NULL, __ATOMIC_RELEASE);
+	}
+}
+
+/* Return the current snapshot without pinning it; the result is only
+ * safe to use while the domain lock is held, or in a single-threaded
+ * process.
+ */
+void *
+snapshot_current(struct snapshot_domain *dom)
+{
+	return __atomic_load_n(&(dom->current), __ATOMIC_ACQUIRE);
+}
+
+void
+snapshot_lock(struct snapshot_domain *dom)
+{
+	pthread_mutex_lock(&(dom->lock));
+}
+
+/* Release the domain lock, and then destroy any snapshots found to be no
+ * longer pinned while it was held, so that the destroy callback never
+ * delays other writers
+ */
+void
+snapshot_unlock(struct snapshot_domain *dom)
+{
+	struct snapshot_retired *r, *next;
+
+	r = dom->dead;
+	dom->dead = NULL;
+	pthread_mutex_unlock(&(dom->lock));
+	for(; r; r = next)
+	{
+		next = r->next;
+		if(dom->destroy)
+		{
+			dom->destroy(r->ptr);
+		}
+		free(r);
+	}
+}
+
+/* Replace the current snapshot with a new one; the caller must hold the
+ * domain lock. The previous snapshot is destroyed once no reader has it
+ * pinned, which may be as soon as the lock is released.
+ */
+int
+snapshot_publish(struct snapshot_domain *dom, void *snap)
+{
+	struct snapshot_retired *r;
+	void *old;
+
+	old = __atomic_exchange_n(&(dom->current), snap, __ATOMIC_SEQ_CST);
+	if(old)
+	{
+		r = (struct snapshot_retired *) malloc(sizeof(struct snapshot_retired));
+		if(!r)
+		{
+			/* Leaking the old snapshot is preferable to freeing it from
+			 * under a reader
+			 */
+			return -1;
+		}
+		r->ptr = old;
+		r->seq = ++dom->seq;
+		r->next = dom->retired;
+		dom->retired = r;
+	}
+	snapshot_reclaim_(dom);
+	return 0;
+}
+
+/* Wait until every snapshot retired before the call has been destroyed,
+ * so that no reader is still using any of them; the caller must not hold
+ * the domain lock, which is taken only briefly while checking, nor itself
+ * have a snapshot pinned. Snapshots retired meanwhile by other writers
+ * are not waited for.
+ */
+void
+snapshot_synchronize(struct snapshot_domain *dom)
+{
+	unsigned long seq;
+	int pending;
+
+	pthread_mutex_lock(&(dom->lock));
+	seq = dom->seq;
+	for(;;)
+	{
+		snapshot_reclaim_(dom);
+		pending = snapshot_pending_(dom, seq);
+		snapshot_unlock(dom);
+		if(!pending)
+		{
+			return;
+		}
+		sched_yield();
+		pthread_mutex_lock(&(dom->lock));
+	}
+}
+
+/* Prepare a domain for use in a child process created by fork(), in which
+ * only the calling thread exists: the lock is reinitialised, and the
+ * parent's other threads' reader records, which would otherwise pin their
+ * snapshots forever, are made idle.
+ */
+void
+snapshot_atfork_child(struct snapshot_domain *dom)
+{
+	struct snapshot_reader *rec, *self;
+
+	self = (struct snapshot_reader *) pthread_getspecific(dom->key);
+	for(rec = dom->readers; rec; rec = rec->next)
+	{
+		if(rec != self)
+		{
+			rec->depth = 0;
+			rec->hazard = NULL;
+			rec->active = 0;
+		}
+	}
+	dom->dead = NULL;
+	pthread_mutex_init(&(dom->lock), NULL);
+}
+
+/* Move every retired snapshot which is not pinned by any reader to the
+ * dead list, from which snapshot_unlock() destroys it; the caller must
+ * hold the domain lock.
+ */
+static void
+snapshot_reclaim_(struct snapshot_domain *dom)
+{
+	struct snapshot_retired *r, **prev;
+	struct snapshot_reader *rec;
+
+	prev = &(dom->retired);
+	while((r = *prev))
+	{
+		for(rec = __atomic_load_n(&(dom->readers), __ATOMIC_ACQUIRE); rec; rec = rec->next)
+		{
+			if(__atomic_load_n(&(rec->hazard), __ATOMIC_SEQ_CST) == r->ptr)
+			{
+				break;
+			}
+		}
+		if(rec)
+		{
+			prev = &(r->next);
+			continue;
+		}
+		*prev = r->next;
+		r->next = dom->dead;
+		dom->dead = r;
+	}
+}
+
+/* Return nonzero if any snapshot retired no later than seq is still
+ * pinned, allowing for the sequence wrapping; the caller must hold the
+ * domain lock.
+ */
+static int
+snapshot_pending_(struct snapshot_domain *dom, unsigned long seq)
+{
+	struct snapshot_retired *r;
+
+	for(r = dom->retired; r; r = r->next)
+	{
+		if((long) (r->seq - seq) <= 0)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* Return the calling thread's reader record, claiming an idle one left
+ * behind by an exited thread or allocating a new one if necessary. Records
+ * are never freed, as writers may be scanning them at any time.
+ */
+static struct snapshot_reader *
+snapshot_reader_(struct snapshot_domain *dom)
+{
+	struct snapshot_reader *rec, *head;
+	int idle;
+
+	rec = (struct snapshot_reader *) pthread_getspecific(dom->key);
+	if(rec)
+	{
+		return rec;
+	}
+	for(rec = __atomic_load_n(&(dom->readers), __ATOMIC_ACQUIRE); rec; rec = rec->next)
+	{
+		idle = 0;
+		if(__atomic_compare_exchange_n(&(rec->active), &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+	if(!rec)
+	{
+		/* Align each record to its own cache line so that readers on
+		 * different cores don't false-share
+		 */
+		if(posix_memalign((void **) &rec, SNAPSHOT_LINE_SIZE, sizeof(struct snapshot_reader)))
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+		memset(rec, 0, sizeof(struct snapshot_reader));
+		rec->active = 1;
+		head = __atomic_load_n(&(dom->readers), __ATOMIC_RELAXED);
+		do
+		{
+			rec->next = head;
+		}
+		while(!__atomic_compare_exchange_n(&(dom->readers), &head, rec, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	rec->depth = 0;
+	pthread_setspecific(dom->key, rec);
+	return rec;
+}
+
+static void
+snapshot_reader_destroy_(void *ptr)
+{
+	struct snapshot_reader *rec;
+
+	rec = (struct snapshot_reader *) ptr;
+	rec->depth = 0;
+	__atomic_store_n(&(rec->hazard), NULL, __ATOMIC_RELEASE);
+	__atomic_store_n(&(rec->active), 0, __ATOMIC_RELEASE);
+}
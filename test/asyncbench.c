@@ -0,0 +1,135 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright 2014-2016 BBC
+ *
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* asyncbench: measure the latency of log_printf() when its output is slow
+ * to drain. stderr is replaced by a pipe which a thread reads in small
+ * pieces with a pause after each, and the time taken by each call is
+ * recorded, synchronously and in asynchronous mode with each overflow
+ * policy; the median, 99th percentile and maximum are reported, along
+ * with the number of messages dropped.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libsupport.h"
+
+#define MESSAGES                       100000
+#define DRAIN_CHUNK                    4096
+#define DRAIN_PAUSE                    50
+
+static double latency[MESSAGES];
+static int drain_fd;
+
+static double
+now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_double_(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Read the pipe standing in for stderr slowly, until it is closed */
+static void *
+drain_(void *arg)
+{
+	char buf[DRAIN_CHUNK];
+
+	(void) arg;
+	while(read(drain_fd, buf, sizeof(buf)) > 0)
+	{
+		usleep(DRAIN_PAUSE);
+	}
+	return NULL;
+}
+
+static void
+run_(const char *name, int async, int policy)
+{
+	unsigned long dropped;
+	double start;
+	int c;
+
+	log_set_async(async);
+	log_set_async_policy(policy);
+	dropped = log_dropped();
+	for(c = 0; c < MESSAGES; c++)
+	{
+		start = now_();
+		log_printf(LOG_NOTICE, "message %d of %d from the benchmark, padded to a typical length\n", c, MESSAGES);
+		latency[c] = now_() - start;
+	}
+	log_flush();
+	qsort(latency, MESSAGES, sizeof(double), cmp_double_);
+	printf("%-14s %10.0f ns %10.0f ns %10.0f ns %10lu\n", name,
+		latency[MESSAGES / 2] * 1e9, latency[MESSAGES * 99 / 100] * 1e9,
+		latency[MESSAGES - 1] * 1e9, log_dropped() - dropped);
+}
+
+int
+main(void)
+{
+	pthread_t drainer;
+	int fds[2];
+
+	if(pipe(fds))
+	{
+		perror("asyncbench: pipe");
+		return 1;
+	}
+	drain_fd = fds[0];
+	fflush(stderr);
+	if(dup2(fds[1], STDERR_FILENO) == -1)
+	{
+		perror("asyncbench: dup2");
+		return 1;
+	}
+	close(fds[1]);
+	pthread_create(&drainer, NULL, drain_, NULL);
+	log_set_use_config(0);
+	log_set_syslog(0);
+	log_set_stderr(1);
+	log_set_level(LOG_NOTICE);
+	printf("%-14s %13s %13s %13s %10s\n", "mode", "p50", "p99", "max", "dropped");
+	run_("sync", 0, LOG_ASYNC_DROP_NEWEST);
+	run_("drop-newest", 1, LOG_ASYNC_DROP_NEWEST);
+	run_("drop-oldest", 1, LOG_ASYNC_DROP_OLDEST);
+	run_("block", 1, LOG_ASYNC_BLOCK);
+	log_set_async(0);
+	close(STDERR_FILENO);
+	pthread_join(drainer, NULL);
+	return 0;
+}
@@ -0,0 +1,93 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright 2014-2016 BBC
+ *
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* configptr: check that a pointer returned by config_getptr_unlocked()
+ * remains valid while the configuration is changed, until it is next
+ * loaded
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libsupport.h"
+
+int
+main(void)
+{
+	const char *ptr, *other;
+	char value[32];
+	int c;
+
+	if(config_init(NULL) || config_set_default("test:held", "original"))
+	{
+		fprintf(stderr, "configptr: failed to initialise configuration\n");
+		return 1;
+	}
+	ptr = config_getptr_unlocked("test:held", NULL);
+	if(!ptr || strcmp(ptr, "original"))
+	{
+		fprintf(stderr, "configptr: unexpected initial value\n");
+		return 1;
+	}
+	/* Each config_set() publishes a new snapshot and retires the one
+	 * which ptr points into
+	 */
+	for(c = 0; c < 256; c++)
+	{
+		snprintf(value, sizeof(value), "value-%d", c);
+		if(config_set("test:other", value))
+		{
+			fprintf(stderr, "configptr: config_set() failed\n");
+			return 1;
+		}
+		other = config_getptr_unlocked("test:other", NULL);
+		if(!other || strcmp(other, value))
+		{
+			fprintf(stderr, "configptr: test:other is '%s', expected '%s'\n", other ? other : "(null)", value);
+			return 1;
+		}
+	}
+	if(strcmp(ptr, "original"))
+	{
+		fprintf(stderr, "configptr: held pointer changed across config_set()\n");
+		return 1;
+	}
+	if(config_set("test:held", "replaced"))
+	{
+		fprintf(stderr, "configptr: config_set() failed\n");
+		return 1;
+	}
+	if(strcmp(ptr, "original"))
+	{
+		fprintf(stderr, "configptr: held pointer changed when its key was replaced\n");
+		return 1;
+	}
+	other = config_getptr_unlocked("test:held", NULL);
+	if(!other || strcmp(other, "replaced"))
+	{
+		fprintf(stderr, "configptr: test:held was not replaced\n");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,121 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright 2014-2016 BBC
+ *
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* kvbench: compare the cost of log_kv(), as logfmt and as JSON, with that
+ * of log_printf() given an equivalent hand-written format. Each is timed
+ * writing to stderr (redirected to /dev/null), and again with stderr
+ * filtered out and only a registered sink which discards its messages,
+ * so that the encoding is measured without the write.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libsupport.h"
+
+#define MESSAGES                       1000000
+
+static double
+now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+discard_(int level, const char *msg, void *data)
+{
+	(void) level;
+	(void) msg;
+	(void) data;
+}
+
+/* Return the mean time per message, in nanoseconds */
+static double
+run_(int format)
+{
+	double start;
+	int c;
+
+	start = now_();
+	for(c = 0; c < MESSAGES; c++)
+	{
+		if(format < 0)
+		{
+			log_printf(LOG_INFO, "msg=\"request done\" path=%s status=%d bytes=%lu\n", "/a/b", 200, 1234UL);
+			continue;
+		}
+		log_kv(LOG_INFO, "request done",
+			"path", LOG_KV_STRING, "/a/b",
+			"status", LOG_KV_INT, 200,
+			"bytes", LOG_KV_ULONG, 1234UL,
+			LOG_KV_END);
+	}
+	return (now_() - start) * 1e9 / MESSAGES;
+}
+
+static void
+report_(const char *name)
+{
+	double printf_ns, logfmt_ns, json_ns;
+
+	printf_ns = run_(-1);
+	log_set_kv_format(LOG_KV_LOGFMT);
+	logfmt_ns = run_(LOG_KV_LOGFMT);
+	log_set_kv_format(LOG_KV_JSON);
+	json_ns = run_(LOG_KV_JSON);
+	printf("%-10s %10.0f ns %10.0f ns %10.0f ns\n", name, printf_ns, logfmt_ns, json_ns);
+}
+
+int
+main(void)
+{
+	int fd;
+
+	fd = open("/dev/null", O_WRONLY);
+	if(fd == -1 || dup2(fd, STDERR_FILENO) == -1)
+	{
+		perror("kvbench: /dev/null");
+		return 1;
+	}
+	close(fd);
+	log_set_use_config(0);
+	log_set_syslog(0);
+	log_set_stderr(1);
+	log_set_level(LOG_INFO);
+	printf("%-10s %13s %13s %13s\n", "sink", "log_printf", "logfmt", "json");
+	report_("stderr");
+	/* Without syslog or a file, stderr is used even if disabled, so it
+	 * is filtered out by level instead
+	 */
+	log_set_sink_level(LOG_SINK_STDERR, LOG_EMERG);
+	log_add_sink(LOG_DEBUG, discard_, NULL);
+	report_("discard");
+	return 0;
+}
@@ -0,0 +1,177 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright 2014-2016 BBC
+ *
+ * Copyright 2013 Mo McRoberts.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/* snapshotbench: measure concurrent configuration reads. Each of 1 to
+ * MAXTHREADS threads calls config_get() repeatedly, and the time per read
+ * is compared with the same lookups made on a plain dictionary behind a
+ * single mutex, as config.c did before reads were served from snapshots.
+ * Each case is run with and without a writer calling config_set() on
+ * another key once a millisecond.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libsupport.h"
+#include "dictionary.h"
+
+#define MAXTHREADS                     8
+#define READS                          1000000
+#define NKEYS                          64
+
+static dictionary *locked;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char keys[NKEYS][32];
+static volatile int stop;
+
+static double
+now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+snapshot_reader_(void *arg)
+{
+	char buf[64];
+	int c;
+
+	(void) arg;
+	for(c = 0; c < READS; c++)
+	{
+		config_get(keys[c % NKEYS], NULL, buf, sizeof(buf));
+	}
+	return NULL;
+}
+
+static void *
+locked_reader_(void *arg)
+{
+	char buf[64];
+	const char *value;
+	int c;
+
+	(void) arg;
+	for(c = 0; c < READS; c++)
+	{
+		pthread_mutex_lock(&lock);
+		value = dictionary_get(locked, keys[c % NKEYS], NULL);
+		strncpy(buf, value ? value : "", sizeof(buf) - 1);
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+static void *
+writer_(void *arg)
+{
+	char value[32];
+	int c;
+
+	(void) arg;
+	for(c = 0; !stop; c++)
+	{
+		snprintf(value, sizeof(value), "%d", c);
+		if(arg)
+		{
+			pthread_mutex_lock(&lock);
+			dictionary_set(locked, "bench:written", value);
+			pthread_mutex_unlock(&lock);
+		}
+		else
+		{
+			config_set("bench:written", value);
+		}
+		usleep(1000);
+	}
+	return NULL;
+}
+
+/* Return the mean time per read, in nanoseconds */
+static double
+run_(void *(*reader)(void *), int nthreads, int write)
+{
+	pthread_t threads[MAXTHREADS], writer;
+	double start, elapsed;
+	int c;
+
+	stop = 0;
+	if(write)
+	{
+		pthread_create(&writer, NULL, writer_, reader == locked_reader_ ? (void *) 1 : NULL);
+	}
+	start = now_();
+	for(c = 0; c < nthreads; c++)
+	{
+		pthread_create(&(threads[c]), NULL, reader, NULL);
+	}
+	for(c = 0; c < nthreads; c++)
+	{
+		pthread_join(threads[c], NULL);
+	}
+	elapsed = now_() - start;
+	if(write)
+	{
+		stop = 1;
+		pthread_join(writer, NULL);
+	}
+	/* Threads run in parallel, so this is the cost seen by each */
+	return elapsed * 1e9 / READS;
+}
+
+int
+main(void)
+{
+	char value[32];
+	int c, n;
+
+	if(config_init(NULL))
+	{
+		fprintf(stderr, "snapshotbench: failed to initialise configuration\n");
+		return 1;
+	}
+	locked = dictionary_new(0);
+	for(c = 0; c < NKEYS; c++)
+	{
+		snprintf(keys[c], sizeof(keys[c]), "bench:key%d", c);
+		snprintf(value, sizeof(value), "value %d", c);
+		config_set(keys[c], value);
+		dictionary_set(locked, keys[c], value);
+	}
+	printf("%-8s %14s %14s %14s %14s\n", "threads", "snapshot", "mutex", "snapshot+w", "mutex+w");
+	for(n = 1; n <= MAXTHREADS; n *= 2)
+	{
+		printf("%-8d %11.1f ns %11.1f ns %11.1f ns %11.1f ns\n", n,
+			run_(snapshot_reader_, n, 0), run_(locked_reader_, n, 0),
+			run_(snapshot_reader_, n, 1), run_(locked_reader_, n, 1));
+	}
+	dictionary_del(locked);
+	return 0;
+}